@@ -0,0 +1,30 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+/* bench.h
+ *
+ * Benchmarks include the source files they measure, as testcases do, and
+ * report the mean wall time per operation */
+
+#include <stdio.h>
+#include <time.h>
+
+#define BENCH_START(T) ((T) = _bench_clock_())
+
+#define BENCH_REPORT(T, NAME, N, OPS) \
+	printf("    %-12s n = %-6zu %8.1f ns/op\n", (NAME), (size_t)(N), \
+		(double)(_bench_clock_() - (T)) / (double)(OPS))
+
+static long long
+_bench_clock_(void)
+{
+	/* Monotonic time in nanoseconds */
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+#endif
@@ -0,0 +1,124 @@
+/* For clock_gettime, mkstemp, pwrite */
+#define _POSIX_C_SOURCE 200809L
+
+#include "bench.h"
+
+#include "../src/utils.c"
+#include "../src/buffer.c"
+#include "../src/spill.c"
+
+/* Bytes per buffer, and cost per line added, for buffers of typical chat
+ * lines, versus lines of fixed size slots holding the longest line. Then
+ * the cost of spilling lines from a full buffer, and reading them back */
+
+#define BENCH_BUFFERS 500
+#define BENCH_LINES (1 << 10)
+
+/* A line with its text inline */
+struct buffer_line_slot
+{
+	enum buffer_line_t type;
+	char *from;
+	char text[TEXT_LENGTH_MAX + 1];
+	size_t from_len;
+	size_t text_len;
+	time_t time;
+	unsigned int _rows;
+	unsigned int _w;
+};
+
+static const char *texts[] = {
+	"hi",
+	"anyone around to help with a build failure?",
+	"try running it again with the debug flags set, and paste the output",
+	"https://example.org/paste/8f3a2c",
+	"thanks, that fixed it"
+};
+
+static void
+bench_buffer(size_t n)
+{
+	long long t;
+	size_t i, j, bytes;
+	struct buffer *b;
+
+	if ((b = malloc(BENCH_BUFFERS * sizeof(*b))) == NULL)
+		fatal("malloc");
+
+	for (i = 0; i < BENCH_BUFFERS; i++)
+		b[i] = buffer(BUFFER_CHANNEL, BENCH_LINES);
+
+	BENCH_START(t);
+
+	for (j = 0; j < n; j++) {
+		for (i = 0; i < BENCH_BUFFERS; i++)
+			buffer_newline(&b[i], BUFFER_LINE_CHAT, "nick", texts[(i + j) % 5], 0);
+	}
+
+	BENCH_REPORT(t, "newline", n, n * BENCH_BUFFERS);
+
+	for (i = 0, bytes = 0; i < BENCH_BUFFERS; i++)
+		bytes += sizeof(*b) + b[i].lines_size * sizeof(struct buffer_line) + b[i].text_size;
+
+	printf("    %-12s n = %-6zu %8zu bytes/buffer\n", "arena", n, bytes / BENCH_BUFFERS);
+	printf("    %-12s n = %-6zu %8zu bytes/buffer\n", "slots", n,
+		sizeof(struct buffer) + sizeof(struct buffer_line_slot) * BENCH_LINES);
+
+	for (i = 0; i < BENCH_BUFFERS; i++)
+		buffer_free(&b[i]);
+
+	free(b);
+}
+
+static void
+bench_buffer_spill(size_t n)
+{
+	/* Cost per line added to a full buffer, spilling the line overwritten,
+	 * and per line read back scrolling through the history spilled */
+
+	long long t;
+	size_t i;
+	unsigned int j;
+	struct buffer b = buffer(BUFFER_CHANNEL, BENCH_LINES);
+
+	for (i = 0; i < BENCH_LINES; i++)
+		buffer_newline(&b, BUFFER_LINE_CHAT, "nick", texts[i % 5], 0);
+
+	BENCH_START(t);
+
+	for (i = 0; i < n; i++)
+		buffer_newline(&b, BUFFER_LINE_CHAT, "nick", texts[i % 5], 0);
+
+	BENCH_REPORT(t, "spill", n, n);
+
+	BENCH_START(t);
+
+	for (j = b.tail; j-- != buffer_first(&b);) {
+		if (buffer_line(&b, j)->text_len == 0)
+			fatal("buffer_line");
+	}
+
+	BENCH_REPORT(t, "spill_line", n, n);
+
+	printf("    %-12s n = %-6zu %8zu bytes in memory, %zu on disk\n", "spilled", n,
+		sizeof(b) + b.lines_size * sizeof(struct buffer_line) + b.text_size,
+		(size_t)b.spill->segs.n * SPILL_SEGMENT_SIZE);
+
+	buffer_free(&b);
+}
+
+int
+main(void)
+{
+	bench_buffer(3);
+	bench_buffer(100);
+	bench_buffer(BENCH_LINES);
+	bench_buffer(BENCH_LINES * 4);
+
+	spill_init(getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp");
+
+	bench_buffer_spill(10000);
+	bench_buffer_spill(1000000);
+
+	return EXIT_SUCCESS;
+}
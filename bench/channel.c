@@ -0,0 +1,166 @@
+/* For clock_gettime, mkstemp, pwrite */
+#define _POSIX_C_SOURCE 200809L
+
+#include "bench.h"
+
+#include "../src/utils.c"
+#include "../src/buffer.c"
+#include "../src/spill.c"
+#include "../src/ignore.c"
+#include "../src/log.c"
+#include "../src/state.c"
+
+/* Channel lookup by name, as for every message received, versus scanning
+ * the server's buffers, per lookup. Names are looked up in another case.
+ *
+ * Bytes per idle channel, joined with a line or two written, as for a bot
+ * in many channels */
+
+#define LOOKUP_ROUNDS 100
+
+/* Stand-ins for the config, draw, input and net functions used by state.c */
+struct config config = {
+	.scrollback.lines = {
+		[BUFFER_OTHER]   = SCROLLBACK_SERVER,
+		[BUFFER_CHANNEL] = SCROLLBACK_CHANNEL,
+		[BUFFER_SERVER]  = SCROLLBACK_SERVER,
+		[BUFFER_PRIVATE] = SCROLLBACK_PRIVATE
+	}
+};
+
+void action(int (*f)(char), const char *m, ...) { UNUSED(f); UNUSED(m); }
+void draw_all(void) { }
+void draw_buffer(void) { }
+void draw_nav(void) { }
+void draw_status(void) { }
+void free_input(input *i) { UNUSED(i); }
+server* get_server_head(void) { return NULL; }
+int sendf(char *e, server *s, const char *m, ...) { UNUSED(e); UNUSED(s); UNUSED(m); return 0; }
+void server_disconnect(server *s, int e, int k, char *m) { UNUSED(s); UNUSED(e); UNUSED(k); UNUSED(m); }
+void split_buffer_cols(struct buffer_line *l, unsigned int *h, unsigned int *t, unsigned int c, unsigned int p)
+{
+	UNUSED(l); UNUSED(c); UNUSED(p);
+
+	*h = *t = 0;
+}
+
+static channel*
+channel_scan(char *chan, server *s)
+{
+	/* Linear search of a server's buffers */
+
+	channel *c = s->channel;
+
+	do {
+		if (!casemap_cmp(s->casemap, c->name, chan))
+			return c;
+
+	} while ((c = c->next) != s->channel);
+
+	return NULL;
+}
+
+static void
+bench_channels(size_t n)
+{
+	char name[32], (*names)[32];
+	long long t;
+	size_t i, j;
+	channel **c;
+	server s = {0};
+
+	if ((names = malloc(n * sizeof(*names))) == NULL || (c = malloc(n * sizeof(*c))) == NULL)
+		fatal("malloc");
+
+	s.channel = new_channel("irc.example.net", &s, NULL, BUFFER_SERVER);
+
+	server_set_casemap(&s, casemap_rfc1459);
+
+	for (i = 0; i < n; i++) {
+		snprintf(name, sizeof(name), "#channel[%zu]", i);
+		snprintf(names[i], sizeof(*names), "#CHANNEL{%zu}", i);
+		c[i] = new_channel(name, &s, s.channel, BUFFER_CHANNEL);
+	}
+
+	BENCH_START(t);
+
+	for (j = 0; j < LOOKUP_ROUNDS; j++) {
+		for (i = 0; i < n; i++) {
+			if (channel_get(names[i], &s) != c[i])
+				fatal("channel_get");
+		}
+	}
+
+	BENCH_REPORT(t, "channel_get", n, n * LOOKUP_ROUNDS);
+
+	BENCH_START(t);
+
+	for (j = 0; j < LOOKUP_ROUNDS; j++) {
+		for (i = 0; i < n; i++) {
+			if (channel_scan(names[i], &s) != c[i])
+				fatal("channel_scan");
+		}
+	}
+
+	BENCH_REPORT(t, "scan", n, n * LOOKUP_ROUNDS);
+
+	for (i = 0; i < n; i++)
+		free_channel(c[i]);
+
+	free_channel(s.channel);
+	hmap_free(&s.channels);
+	free(names);
+	free(c);
+}
+
+static void
+bench_channel_bytes(size_t n)
+{
+	char name[32];
+	size_t i, bytes;
+	channel **c;
+	server s = {0};
+
+	if ((c = malloc(n * sizeof(*c))) == NULL)
+		fatal("malloc");
+
+	s.channel = new_channel("irc.example.net", &s, NULL, BUFFER_SERVER);
+
+	server_set_casemap(&s, casemap_rfc1459);
+
+	for (i = 0, bytes = 0; i < n; i++) {
+		snprintf(name, sizeof(name), "#channel%zu", i);
+		c[i] = new_channel(name, &s, s.channel, BUFFER_CHANNEL);
+
+		newlinef(c[i], 0, ">", "tester!~tester@example.net has joined %s", name);
+		newlinef(c[i], 0, "--", "Topic for %s is \"%s\"", name, "Welcome, see the channel rules");
+
+		bytes += sizeof(*c[i]) + strlen(c[i]->name) + 1;
+		bytes += c[i]->buffer.lines_size * sizeof(struct buffer_line) + c[i]->buffer.text_size;
+		bytes += c[i]->input ? sizeof(*c[i]->input) + sizeof(*c[i]->input->line) : 0;
+	}
+
+	printf("    %-12s n = %-6zu %8zu bytes/channel\n", "idle", n, bytes / n);
+
+	for (i = 0; i < n; i++)
+		free_channel(c[i]);
+
+	free_channel(s.channel);
+	hmap_free(&s.channels);
+	free(c);
+}
+
+int
+main(void)
+{
+	size_t n;
+
+	for (n = 1; n <= 1000; n *= 10)
+		bench_channels(n);
+
+	bench_channels(2000);
+
+	bench_channel_bytes(10000);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,130 @@
+/* For clock_gettime */
+#define _POSIX_C_SOURCE 200112L
+
+#include "bench.h"
+
+#include "../src/utils.c"
+#include "../src/ignore.c"
+
+/* Ignore list matching per message received, as the list grows with nick
+ * and host masks, e.g. during a spam wave, versus matching each mask as a
+ * glob in turn. Senders are ignored by nick, by host, or not at all */
+
+#define MATCH_ROUNDS 100
+#define MATCH_SENDERS 64
+#define MATCH_GLOBS 4
+
+static const char *globs[MATCH_GLOBS] = {
+	"*!*@*.spam.example.org",
+	"bot?*!*@*",
+	"*!~spam*@*",
+	"*!*@10.0.?.*"
+};
+
+static int
+ignore_scan(const struct ignore *i, const char *nick, const char *hostinfo)
+{
+	/* Match each mask, unfolded, as a glob */
+
+	char subject[IGNORE_MASK_MAX + 1], mask[IGNORE_MASK_MAX + 1], *p;
+	const char *m;
+	size_t j;
+
+	snprintf(subject, sizeof(subject), "%s!%s", nick, hostinfo);
+
+	for (j = 0; (m = ignore_get(i, j)); j++) {
+
+		for (p = mask; *m; m++)
+			*p++ = i->map[(unsigned char)*m];
+
+		*p = '\0';
+
+		if (ignore_glob(mask, subject, i->map))
+			return 1;
+	}
+
+	return 0;
+}
+
+static void
+bench_ignore(size_t n)
+{
+	char mask[64], (*nicks)[32], (*hosts)[64];
+	long long t;
+	size_t i, j, k, m;
+	struct ignore ign = {0};
+
+	if ((nicks = malloc(MATCH_SENDERS * sizeof(*nicks))) == NULL
+	 || (hosts = malloc(MATCH_SENDERS * sizeof(*hosts))) == NULL)
+		fatal("malloc");
+
+	ignore_set_casemap(&ign, casemap_rfc1459);
+
+	for (i = 0; i < MATCH_GLOBS; i++)
+		ignore_add(&ign, globs[i]);
+
+	for (i = 0; i < n; i++) {
+		snprintf(mask, sizeof(mask), (i % 2) ? "spam[%zu]" : "*!*@%zu.spam.example.net", i);
+		ignore_add(&ign, mask);
+	}
+
+	/* Senders ignored by nick, by host and not ignored, in turn */
+	for (i = 0; i < MATCH_SENDERS; i++) {
+
+		k = (i * 7919) % n;
+
+		switch (i % 3) {
+			case 0:
+				snprintf(nicks[i], sizeof(*nicks), "SPAM{%zu}", k | 1);
+				snprintf(hosts[i], sizeof(*hosts), "~user@host.example.net");
+				break;
+			case 1:
+				snprintf(nicks[i], sizeof(*nicks), "nick%zu", i);
+				snprintf(hosts[i], sizeof(*hosts), "~user@%zu.SPAM.example.net", k & ~(size_t)1);
+				break;
+			default:
+				snprintf(nicks[i], sizeof(*nicks), "nick%zu", i);
+				snprintf(hosts[i], sizeof(*hosts), "~user@host.example.net");
+				break;
+		}
+	}
+
+	BENCH_START(t);
+
+	for (j = 0, m = 0; j < MATCH_ROUNDS; j++) {
+		for (i = 0; i < MATCH_SENDERS; i++)
+			m += ignore_match(&ign, nicks[i], hosts[i]);
+	}
+
+	BENCH_REPORT(t, "ignore_match", n, MATCH_ROUNDS * MATCH_SENDERS);
+
+	if (m != MATCH_ROUNDS * ((MATCH_SENDERS + 1) / 3 + (MATCH_SENDERS + 2) / 3))
+		fatal("ignore_match");
+
+	BENCH_START(t);
+
+	for (j = 0, m = 0; j < MATCH_ROUNDS; j++) {
+		for (i = 0; i < MATCH_SENDERS; i++)
+			m += ignore_scan(&ign, nicks[i], hosts[i]);
+	}
+
+	BENCH_REPORT(t, "scan", n, MATCH_ROUNDS * MATCH_SENDERS);
+
+	if (m != MATCH_ROUNDS * ((MATCH_SENDERS + 1) / 3 + (MATCH_SENDERS + 2) / 3))
+		fatal("ignore_scan");
+
+	ignore_free(&ign);
+	free(nicks);
+	free(hosts);
+}
+
+int
+main(void)
+{
+	size_t n;
+
+	for (n = 10; n <= 10000; n *= 10)
+		bench_ignore(n);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,126 @@
+/* For clock_gettime, localtime_r, mkdtemp */
+#define _POSIX_C_SOURCE 200809L
+
+#include "bench.h"
+
+#include "../src/utils.c"
+#include "../src/log.c"
+
+/* Latency added per line logged at 10k lines per second, the writer
+ * batching and syncing on its own thread, versus writing each line from
+ * the caller. Then throughput, with lines dropped when the queue is full */
+
+#define LOG_RATE 10000
+
+static const char *texts[] = {
+	"hi",
+	"anyone around to help with a build failure?",
+	"try running it again with the debug flags set, and paste the output",
+	"https://example.org/paste/8f3a2c",
+	"thanks, that fixed it"
+};
+
+static void
+bench_log_rate(size_t n, int sync)
+{
+	/* Mean and worst time per line, paced at LOG_RATE lines per second */
+
+	char line[256], path[256];
+	int fd = -1, len;
+	long long t, t0, total = 0, worst = 0;
+	size_t i;
+
+	if (sync) {
+		snprintf(path, sizeof(path), "%s/write.log", logger.dir);
+
+		if ((fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0600)) < 0)
+			fatal("open");
+	}
+
+	t0 = _bench_clock_();
+
+	for (i = 0; i < n; i++) {
+
+		while (_bench_clock_() < t0 + (long long)i * (1000000000LL / LOG_RATE))
+			;
+
+		BENCH_START(t);
+
+		if (sync) {
+			len = snprintf(line, sizeof(line), "00:00:00 nick %s\n", texts[i % 5]);
+
+			if (write(fd, line, len) < 0)
+				fatal("write");
+		} else {
+			log_line("irc.example.net", "#chan", time(NULL), "nick", texts[i % 5], strlen(texts[i % 5]));
+		}
+
+		t = _bench_clock_() - t;
+		total += t;
+
+		if (t > worst)
+			worst = t;
+	}
+
+	printf("    %-12s n = %-6zu %8.1f ns/op %8.1f ns worst\n",
+		sync ? "write" : "log_line", n, (double)total / (double)n, (double)worst);
+
+	if (sync) {
+		close(fd);
+		unlink(path);
+	}
+}
+
+static void
+bench_log_burst(size_t n)
+{
+	/* Time per line logged unpaced, and lines dropped */
+
+	long long t;
+	size_t i, dropped = 0;
+
+	BENCH_START(t);
+
+	for (i = 0; i < n; i++)
+		dropped -= log_line("irc.example.net", "#chan", time(NULL), "nick", texts[i % 5], strlen(texts[i % 5]));
+
+	BENCH_REPORT(t, "burst", n, n);
+
+	printf("    %-12s n = %-6zu %8zu lines\n", "dropped", n, dropped);
+}
+
+int
+main(void)
+{
+	char date[sizeof("YYYY-MM-DD")], dir[256], path[512];
+	const char *tmp = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+	struct tm tm;
+	time_t now;
+
+	snprintf(dir, sizeof(dir), "%s/rirc-log-XXXXXX", tmp);
+
+	if (mkdtemp(dir) == NULL)
+		fatal("mkdtemp");
+
+	log_init(dir, LOG_SYNC_INTERVAL);
+
+	bench_log_rate(LOG_RATE, 0);
+	bench_log_rate(LOG_RATE, 1);
+	bench_log_burst(100000);
+
+	log_free();
+
+	/* Remove the log written */
+	now = time(NULL);
+	localtime_r(&now, &tm);
+	strftime(date, sizeof(date), "%Y-%m-%d", &tm);
+
+	snprintf(path, sizeof(path), "%s/irc.example.net/#chan.%s.log", dir, date);
+	unlink(path);
+
+	snprintf(path, sizeof(path), "%s/irc.example.net", dir);
+	rmdir(path);
+	rmdir(dir);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,83 @@
+/* For clock_gettime */
+#define _POSIX_C_SOURCE 200112L
+
+#include "bench.h"
+
+#include "../src/utils.c"
+
+/* Nicklist construction from a channel's RPL_NAMREPLY, adding nicks one at
+ * a time versus in bulk, per nick. Freeing the nicklists isn't measured */
+
+#define ROUNDS 10
+
+static void
+bench_nicklist(size_t n)
+{
+	char (*nicks)[16], **keys;
+	long long t;
+	size_t i, j, k, len;
+	unsigned long r = 1;
+	avl_node *roots[ROUNDS];
+
+	if ((nicks = malloc(n * sizeof(*nicks))) == NULL || (keys = malloc(n * sizeof(*keys))) == NULL)
+		fatal("malloc");
+
+	/* Nicks of 4 to 12 letters, arriving in no particular order */
+	for (i = 0; i < n; i++) {
+
+		r = r * 1103515245 + 12345;
+		len = 4 + (r >> 16) % 9;
+
+		for (k = 0; k < len; k++) {
+			r = r * 1103515245 + 12345;
+			nicks[i][k] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ_-[]"[(r >> 16) % 56];
+		}
+
+		nicks[i][k] = '\0';
+	}
+
+	BENCH_START(t);
+
+	for (j = 0; j < ROUNDS; j++) {
+
+		roots[j] = NULL;
+
+		for (i = 0; i < n; i++)
+			avl_add(&roots[j], nicks[i], NULL, casemap_rfc1459);
+	}
+
+	BENCH_REPORT(t, "avl_add", n, ROUNDS * n);
+
+	for (j = 0; j < ROUNDS; j++)
+		free_avl(roots[j]);
+
+	BENCH_START(t);
+
+	for (j = 0; j < ROUNDS; j++) {
+
+		roots[j] = NULL;
+
+		for (i = 0; i < n; i++)
+			keys[i] = str_intern(nicks[i]);
+
+		avl_merge(&roots[j], keys, n, casemap_rfc1459);
+	}
+
+	BENCH_REPORT(t, "avl_merge", n, ROUNDS * n);
+
+	for (j = 0; j < ROUNDS; j++)
+		free_avl(roots[j]);
+
+	free(keys);
+	free(nicks);
+}
+
+int
+main(void)
+{
+	bench_nicklist(100);
+	bench_nicklist(1000);
+	bench_nicklist(20000);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,102 @@
+/* For clock_gettime */
+#define _POSIX_C_SOURCE 200112L
+
+#include "bench.h"
+
+#include "../src/utils.c"
+
+/* Message parsing throughput, over a replay of typical server traffic */
+
+#define ROUNDS 200000
+
+static const char *traffic[] = {
+	":nick!user@host.example.net PRIVMSG #channel :hello world, how is everyone doing today?",
+	":nick!user@host.example.net PRIVMSG #channel :\x01""ACTION waves\x01",
+	":other!~ident@2001:db8::1 NOTICE nick :a notice with a few more words in it",
+	":nick!user@host.example.net JOIN #channel",
+	":nick!user@host.example.net JOIN :#channel",
+	":nick!user@host.example.net PART #channel :leaving",
+	":nick!user@host.example.net QUIT :Ping timeout: 240 seconds",
+	":nick!user@host.example.net NICK :nick_",
+	":nick!user@host.example.net MODE #channel +ov nick other",
+	":nick!user@host.example.net KICK #channel other :bye",
+	":irc.example.net 353 nick = #channel :@op +voice user1 user2 user3 user4 user5 user6 user7",
+	":irc.example.net 332 nick #channel :the channel topic",
+	":irc.example.net 333 nick #channel setter 1500000000",
+	":irc.example.net 005 nick CHANTYPES=# PREFIX=(ov)@+ NETWORK=Example CASEMAPPING=rfc1459 :are supported by this server",
+	":irc.example.net 372 nick :- message of the day line",
+	"PING :irc.example.net",
+};
+
+/* Tagged traffic, as sent with server-time, message-tags and batch enabled */
+static const char *traffic_tags[] = {
+	"@time=2017-01-01T00:00:00.000Z;msgid=Jx2hX0TXnNbJdNtlH2mK4A;account=nick :nick!user@host.example.net PRIVMSG #channel :hello world",
+	"@time=2017-01-01T00:00:00.001Z;msgid=7r6dAyRnsSU5QUsCT2eZCg;+draft/reply=Jx2hX0TXnNbJdNtlH2mK4A :other!~ident@2001:db8::1 PRIVMSG #channel :a reply",
+	"@time=2017-01-01T00:00:00.002Z;batch=yXNAbvnRHTRBv;msgid=WxkUlAYxpJnCJGsRFDnBKw :nick!user@host.example.net PRIVMSG #channel :from a batch",
+	"@badge-info=subscriber/12;badges=subscriber/12,premium/1;color=#1E90FF;display-name=Nick;emotes=;flags=;id=b34ccfc7-4977-403a-8a94-33c6bac34fb8;mod=0;room-id=1337;subscriber=1;tmi-sent-ts=1507246572675;turbo=1;user-id=1337;user-type= :nick!nick@nick.tmi.twitch.tv PRIVMSG #channel :vendor tags",
+	"@label=abc123;time=2017-01-01T00:00:00.003Z :irc.example.net 332 nick #channel :the\\ topic",
+	"@time=2017-01-01T00:00:00.004Z;msgid=O2Gb3m7xkR2o;+typing=active :nick!user@host.example.net TAGMSG #channel",
+	"@msgid=esc;+example.com/note=a\\sline\\swith\\:escapes :nick!user@host.example.net NOTICE #channel :escaped values",
+	"@time=2017-01-01T00:00:00.005Z :nick!user@host.example.net JOIN #channel",
+};
+
+int
+main(void)
+{
+	char buf[1024];
+	long long t;
+	size_t i, j, n = sizeof(traffic) / sizeof(*traffic);
+	size_t n_tags = sizeof(traffic_tags) / sizeof(*traffic_tags);
+	unsigned int k;
+	volatile size_t sink = 0;
+	parsed_mesg p;
+
+	BENCH_START(t);
+
+	for (i = 0; i < ROUNDS; i++) {
+		for (j = 0; j < n; j++) {
+
+			strcpy(buf, traffic[j]);
+
+			if (parse(&p, buf) == NULL)
+				fatal("parse");
+
+			/* Read each parameter, as handlers do */
+			for (k = 0; k < p.n_params; k++)
+				sink += p.params[k][0];
+		}
+	}
+
+	BENCH_REPORT(t, "parse", n, ROUNDS * n);
+
+	BENCH_START(t);
+
+	for (i = 0; i < ROUNDS; i++) {
+		for (j = 0; j < n_tags; j++) {
+
+			strcpy(buf, traffic_tags[j]);
+
+			if (parse(&p, buf) == NULL)
+				fatal("parse");
+
+			for (k = 0; k < p.n_params; k++)
+				sink += p.params[k][0];
+
+			/* Read the well-known tags, and unescape one vendor tag */
+			if (p.known[TAG_TIME])
+				sink += tag_value(p.known[TAG_TIME])[0];
+
+			if (p.known[TAG_MSGID])
+				sink += tag_value(p.known[TAG_MSGID])[0];
+
+			if (p.n_tags)
+				sink += tag_value(&p.tags[p.n_tags - 1])[0];
+		}
+	}
+
+	BENCH_REPORT(t, "parse tags", n_tags, ROUNDS * n_tags);
+
+	(void)(sink);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,123 @@
+/* For clock_gettime, getnameinfo, gai_strerror */
+#define _POSIX_C_SOURCE 200112L
+
+#include "bench.h"
+
+#include "../src/utils.c"
+#include "../src/timer.c"
+
+/* Defined by limits.h, and redefined by common.h */
+#undef MAX_INPUT
+
+#include "../src/net.c"
+
+/* Server registry cost per operation, which should stay flat as the number
+ * of configured servers grows */
+
+#define LOOKUP_ROUNDS 100
+
+/* Stand-ins for the state, draw, mesg, ignore and dns functions used by net.c */
+struct config config;
+
+static channel _channel = { .next = &_channel, .prev = &_channel };
+static channel _current_channel;
+static char _query;
+
+/* Servers share a single channel, allocating channel buffers isn't
+ * part of the registry cost */
+channel*
+new_channel(char *name, server *s, channel *chanlist, enum buffer_t type)
+{
+	UNUSED(name);
+	UNUSED(s);
+	UNUSED(chanlist);
+	UNUSED(type);
+
+	return &_channel;
+}
+
+void free_channel(channel *c) { UNUSED(c); }
+void reset_channel(channel *c) { UNUSED(c); }
+void channel_set_current(channel *c) { UNUSED(c); }
+channel* current_channel(void) { return &_current_channel; }
+void auto_nick(char **p, char *n) { UNUSED(p); *n = 0; }
+void newline(channel *c, enum buffer_line_t t, const char *f, const char *m) { UNUSED(c); UNUSED(t); UNUSED(f); UNUSED(m); }
+void newlinef(channel *c, enum buffer_line_t t, const char *f, const char *m, ...) { UNUSED(c); UNUSED(t); UNUSED(f); UNUSED(m); }
+void draw_status(void) { }
+void recv_mesg(char *m, server *s) { UNUSED(m); UNUSED(s); }
+void recv_reset(server *s) { UNUSED(s); }
+void ignore_free(struct ignore *i) { UNUSED(i); }
+
+struct dns_query*
+dns_lookup(const char *host, const char *port, dns_cb cb, void *arg)
+{
+	/* Lookups never complete, servers remain connecting */
+
+	UNUSED(host);
+	UNUSED(port);
+	UNUSED(cb);
+	UNUSED(arg);
+
+	return (struct dns_query *)&_query;
+}
+
+void dns_cancel(struct dns_query *q) { UNUSED(q); }
+
+static void
+bench_servers(size_t n)
+{
+	char (*hosts)[32];
+	long long t;
+	size_t i, j;
+	server **s;
+
+	if ((hosts = malloc(n * sizeof(*hosts))) == NULL || (s = malloc(n * sizeof(*s))) == NULL)
+		fatal("malloc");
+
+	for (i = 0; i < n; i++)
+		snprintf(hosts[i], sizeof(*hosts), "irc%zu.example.net", i);
+
+	BENCH_START(t);
+
+	for (i = 0; i < n; i++)
+		s[i] = server_connect(hosts[i], "6667", NULL, NULL);
+
+	BENCH_REPORT(t, "connect", n, n);
+
+	BENCH_START(t);
+
+	for (j = 0; j < LOOKUP_ROUNDS; j++) {
+		for (i = 0; i < n; i++) {
+			if (server_get(hosts[i], "6667") != s[i])
+				fatal("server_get");
+		}
+	}
+
+	BENCH_REPORT(t, "lookup", n, n * LOOKUP_ROUNDS);
+
+	BENCH_START(t);
+
+	for (i = 0; i < n; i++)
+		server_disconnect(s[i], 0, 1, NULL);
+
+	BENCH_REPORT(t, "disconnect", n, n);
+
+	if (servers.n || connect_queue.head || connect_queue.inflight)
+		fatal("servers remaining");
+
+	free(hosts);
+	free(s);
+}
+
+int
+main(void)
+{
+	size_t n;
+
+	for (n = 1; n <= 1000; n *= 10)
+		bench_servers(n);
+
+	timer_free();
+
+	return EXIT_SUCCESS;
+}
@@ -1,19 +1,33 @@
+#include <stdlib.h>
 #include <string.h>
 
 #include "buffer.h"
+#include "spill.h"
 
 #if (BUFFER_LINES_MAX & (BUFFER_LINES_MAX - 1)) != 0
 	/* Required for proper masking when indexing */
 	#error BUFFER_LINES_MAX must be a power of 2
 #endif
 
-#define MASK(X) ((X) & (BUFFER_LINES_MAX - 1))
+#if (BUFFER_LINES_MIN & (BUFFER_LINES_MIN - 1)) != 0
+	#error BUFFER_LINES_MIN must be a power of 2
+#endif
+
+#define MASK(B, X) ((X) & ((B)->lines_size - 1))
+
+/* Minimum size of a buffer's text arena */
+#define TEXT_ARENA_MIN 256
+
+static char* buffer_text(struct buffer*, const char*, size_t);
 
 static unsigned int buffer_size(struct buffer*);
 static unsigned int buffer_full(struct buffer*);
 
 static struct buffer_line* buffer_push(struct buffer*);
 
+static void buffer_grow(struct buffer*);
+static void buffer_text_pack(struct buffer*, size_t);
+
 static unsigned int
 buffer_size(struct buffer *b)
 {
@@ -23,29 +37,135 @@ buffer_size(struct buffer *b)
 static unsigned int
 buffer_full(struct buffer *b)
 {
-	return buffer_size(b) == BUFFER_LINES_MAX;
+	return buffer_size(b) == b->lines_max;
 }
 
 static struct buffer_line*
 buffer_push(struct buffer *b)
 {
 	/* Return a new buffer_line pushed to a buffer, ensure that:
-	 *  - scrollback stays between [tail, head)
-	 *  - tail increments when the buffer is full */
+	 *  - scrollback stays between [first, head)
+	 *  - tail increments when the buffer is full, spilling the line
+	 *    overwritten to disk when possible
+	 *  - lines allocated grow until the buffer is full */
 
 	if (buffer_line(b, b->scrollback) == buffer_head(b))
 		b->scrollback = b->head;
 
 	if (buffer_full(b)) {
 
-		/* scrollback locked to tail */
-		if (b->scrollback == b->tail)
-			b->scrollback++;
+		unsigned int first = buffer_first(b);
+
+		if (b->spill == NULL)
+			b->spill = spill_new();
+
+		/* On failure, drop the lines spilled and continue in memory */
+		if (b->spill && spill_push(b->spill, b->tail, &b->buffer_lines[MASK(b, b->tail)]) < 0) {
+			spill_free(b->spill);
+			b->spill = NULL;
+		}
 
 		b->tail++;
+
+		/* scrollback locked to the first line, when lines are dropped */
+		if (b->scrollback - first < buffer_first(b) - first)
+			b->scrollback = buffer_first(b);
+
+	} else if (buffer_size(b) >= b->lines_size) {
+		buffer_grow(b);
+	}
+
+	return &b->buffer_lines[MASK(b, b->head++)];
+}
+
+static void
+buffer_grow(struct buffer *b)
+{
+	/* Double the lines allocated to a buffer, moving each line to its
+	 * index masked by the new size */
+
+	struct buffer_line *lines;
+	unsigned int i, size = b->lines_size ? b->lines_size : BUFFER_LINES_MIN;
+
+	if (size > b->lines_max)
+		size = b->lines_max;
+
+	while (size <= buffer_size(b) && size < b->lines_max)
+		size *= 2;
+
+	if ((lines = calloc(size, sizeof(*lines))) == NULL)
+		fatal("calloc");
+
+	for (i = b->tail; i != b->head; i++)
+		lines[i & (size - 1)] = b->buffer_lines[MASK(b, i)];
+
+	free(b->buffer_lines);
+
+	b->buffer_lines = lines;
+	b->lines_size = size;
+}
+
+static char*
+buffer_text(struct buffer *b, const char *text, size_t len)
+{
+	/* Append a line's text to a buffer's arena */
+
+	char *p;
+
+	if (b->text_len + len + 1 > b->text_size)
+		buffer_text_pack(b, len + 1);
+
+	p = b->text + b->text_len;
+
+	memcpy(p, text, len);
+	p[len] = '\0';
+
+	b->text_len += len + 1;
+
+	return p;
+}
+
+static void
+buffer_text_pack(struct buffer *b, size_t len)
+{
+	/* Repack a buffer's arena with the text of the lines remaining, sized
+	 * to half again that and len bytes more, so space of the lines
+	 * overwritten as the tail advances is reclaimed, and repacking is
+	 * amortized over half as many bytes appended as remain */
+
+	char *p, *text;
+	size_t size, used = len;
+	unsigned int i;
+	struct buffer_line *line;
+
+	for (i = b->tail; i != b->head; i++) {
+		if ((line = &b->buffer_lines[MASK(b, i)])->text)
+			used += line->text_len + 1;
 	}
 
-	return &b->buffer_lines[MASK(b->head++)];
+	if ((size = used + used / 2) < TEXT_ARENA_MIN)
+		size = TEXT_ARENA_MIN;
+
+	if ((text = malloc(size)) == NULL)
+		fatal("malloc");
+
+	for (p = text, i = b->tail; i != b->head; i++) {
+
+		if ((line = &b->buffer_lines[MASK(b, i)])->text == NULL)
+			continue;
+
+		memcpy(p, line->text, line->text_len + 1);
+
+		line->text = p;
+
+		p += line->text_len + 1;
+	}
+
+	free(b->text);
+
+	b->text = text;
+	b->text_len = p - text;
+	b->text_size = size;
 }
 
 struct buffer_line*
@@ -53,7 +173,7 @@ buffer_head(struct buffer *b)
 {
 	/* Return the first printable line in a buffer */
 
-	return buffer_size(b) == 0 ? NULL : &b->buffer_lines[MASK(b->head - 1)];
+	return buffer_size(b) == 0 ? NULL : &b->buffer_lines[MASK(b, b->head - 1)];
 }
 
 struct buffer_line*
@@ -61,7 +181,15 @@ buffer_tail(struct buffer *b)
 {
 	/* Return the last printable line in a buffer */
 
-	return buffer_size(b) == 0 ? NULL : &b->buffer_lines[MASK(b->tail)];
+	return buffer_size(b) == 0 ? NULL : &b->buffer_lines[MASK(b, b->tail)];
+}
+
+unsigned int
+buffer_first(struct buffer *b)
+{
+	/* Return the index of the first line in a buffer, including lines spilled */
+
+	return b->spill ? b->tail - b->spill->n : b->tail;
 }
 
 struct buffer_line*
@@ -89,10 +217,18 @@ buffer_line(struct buffer *b, unsigned int i)
 	 *  b    : invalid
 	 *  */
 	if (((b->head > b->tail) && (i < b->tail || i >= b->head)) ||
-	    ((b->tail > b->head) && (i < b->tail && i >= b->head)))
-		fatal("invalid index");
+	    ((b->tail > b->head) && (i < b->tail && i >= b->head))) {
+
+		struct buffer_line *line;
+
+		/* Lines before tail may have been spilled */
+		if ((line = spill_line(b->spill, i)) == NULL)
+			fatal("invalid index");
+
+		return line;
+	}
 
-	return &b->buffer_lines[MASK(i)];
+	return &b->buffer_lines[MASK(b, i)];
 }
 
 unsigned int
@@ -120,8 +256,9 @@ buffer_line_rows(struct buffer_line *line, unsigned int w)
 }
 
 void
-buffer_newline(struct buffer *b, enum buffer_line_t type, const char *from, const char *text)
+buffer_newline(struct buffer *b, enum buffer_line_t type, const char *from, const char *text, time_t t)
 {
+	char from_trunc[FROM_LENGTH_MAX + 1];
 	struct buffer_line *line;
 
 	if (from == NULL)
@@ -134,7 +271,13 @@ buffer_newline(struct buffer *b, enum buffer_line_t type, const char *from, cons
 	       from_len = strlen(from),
 	       text_len = strlen(text);
 
-	line = memset(buffer_push(b), 0, sizeof(*line));
+	line = buffer_push(b);
+
+	/* Release the sender of the line overwritten, if any, its text is
+	 * reclaimed when the arena is next repacked */
+	str_release(line->from);
+
+	line->text = NULL;
 
 	/* Split overlength lines into continuations */
 	if (text_len > TEXT_LENGTH_MAX) {
@@ -143,26 +286,62 @@ buffer_newline(struct buffer *b, enum buffer_line_t type, const char *from, cons
 	}
 
 	/* Silently truncate */
-	if (from_len > FROM_LENGTH_MAX)
+	if (from_len > FROM_LENGTH_MAX) {
 		from_len = FROM_LENGTH_MAX;
+		memcpy(from_trunc, from, from_len);
+		from_trunc[from_len] = '\0';
+		from = from_trunc;
+	}
 
-	memcpy(line->from, from, from_len);
-	memcpy(line->text, text, text_len);
-
-	*(line->from + from_len) = '\0';
-	*(line->text + text_len) = '\0';
+	line->from = str_intern(from);
+	line->text = buffer_text(b, text, text_len);
 
 	line->from_len = from_len;
 	line->text_len = text_len;
 
-	line->time = time(NULL);
+	line->time = t;
 	line->type = type;
 
+	line->_rows = 0;
+	line->_w = 0;
+
 	if (from_len > b->pad)
 		b->pad = from_len;
 
 	if (remainder_len)
-		buffer_newline(b, type, from, text + TEXT_LENGTH_MAX);
+		buffer_newline(b, type, from, text + TEXT_LENGTH_MAX, t);
+}
+
+void
+buffer_free(struct buffer *b)
+{
+	/* Release the senders of a buffer's lines, its lines, text arena and
+	 * any lines spilled */
+
+	for (; b->tail != b->head; b->tail++) {
+		str_release(b->buffer_lines[MASK(b, b->tail)].from);
+		b->buffer_lines[MASK(b, b->tail)].from = NULL;
+		b->buffer_lines[MASK(b, b->tail)].text = NULL;
+	}
+
+	free(b->buffer_lines);
+	free(b->text);
+	spill_free(b->spill);
+
+	b->buffer_lines = NULL;
+	b->spill = NULL;
+	b->lines_size = 0;
+	b->text = NULL;
+	b->text_len = 0;
+	b->text_size = 0;
+}
+
+int
+buffer_lines_valid(unsigned int lines)
+{
+	/* Buffers keep a power of 2 lines in history, for masked indexing */
+
+	return (lines && (lines & (lines - 1)) == 0 && lines <= BUFFER_LINES_MAX);
 }
 
 float
@@ -173,13 +352,16 @@ buffer_scrollback_status(struct buffer *b)
 	if (buffer_line(b, b->scrollback) == buffer_head(b))
 		return 0;
 
-	return (float)(b->head - b->scrollback) / (float)(buffer_size(b));
+	return (float)(b->head - b->scrollback) / (float)(b->head - buffer_first(b));
 }
 
 struct buffer
-buffer(enum buffer_t type)
+buffer(enum buffer_t type, unsigned int lines)
 {
-	/* Initialize a buffer */
+	/* Initialize a buffer, keeping at most lines in history */
+
+	if (!buffer_lines_valid(lines))
+		fatal("invalid buffer size");
 
-	return (struct buffer) { .type = type };
+	return (struct buffer) { .type = type, .lines_max = lines };
 }
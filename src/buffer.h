@@ -8,8 +8,14 @@
 #define TEXT_LENGTH_MAX 510
 #define FROM_LENGTH_MAX 100
 
+/* Most lines a buffer can keep in history, see buffer() */
 #ifndef BUFFER_LINES_MAX
-	#define BUFFER_LINES_MAX (1 << 10)
+	#define BUFFER_LINES_MAX (1 << 20)
+#endif
+
+/* Lines allocated when a buffer is first written, doubled as it fills */
+#ifndef BUFFER_LINES_MIN
+	#define BUFFER_LINES_MIN (1 << 4)
 #endif
 
 enum buffer_line_t
@@ -29,16 +35,18 @@ enum buffer_t
 	BUFFER_T_SIZE
 };
 
+struct spill;
+
 struct buffer_line
 {
-	enum buffer_line_t type;
-	char from[FROM_LENGTH_MAX + 1];
-	char text[TEXT_LENGTH_MAX + 1];
-	size_t from_len;
-	size_t text_len;
+	char *from; /* Interned, see str_intern */
+	char *text; /* In the buffer's text arena */
 	time_t time;
+	enum buffer_line_t type;
 	unsigned int _rows; /* Cached number of rows occupied when wrapping on w columns */
 	unsigned int _w;    /* Cached width for rows */
+	unsigned short from_len;
+	unsigned short text_len;
 };
 
 struct buffer
@@ -46,24 +54,33 @@ struct buffer
 	enum buffer_t type;
 	unsigned int head;
 	unsigned int tail;
-	unsigned int scrollback; /* Index of the current line between [tail, head) for scrollback */
+	unsigned int scrollback; /* Index of the current line between [first, head) for scrollback */
 	size_t pad;              /* Pad 'from' when printing to be at least this wide */
-	struct buffer_line buffer_lines[BUFFER_LINES_MAX];
+	char *text;              /* Arena of line texts, appended in order of lines added */
+	size_t text_len;         /* Arena bytes appended */
+	size_t text_size;        /* Arena bytes allocated */
+	unsigned int lines_max;  /* Lines kept in history, a power of 2 up to BUFFER_LINES_MAX */
+	unsigned int lines_size; /* Lines allocated, a power of 2 up to lines_max */
+	struct buffer_line *buffer_lines;
+	struct spill *spill;     /* Lines before tail, spilled to disk when the buffer is full */
 };
 
 float buffer_scrollback_status(struct buffer*);
 
+int buffer_lines_valid(unsigned int);
 int buffer_page_back(struct buffer*, unsigned int, unsigned int);
 int buffer_page_forw(struct buffer*, unsigned int, unsigned int);
 
+unsigned int buffer_first(struct buffer*);
 unsigned int buffer_line_rows(struct buffer_line*, unsigned int);
 
-struct buffer buffer(enum buffer_t);
+struct buffer buffer(enum buffer_t, unsigned int);
 
 struct buffer_line* buffer_head(struct buffer*);
 struct buffer_line* buffer_tail(struct buffer*);
 struct buffer_line* buffer_line(struct buffer*, unsigned int);
 
-void buffer_newline(struct buffer*, enum buffer_line_t, const char*, const char*);
+void buffer_free(struct buffer*);
+void buffer_newline(struct buffer*, enum buffer_line_t, const char*, const char*, time_t);
 
 #endif
@@ -1,22 +1,42 @@
 #ifndef COMMON_H
 #define COMMON_H
 
+#include <poll.h>
+
 /* FIXME: refactoring */
 #include "buffer.h"
 #include "draw.h"
+#include "ignore.h"
+#include "timer.h"
 #include "utils.h"
 
 #define VERSION "0.1"
 
-#define MAX_SERVERS 32
-
 //FIXME:
 #define SCROLLBACK_INPUT 15
 #define MAX_INPUT 256
 #define NICKSIZE 255
 
 #define BUFFSIZE 512
+
+/* Auto reconnect backoff, doubling from RECONNECT_DELTA to RECONNECT_DELTA_MAX seconds */
 #define RECONNECT_DELTA 15
+#define RECONNECT_DELTA_MAX 600
+
+/* Default lines kept in history per buffer type, powers of 2 */
+#define SCROLLBACK_SERVER  (1 << 10)
+#define SCROLLBACK_CHANNEL (1 << 10)
+#define SCROLLBACK_PRIVATE (1 << 10)
+
+/* Most messages held per open IRCv3 batch, and batches open per server,
+ * beyond which a batch is ended early and its messages handled unbatched.
+ * Netsplits and netjoins hold none, applied to the nicklists as received */
+#define BATCH_LINES_MAX 4096
+#define BATCH_OPEN_MAX 16
+
+/* Default flood control, send FLOOD_BURST lines at once then one line per FLOOD_INTERVAL ms */
+#define FLOOD_BURST 5
+#define FLOOD_INTERVAL 2000
 #define MODE_SIZE (26 * 2) + 1 /* Supports modes [az-AZ] */
 
 /* When tab completing a nick at the beginning of the line, append the following char */
@@ -77,6 +97,15 @@ typedef enum
 	ACTIVITY_T_SIZE
 } activity_t;
 
+/* Outbound message priorities, in order of release */
+enum send_prio
+{
+	SEND_PRIO_HIGH, /* Protocol messages, never held back by flood control */
+	SEND_PRIO_USER, /* User commands and messages */
+	SEND_PRIO_BULK, /* Pastes, channel rejoins, automatic replies */
+	SEND_PRIO_T_SIZE
+};
+
 /* Channel input line */
 typedef struct input_line
 {
@@ -111,31 +140,91 @@ typedef struct channel
 	struct channel *prev;
 	struct avl_node *nicklist;
 	struct server *server;
-	struct input *input;
+	struct input *input; /* Allocated on first keystroke, see read_input */
+	struct {
+		char **nicks;  /* Received by RPL_NAMREPLY, added at RPL_ENDOFNAMES */
+		size_t n;
+		size_t size;
+	} names;
 } channel;
 
+/* Channels a nick is in, indexed per server by casefolded nick */
+struct member
+{
+	char *key;
+	size_t n;
+	size_t size;
+	struct channel **channels;
+};
+
+/* Server features advertised by RPL_ISUPPORT, defaulted until received */
+struct isupport
+{
+	char chanmodes[4][MODE_SIZE]; /* CHANMODES: list, always, set-only and flag modes */
+	char chantypes[MODE_SIZE];    /* CHANTYPES: channel name prefixes */
+	char prefix_chars[MODE_SIZE]; /* PREFIX: nick prefixes, e.g. "@+", ... */
+	char prefix_modes[MODE_SIZE]; /* ... and their corresponding modes, e.g. "ov" */
+	unsigned int maxtargets;      /* MAXTARGETS, 0 if unlimited */
+	unsigned int nicklen;         /* NICKLEN, 0 if unknown */
+};
+
 /* Server */
 typedef struct server
 {
 	char *host;
-	char input[BUFFSIZE];
-	char *iptr;
+	char *key; /* "host:port", indexing the server registry */
 	char nick[NICKSIZE + 1];
 	char *nicks;
 	char *nptr;
 	char *port;
 	char *join;
 	char usermodes[MODE_SIZE];
+	int af_pref; /* Address family of the last successful connection, or 0 */
+	unsigned int flood_burst;    /* Flood control: lines sent at once */
+	unsigned int flood_interval; /* Flood control: ms per line thereafter */
 	int soc;
+	int pfd; /* Index of soc in the main loop's pollfd set, or -1 */
 	int pinging;
-	struct avl_node *ignore;
+	int queued; /* Waiting in the connection queue */
+	size_t registry_i; /* Position in the server registry's list */
+	unsigned int caps;     /* IRCv3 capabilities enabled */
+	unsigned int caps_req; /* IRCv3 capabilities requested, not yet ACKed or NAKed */
+	const unsigned char *casemap; /* CASEMAPPING, folding nicks and channel names */
+	struct isupport isupport;
+	struct ignore ignore;
+	struct hmap channels;  /* Buffers by name, folded by the server's case mapping */
+	struct hmap members;   /* Nicks to the channels they're in, see struct member */
+	struct batch *batches; /* Open IRCv3 batches, holding their messages until ended */
 	struct channel *channel;
 	struct server *next;
 	struct server *prev;
+	struct server *queue_next;
+	struct server *queue_prev;
+	struct {
+		char *buf;                /* Allocated on first connect */
+		int discard;              /* Discarding the remainder of an overlong message */
+		size_t len;               /* Bytes received, not yet handled */
+	} recv;
+	struct {
+		long refill;              /* Time of the last token refill, in ms */
+		long tokens;              /* Flood control tokens, in ms of sending time */
+		size_t backlog;           /* Lines left queued by the last flush */
+		size_t bytes;
+		size_t lines;
+		size_t offset;            /* Bytes of the first line already sent */
+		struct sendq_line *head;  /* Lines released for sending */
+		struct sendq_line *tail;
+		struct {
+			struct sendq_line *head;
+			struct sendq_line *tail;
+		} prio[SEND_PRIO_T_SIZE]; /* Lines held back by flood control */
+	} sendq;
+	struct timer latency_timer;
+	struct timer reconnect_timer;
+	struct timer sendq_timer;     /* Flood control allows releasing lines */
+	long latency_time;            /* Time of the last message received, in ms */
 	time_t latency_delta;
-	time_t latency_time;
-	time_t reconnect_delta;
-	time_t reconnect_time;
+	time_t reconnect_delta;       /* Auto reconnect backoff, 0 if not auto reconnecting */
 	void *connecting;
 } server;
 
@@ -143,29 +232,44 @@ typedef struct server
 extern struct config
 {
 	int join_part_quit_threshold;
+	unsigned int flood_burst;
+	unsigned int flood_interval;
 	char *username;
 	char *realname;
 	char *default_nick;
+	struct {
+		unsigned int lines[BUFFER_T_SIZE]; /* Per buffer type */
+		struct scrollback_chan {
+			char *name;
+			unsigned int lines;
+		} *chans;                          /* Per channel, overriding the buffer type */
+		size_t n;
+		size_t size;
+	} scrollback;
 } config;
 
 /* net.c */
 int sendf(char*, server*, const char*, ...);
+int sendf_prio(char*, server*, enum send_prio, const char*, ...);
 server* get_server_head(void);
-void check_servers(void);
-void server_connect(char*, char*, char*, char*);
+size_t server_pollfds(struct pollfd*, size_t);
+void check_servers(struct pollfd*, size_t);
+void flush_servers(void);
+server* server_connect(char*, char*, char*, char*);
 void server_disconnect(server*, int, int, char*);
 
 /* input.c */
 input* new_input(void);
 void action(int(*)(char), const char*, ...);
 void free_input(input*);
-void poll_input(void);
+void read_input(void);
 extern char *action_message;
 
 /* mesg.c */
 void init_mesg(void);
 void free_mesg(void);
-void recv_mesg(char*, int, server*);
+void recv_mesg(char*, server*);
+void recv_reset(server*);
 void send_mesg(char*, channel*);
 void send_paste(char*);
 extern avl_node* commands;
@@ -0,0 +1,399 @@
+/* dns.c
+ *
+ * Asynchronous host resolution
+ *
+ * getaddrinfo blocks, so lookups are queued to a pool of worker threads,
+ * started on demand up to DNS_WORKERS. Finished lookups are queued back to
+ * the main thread, which is woken by a byte written to a pipe.
+ *
+ * Successful results are cached per host:port for DNS_CACHE_TTL seconds,
+ * so reconnecting to a server doesn't wait on the resolver
+ * */
+
+/* For addrinfo, getaddrinfo */
+#define _POSIX_C_SOURCE 200112L
+
+#include <fcntl.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dns.h"
+#include "utils.h"
+
+enum dns_query_t
+{
+	DNS_QUERY_PENDING, /* Queued for a worker */
+	DNS_QUERY_ACTIVE,  /* Being resolved by a worker */
+	DNS_QUERY_DONE     /* Queued for dns_dispatch */
+};
+
+struct dns_query
+{
+	char *host;
+	char *port;
+	dns_cb cb;
+	void *arg;
+	int canceled;
+	enum dns_query_t state;
+	struct dns_result result;
+	struct dns_query *next;
+};
+
+struct dns_cache
+{
+	char *host;
+	char *port;
+	time_t expire;
+	struct dns_result result;
+	struct dns_cache *next;
+};
+
+static int dns_resolve(const char*, const char*, struct dns_result*);
+
+static struct dns_cache* dns_cache_get(const char*, const char*);
+static void dns_cache_put(const char*, const char*, const struct dns_result*);
+
+static void dns_lock(void);
+static void dns_unlock(void);
+static void dns_query_free(struct dns_query*);
+static void* dns_worker(void*);
+
+/* Resolver called by the workers, replaced by a stand-in in testcases */
+static int (*dns_resolve_fn)(const char*, const char*, struct dns_result*) = dns_resolve;
+
+static struct
+{
+	int pipe[2];
+	unsigned int idle;
+	unsigned int workers;
+	pthread_cond_t cond;
+	pthread_mutex_t mutex;
+	struct dns_cache *cache;
+	struct dns_query *done;
+	struct dns_query *pending_head;
+	struct dns_query *pending_tail;
+} dns = {
+	.pipe  = {-1, -1},
+	.cond  = PTHREAD_COND_INITIALIZER,
+	.mutex = PTHREAD_MUTEX_INITIALIZER
+};
+
+void
+dns_init(void)
+{
+	if (pipe(dns.pipe) < 0)
+		fatal("pipe");
+
+	if (fcntl(dns.pipe[0], F_SETFL, O_NONBLOCK) < 0 || fcntl(dns.pipe[1], F_SETFL, O_NONBLOCK) < 0)
+		fatal("fcntl");
+}
+
+void
+dns_free(void)
+{
+	/* Free the cache. Workers may still be blocked resolving, their
+	 * queries are left to be reclaimed at exit */
+
+	struct dns_cache *c;
+
+	while ((c = dns.cache)) {
+		dns.cache = c->next;
+		free(c->host);
+		free(c->port);
+		free(c->result.addrs);
+		free(c);
+	}
+}
+
+int
+dns_fd(void)
+{
+	/* Readable when lookups are ready for dns_dispatch */
+
+	return dns.pipe[0];
+}
+
+struct dns_query*
+dns_lookup(const char *host, const char *port, dns_cb cb, void *arg)
+{
+	/* Resolve host:port and call cb with the result.
+	 *
+	 * If the result is cached cb is called immediately and NULL is returned,
+	 * otherwise the query returned is pending until completed by dns_dispatch
+	 * or canceled by dns_cancel */
+
+	pthread_t tid;
+	struct dns_cache *c;
+	struct dns_query *q;
+
+	if ((c = dns_cache_get(host, port))) {
+		cb(arg, &c->result);
+		return NULL;
+	}
+
+	if ((q = calloc(1, sizeof(*q))) == NULL)
+		fatal("calloc");
+
+	q->host = strdup(host);
+	q->port = strdup(port);
+	q->cb = cb;
+	q->arg = arg;
+	q->state = DNS_QUERY_PENDING;
+
+	dns_lock();
+
+	if (dns.pending_tail)
+		dns.pending_tail->next = q;
+	else
+		dns.pending_head = q;
+
+	dns.pending_tail = q;
+
+	/* Start a worker if none are idle, otherwise wake one */
+	if (dns.idle == 0 && dns.workers < DNS_WORKERS) {
+
+		if ((errno = pthread_create(&tid, NULL, dns_worker, NULL)))
+			fatal("pthread_create");
+
+		if ((errno = pthread_detach(tid)))
+			fatal("pthread_detach");
+
+		dns.workers++;
+	} else {
+		pthread_cond_signal(&dns.cond);
+	}
+
+	dns_unlock();
+
+	return q;
+}
+
+void
+dns_cancel(struct dns_query *q)
+{
+	/* Cancel a pending lookup, its callback won't be called */
+
+	struct dns_query *prev = NULL, *tmp;
+
+	dns_lock();
+
+	/* Not yet picked up by a worker, unlink and free it */
+	if (q->state == DNS_QUERY_PENDING) {
+
+		for (tmp = dns.pending_head; tmp != q; tmp = tmp->next)
+			prev = tmp;
+
+		if (prev)
+			prev->next = q->next;
+		else
+			dns.pending_head = q->next;
+
+		if (dns.pending_tail == q)
+			dns.pending_tail = prev;
+
+		dns_unlock();
+		dns_query_free(q);
+		return;
+	}
+
+	/* Otherwise it's freed by dns_dispatch once the worker is done */
+	q->canceled = 1;
+
+	dns_unlock();
+}
+
+void
+dns_dispatch(void)
+{
+	/* Complete all finished lookups, caching successful results */
+
+	char drain[64];
+	struct dns_query *q, *done;
+
+	while (read(dns.pipe[0], drain, sizeof(drain)) > 0)
+		;
+
+	dns_lock();
+	done = dns.done;
+	dns.done = NULL;
+	dns_unlock();
+
+	while ((q = done)) {
+
+		done = q->next;
+
+		if (q->result.error == 0)
+			dns_cache_put(q->host, q->port, &q->result);
+
+		if (!q->canceled)
+			q->cb(q->arg, &q->result);
+
+		dns_query_free(q);
+	}
+}
+
+static void*
+dns_worker(void *arg)
+{
+	/* Resolve pending queries until the program exits */
+
+	ssize_t ret;
+	struct dns_query *q;
+
+	(void)(arg);
+
+	dns_lock();
+
+	for (;;) {
+
+		while ((q = dns.pending_head) == NULL) {
+			dns.idle++;
+			pthread_cond_wait(&dns.cond, &dns.mutex);
+			dns.idle--;
+		}
+
+		if ((dns.pending_head = q->next) == NULL)
+			dns.pending_tail = NULL;
+
+		q->state = DNS_QUERY_ACTIVE;
+
+		dns_unlock();
+
+		q->result.error = dns_resolve_fn(q->host, q->port, &q->result);
+
+		dns_lock();
+
+		q->state = DNS_QUERY_DONE;
+		q->next = dns.done;
+		dns.done = q;
+
+		/* Wake the main thread, a full pipe means it's already pending */
+		ret = write(dns.pipe[1], "", 1);
+
+		(void)(ret);
+	}
+
+	return NULL;
+}
+
+static int
+dns_resolve(const char *host, const char *port, struct dns_result *r)
+{
+	/* Resolve host:port, returning a getaddrinfo error code on failure */
+
+	int ret;
+	size_t i;
+	struct addrinfo hints, *p, *servinfo;
+
+	memset(&hints, 0, sizeof(hints));
+
+	/* IPv4 and/or IPv6 */
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_flags = AI_PASSIVE;
+	hints.ai_socktype = SOCK_STREAM;
+
+	if ((ret = getaddrinfo(host, port, &hints, &servinfo)))
+		return ret;
+
+	for (r->count = 0, p = servinfo; p != NULL; p = p->ai_next)
+		r->count++;
+
+	if ((r->addrs = calloc(r->count, sizeof(*r->addrs))) == NULL)
+		fatal("calloc");
+
+	for (i = 0, p = servinfo; p != NULL; p = p->ai_next, i++) {
+		r->addrs[i].family = p->ai_family;
+		r->addrs[i].socktype = p->ai_socktype;
+		r->addrs[i].protocol = p->ai_protocol;
+		r->addrs[i].addrlen = p->ai_addrlen;
+		memcpy(&r->addrs[i].addr, p->ai_addr, p->ai_addrlen);
+	}
+
+	freeaddrinfo(servinfo);
+
+	return 0;
+}
+
+static struct dns_cache*
+dns_cache_get(const char *host, const char *port)
+{
+	/* Return the unexpired cache entry for host:port, if any */
+
+	struct dns_cache *c, **cc;
+
+	for (cc = &dns.cache; (c = *cc) != NULL; cc = &c->next) {
+
+		if (strcmp(c->host, host) || strcmp(c->port, port))
+			continue;
+
+		if (c->expire > time(NULL))
+			return c;
+
+		/* Expired */
+		*cc = c->next;
+		free(c->host);
+		free(c->port);
+		free(c->result.addrs);
+		free(c);
+		break;
+	}
+
+	return NULL;
+}
+
+static void
+dns_cache_put(const char *host, const char *port, const struct dns_result *r)
+{
+	/* Cache a copy of a successful result for host:port */
+
+	struct dns_cache *c;
+
+	if ((c = dns_cache_get(host, port)) == NULL) {
+
+		if ((c = calloc(1, sizeof(*c))) == NULL)
+			fatal("calloc");
+
+		c->host = strdup(host);
+		c->port = strdup(port);
+		c->next = dns.cache;
+		dns.cache = c;
+	} else {
+		free(c->result.addrs);
+	}
+
+	if ((c->result.addrs = malloc(r->count * sizeof(*r->addrs))) == NULL)
+		fatal("malloc");
+
+	memcpy(c->result.addrs, r->addrs, r->count * sizeof(*r->addrs));
+
+	c->result.count = r->count;
+	c->result.error = 0;
+	c->expire = time(NULL) + DNS_CACHE_TTL;
+}
+
+static void
+dns_query_free(struct dns_query *q)
+{
+	free(q->host);
+	free(q->port);
+	free(q->result.addrs);
+	free(q);
+}
+
+static void
+dns_lock(void)
+{
+	if ((errno = pthread_mutex_lock(&dns.mutex)))
+		fatal("pthread_mutex_lock");
+}
+
+static void
+dns_unlock(void)
+{
+	if ((errno = pthread_mutex_unlock(&dns.mutex)))
+		fatal("pthread_mutex_unlock");
+}
@@ -0,0 +1,50 @@
+#ifndef DNS_H
+#define DNS_H
+
+/* dns.h
+ *
+ * Asynchronous host resolution with a cache of results per host:port
+ *
+ * Lookups are resolved by a small pool of worker threads and completed on
+ * the main thread by dns_dispatch, once dns_fd is readable */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+/* Number of seconds a successfully resolved host:port is cached */
+#define DNS_CACHE_TTL 300
+
+/* Maximum number of concurrent lookups */
+#define DNS_WORKERS 4
+
+struct dns_addr
+{
+	int family;
+	int socktype;
+	int protocol;
+	socklen_t addrlen;
+	struct sockaddr_storage addr;
+};
+
+struct dns_result
+{
+	int error;              /* getaddrinfo error code, 0 on success */
+	size_t count;
+	struct dns_addr *addrs;
+};
+
+/* Lookup completion callback, the result is only valid for the duration of the call */
+typedef void (*dns_cb)(void*, const struct dns_result*);
+
+struct dns_query;
+
+int dns_fd(void);
+
+struct dns_query* dns_lookup(const char*, const char*, dns_cb, void*);
+
+void dns_cancel(struct dns_query*);
+void dns_dispatch(void);
+void dns_free(void);
+void dns_init(void);
+
+#endif
@@ -309,9 +309,10 @@ _draw_buffer(struct buffer *b, struct coords coords)
 	if (line == NULL)
 		return;
 
-	struct buffer_line *tail = buffer_tail(b);
 	struct buffer_line *head = buffer_head(b);
 
+	unsigned int first = buffer_first(b);
+
 	/* Find top line */
 	for (;;) {
 
@@ -319,7 +320,7 @@ _draw_buffer(struct buffer *b, struct coords coords)
 
 		row_count += buffer_line_rows(line, text_w);
 
-		if (line == tail)
+		if (buffer_i == first)
 			break;
 
 		if (row_count >= row_total)
@@ -518,6 +519,14 @@ _draw_input(channel *c)
 
 	input *in = c->input;
 
+	/* Input is allocated on the first keystroke in a channel */
+	if (in == NULL) {
+		printf(CLEAR_RIGHT);
+		printf(MOVE(%d, %d), rows, 6);
+		printf(CURSOR_SAVE);
+		return;
+	}
+
 	/* Reframe the input bar window */
 	if (in->head > (in->window + cols - 6))
 		in->window += winsz;
@@ -548,10 +557,10 @@ static void
 _draw_status(channel *c)
 {
 	/* server / private chat:
-	 * |-[usermodes]-(latency)---...|
+	 * |-[usermodes]-(latency)-(reconnect)-(sendq)---...|
 	 *
 	 * channel:
-	 * |-[usermodes]-[chancount chantype chanmodes]/[priv]-(latency)---...|
+	 * |-[usermodes]-[chancount chantype chanmodes]/[priv]-(latency)-(reconnect)-(sendq)---...|
 	 * */
 
 	float sb;
@@ -633,6 +642,27 @@ _draw_status(channel *c)
 			goto print_status;
 	}
 
+	/* -(reconnect in seconds), or -(queued) waiting on other connections */
+	if (c->server && timer_pending(&c->server->reconnect_timer)) {
+		ret = snprintf(status_buff + col, cols - col + 1,
+				HORIZONTAL_SEPARATOR "(reconnect in %lds)",
+				(c->server->reconnect_timer.expire - timer_now() + 999) / 1000);
+		if (ret < 0 || (col += ret) >= cols)
+			goto print_status;
+	} else if (c->server && c->server->queued) {
+		ret = snprintf(status_buff + col, cols - col + 1, "%s", HORIZONTAL_SEPARATOR "(queued)");
+		if (ret < 0 || (col += ret) >= cols)
+			goto print_status;
+	}
+
+	/* -(sendq lines), lines waiting on a full socket */
+	if (c->server && c->server->sendq.backlog) {
+		ret = snprintf(status_buff + col, cols - col + 1,
+				HORIZONTAL_SEPARATOR "(sendq %zu)", c->server->sendq.backlog);
+		if (ret < 0 || (col += ret) >= cols)
+			goto print_status;
+	}
+
 	/* -(scrollback%) */
 	if ((sb = buffer_scrollback_status(&c->buffer))) {
 		ret = snprintf(status_buff + col, cols - col + 1,
@@ -0,0 +1,343 @@
+/* ignore.c
+ *
+ * Ignore lists, see ignore.h
+ *
+ * Masks are normalized to nick!user@host when added, so that "nick",
+ * "nick!*" and "nick!*@*" are the same mask. Masks are compared by the
+ * case mapping of the server, and recompiled when it changes
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ignore.h"
+
+static int ignore_glob(const char*, const char*, const unsigned char*);
+static int ignore_norm(char*, const char*);
+static void ignore_compile(struct ignore*, struct ignore_mask*);
+static void ignore_index(struct ignore*, struct ignore_mask*);
+static void ignore_mask_free(struct ignore_mask*);
+static void ignore_push(size_t*, size_t*, struct ignore_mask***, struct ignore_mask*);
+static void ignore_remove(size_t*, struct ignore_mask**, struct ignore_mask*);
+
+#define IGNORE_WILD(C) ((C) == '*' || (C) == '?')
+
+int
+ignore_add(struct ignore *i, const char *mask)
+{
+	/* Add a mask to an ignore list, returning 0 if already present,
+	 * or -1 if invalid */
+
+	char norm[IGNORE_MASK_MAX + 1];
+	struct ignore_mask *m;
+
+	if (!ignore_norm(norm, mask))
+		return -1;
+
+	if (hmap_get(&i->masks, norm))
+		return 0;
+
+	if ((m = calloc(1, sizeof(*m))) == NULL)
+		fatal("calloc");
+
+	m->mask = str_intern(norm);
+
+	ignore_compile(i, m);
+	ignore_index(i, m);
+
+	ignore_push(&i->list.n, &i->list.size, &i->list.masks, m);
+
+	return 1;
+}
+
+int
+ignore_del(struct ignore *i, const char *mask)
+{
+	/* Remove a mask from an ignore list, returning 0 if not present */
+
+	char norm[IGNORE_MASK_MAX + 1];
+	struct ignore_mask *m;
+
+	if (!ignore_norm(norm, mask) || (m = hmap_del(&i->masks, norm)) == NULL)
+		return 0;
+
+	if (m->type == IGNORE_MASK_NICK)
+		hmap_del(&i->nicks, m->key);
+
+	if (m->type == IGNORE_MASK_HOST)
+		hmap_del(&i->hosts, m->key);
+
+	if (m->type == IGNORE_MASK_GLOB)
+		ignore_remove(&i->globs.n, i->globs.masks, m);
+
+	ignore_remove(&i->list.n, i->list.masks, m);
+	ignore_mask_free(m);
+
+	return 1;
+}
+
+const char*
+ignore_get(const struct ignore *i, size_t n)
+{
+	/* Return the nth mask added to an ignore list, or NULL */
+
+	return (n < i->list.n) ? i->list.masks[n]->mask : NULL;
+}
+
+int
+ignore_match(const struct ignore *i, const char *nick, const char *hostinfo)
+{
+	/* Return 1 if a message's prefix, nick and [user]@host, if any, is
+	 * matched by an ignore list */
+
+	char subject[IGNORE_MASK_MAX + 1];
+	const char *host = NULL;
+	size_t j, len;
+	struct ignore_mask *m;
+
+	if (nick == NULL || i->list.n == 0)
+		return 0;
+
+	if (hostinfo)
+		host = (host = strrchr(hostinfo, '@')) ? host + 1 : hostinfo;
+
+	if (i->nicks.n && hmap_get(&i->nicks, nick))
+		return 1;
+
+	if (i->hosts.n && host && hmap_get(&i->hosts, host))
+		return 1;
+
+	if (i->globs.n == 0)
+		return 0;
+
+	/* nick!user@host, with the user or host empty if not sent */
+	snprintf(subject, sizeof(subject), "%s!%s%s",
+		nick,
+		(hostinfo && host == hostinfo) ? "@" : "",
+		(hostinfo ? hostinfo : "@"));
+
+	len = strlen(subject);
+
+	for (j = 0; j < i->globs.n; j++) {
+
+		m = i->globs.masks[j];
+
+		/* Literal suffix mismatched */
+		if (m->suffix > len)
+			continue;
+
+		if (ignore_glob(m->key + strlen(m->key) - m->suffix, subject + len - m->suffix, i->map)
+		 && ignore_glob(m->key, subject, i->map))
+			return 1;
+	}
+
+	return 0;
+}
+
+void
+ignore_free(struct ignore *i)
+{
+	while (i->list.n)
+		ignore_mask_free(i->list.masks[--i->list.n]);
+
+	free(i->globs.masks);
+	free(i->list.masks);
+
+	hmap_free(&i->hosts);
+	hmap_free(&i->masks);
+	hmap_free(&i->nicks);
+
+	i->globs.masks = NULL;
+	i->globs.n = i->globs.size = 0;
+	i->list.masks = NULL;
+	i->list.size = 0;
+}
+
+void
+ignore_set_casemap(struct ignore *i, const unsigned char *map)
+{
+	/* Compare an ignore list's masks by another case mapping, recompiling
+	 * them. Masks made equal by the mapping are merged */
+
+	size_t j, n = i->list.n;
+	struct ignore_mask *m;
+
+	hmap_free(&i->hosts);
+	hmap_free(&i->masks);
+	hmap_free(&i->nicks);
+
+	i->map = map;
+	i->hosts.map = map;
+	i->masks.map = map;
+	i->nicks.map = map;
+
+	i->globs.n = 0;
+	i->list.n = 0;
+
+	for (j = 0; j < n; j++) {
+
+		m = i->list.masks[j];
+
+		if (hmap_get(&i->masks, m->mask)) {
+			ignore_mask_free(m);
+			continue;
+		}
+
+		free(m->key);
+
+		ignore_compile(i, m);
+		ignore_index(i, m);
+
+		i->list.masks[i->list.n++] = m;
+	}
+}
+
+static int
+ignore_norm(char *norm, const char *mask)
+{
+	/* Normalize a mask to nick!user@host, any part not given matching all.
+	 * A lone word is a nick, or a host if dotted, since nicks can't be.
+	 * Returns 0 if the mask is empty or too long */
+
+	int ret;
+	const char *bang = strchr(mask, '!'), *at = strchr(mask, '@');
+
+	if (*mask == '\0' || strchr(mask, ' '))
+		return 0;
+
+	if (bang && at && at < bang)
+		return 0;
+
+	if (bang && at)
+		ret = snprintf(norm, IGNORE_MASK_MAX + 1, "%s", mask);
+	else if (bang)
+		ret = snprintf(norm, IGNORE_MASK_MAX + 1, "%s@*", mask);
+	else if (at)
+		ret = snprintf(norm, IGNORE_MASK_MAX + 1, "*!%s%s", (at == mask) ? "*" : "", mask);
+	else if (strchr(mask, '.'))
+		ret = snprintf(norm, IGNORE_MASK_MAX + 1, "*!*@%s", mask);
+	else
+		ret = snprintf(norm, IGNORE_MASK_MAX + 1, "%s!*@*", mask);
+
+	return (ret > 0 && ret <= IGNORE_MASK_MAX);
+}
+
+static void
+ignore_compile(struct ignore *i, struct ignore_mask *m)
+{
+	/* Classify a normalized mask, and set its key */
+
+	char *p;
+	const char *bang = strchr(m->mask, '!'), *at = strchr(bang, '@');
+	size_t nick_len = bang - m->mask;
+
+	if (!strcmp(bang, "!*@*") && strcspn(m->mask, "*?") >= nick_len) {
+		m->type = IGNORE_MASK_NICK;
+		m->key = strdup(m->mask);
+		m->key[nick_len] = '\0';
+		return;
+	}
+
+	if (!strncmp(m->mask, "*!*@", 4) && at == bang + 2 && !strpbrk(at + 1, "*?")) {
+		m->type = IGNORE_MASK_HOST;
+		m->key = strdup(at + 1);
+		return;
+	}
+
+	m->type = IGNORE_MASK_GLOB;
+	m->key = strdup(m->mask);
+	m->suffix = 0;
+
+	for (p = m->key; *p; p++)
+		*p = i->map[(unsigned char)*p];
+
+	while (m->suffix < (size_t)(p - m->key) && !IGNORE_WILD(*(p - m->suffix - 1)))
+		m->suffix++;
+}
+
+static void
+ignore_index(struct ignore *i, struct ignore_mask *m)
+{
+	hmap_add(&i->masks, m->mask, m);
+
+	if (m->type == IGNORE_MASK_NICK)
+		hmap_add(&i->nicks, m->key, m);
+
+	if (m->type == IGNORE_MASK_HOST)
+		hmap_add(&i->hosts, m->key, m);
+
+	if (m->type == IGNORE_MASK_GLOB)
+		ignore_push(&i->globs.n, &i->globs.size, &i->globs.masks, m);
+}
+
+static int
+ignore_glob(const char *pat, const char *str, const unsigned char *map)
+{
+	/* Match a folded glob pattern against a string, '*' matching any
+	 * characters and '?' any one.
+	 *
+	 * On mismatch, the last '*' is retried one character further, which
+	 * is sufficient since any earlier '*' could only match less */
+
+	const char *pat_star = NULL, *str_star = NULL;
+
+	while (*str) {
+
+		if (*pat == '*') {
+			pat_star = ++pat;
+			str_star = str;
+		} else if (*pat == '?' || *pat == (char)map[(unsigned char)*str]) {
+			pat++;
+			str++;
+		} else if (pat_star) {
+			pat = pat_star;
+			str = ++str_star;
+		} else {
+			return 0;
+		}
+	}
+
+	while (*pat == '*')
+		pat++;
+
+	return (*pat == '\0');
+}
+
+static void
+ignore_mask_free(struct ignore_mask *m)
+{
+	str_release(m->mask);
+	free(m->key);
+	free(m);
+}
+
+static void
+ignore_push(size_t *n, size_t *size, struct ignore_mask ***masks, struct ignore_mask *m)
+{
+	if (*n == *size) {
+
+		*size = *size ? *size * 2 : 16;
+
+		if ((*masks = realloc(*masks, *size * sizeof(**masks))) == NULL)
+			fatal("realloc");
+	}
+
+	(*masks)[(*n)++] = m;
+}
+
+static void
+ignore_remove(size_t *n, struct ignore_mask **masks, struct ignore_mask *m)
+{
+	/* Remove a mask, keeping the others in order */
+
+	size_t j;
+
+	for (j = 0; j < *n && masks[j] != m; j++)
+		;
+
+	if (j < *n) {
+		memmove(masks + j, masks + j + 1, (*n - j - 1) * sizeof(*masks));
+		(*n)--;
+	}
+}
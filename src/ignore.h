@@ -0,0 +1,57 @@
+#ifndef IGNORE_H
+#define IGNORE_H
+
+/* ignore.h
+ *
+ * Ignore lists of nick!user@host glob masks, matched against the prefix of
+ * each message received
+ *
+ * Masks are compiled when added: exact nicks ("nick", "nick!*@*") and exact
+ * hosts ("*!*@host") are kept in hash sets, so matching them stays constant
+ * time however many are added, e.g. during a spam wave. Other masks are
+ * case folded once, and matched as globs rejected first by their literal
+ * suffix */
+
+#include "utils.h"
+
+/* Maximum length of a mask, nick!user@host */
+#define IGNORE_MASK_MAX 255
+
+enum ignore_mask_t
+{
+	IGNORE_MASK_NICK, /* nick!*@* */
+	IGNORE_MASK_HOST, /* *!*@host */
+	IGNORE_MASK_GLOB  /* Any other */
+};
+
+struct ignore_mask
+{
+	enum ignore_mask_t type;
+	char *mask;    /* nick!user@host, interned */
+	char *key;     /* The nick or host hashed, or the folded glob */
+	size_t suffix; /* Length of the glob's literal suffix */
+};
+
+struct ignore
+{
+	const unsigned char *map; /* Case mapping of nicks, and masks compared */
+	struct hmap hosts;
+	struct hmap masks;        /* All masks, by mask */
+	struct hmap nicks;
+	struct {
+		size_t n;
+		size_t size;
+		struct ignore_mask **masks;
+	} globs, list;            /* Glob masks, and all masks in the order added */
+};
+
+const char* ignore_get(const struct ignore*, size_t);
+
+int ignore_add(struct ignore*, const char*);
+int ignore_del(struct ignore*, const char*);
+int ignore_match(const struct ignore*, const char*, const char*);
+
+void ignore_free(struct ignore*);
+void ignore_set_casemap(struct ignore*, const unsigned char*);
+
+#endif
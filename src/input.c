@@ -11,7 +11,6 @@
  * */
 
 #include <ctype.h>
-#include <poll.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -36,8 +35,8 @@ char *action_message;
 /* Static buffer that accepts input from stdin */
 static char input_buff[MAX_PASTE];
 
-/* Buffer to hold paste message while waiting for confirmation, includes room for \r\n */
-static char paste_buff[MAX_INPUT + MAX_PASTE + (2 * MAX_PASTE_LINES)];
+/* Buffer to hold paste message while waiting for confirmation, includes room for \r\n and \0 */
+static char paste_buff[MAX_INPUT + MAX_PASTE + (2 * MAX_PASTE_LINES) + 1];
 static size_t paste_len;
 
 /* User input handlers */
@@ -128,9 +127,9 @@ new_list_head(input *i)
 }
 
 void
-poll_input(void)
+read_input(void)
 {
-	/* Poll stdin for user input. 4 cases:
+	/* Read user input from stdin, called when stdin is readable. 4 cases:
 	 *
 	 * 1. A single printable character
 	 * 2. A single byte control character
@@ -141,44 +140,41 @@ poll_input(void)
 	 * lines by \n characters or by MAX_INPUT. The user is warned about
 	 * pastes exceeding a single line before sending. */
 
-	int ret;
-	int timeout_ms = 200;
+	ssize_t count;
 
-	struct pollfd stdin_fd[] = {{ .fd = STDIN_FILENO, .events = POLLIN }};
+	if ((count = read(STDIN_FILENO, input_buff, MAX_PASTE)) < 0) {
+		if (errno == EINTR || errno == EAGAIN)
+			return;
 
-	if ((ret = poll(stdin_fd, 1, timeout_ms)) < 0 && errno != EINTR)
-		fatal("poll");
-
-	if (ret > 0) {
-
-		ssize_t count;
+		fatal("read");
+	}
 
-		if ((count = read(STDIN_FILENO, input_buff, MAX_PASTE)) < 0 && errno != EINTR)
-			fatal("read");
+	if (count == 0)
+		fatal("stdin closed");
 
-		if (count == 0)
-			fatal("stdin closed");
+	/* Channels' input is allocated when first used */
+	if (ccur->input == NULL)
+		ccur->input = new_input();
 
-		/* Waiting for user action, ignore everything else */
-		 if (action_message)
-			input_action(input_buff, count);
+	/* Waiting for user action, ignore everything else */
+	if (action_message)
+		input_action(input_buff, count);
 
-		/* Case 1 */
-		else if (count == 1 && isprint(*input_buff))
-			input_char(*input_buff);
+	/* Case 1 */
+	else if (count == 1 && isprint(*input_buff))
+		input_char(*input_buff);
 
-		/* Case 2 */
-		else if (count == 1 && iscntrl(*input_buff))
-			input_cchar(*input_buff);
+	/* Case 2 */
+	else if (count == 1 && iscntrl(*input_buff))
+		input_cchar(*input_buff);
 
-		/* Case 3 */
-		else if (*input_buff == 0x1b)
-			input_cseq(input_buff, count);
+	/* Case 3 */
+	else if (*input_buff == 0x1b)
+		input_cseq(input_buff, count);
 
-		/* Case 4 */
-		else if (count > 1)
-			input_paste(input_buff, count);
-	}
+	/* Case 4 */
+	else if (count > 1)
+		input_paste(input_buff, count);
 }
 
 /*
@@ -434,6 +430,8 @@ send_paste:
 	/* Store the paste length */
 	paste_len = paste_ptr - paste_buff;
 
+	*paste_ptr = '\0';
+
 	/* Confirm sending the paste */
 	action(action_send_paste, "Confirm sending %d lines? [y/n]", line_count);
 }
@@ -718,7 +716,7 @@ tab_complete(input *inp)
 	if (*str == '/' && str == inp->line->text) {
 		/* Command tab completion */
 
-		if ((n = avl_get(commands, ++str, --len))) {
+		if ((n = avl_get(commands, ++str, --len, casemap_ascii))) {
 
 			match = n->key;
 
@@ -733,7 +731,7 @@ tab_complete(input *inp)
 			/* For commands, append a space */
 			input_char(' ');
 		}
-	} else if ((n = avl_get(ccur->nicklist, str, len))) {
+	} else if (ccur->server && (n = avl_get(ccur->nicklist, str, len, ccur->server->casemap))) {
 		/* Nick tab completion */
 
 		match = n->key;
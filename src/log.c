@@ -0,0 +1,610 @@
+/* log.c
+ *
+ * Logging of buffer lines to disk, see log.h
+ *
+ * Records in the queue are aligned to 8 bytes, a header followed by the
+ * line's network, channel, sender and text, unterminated. A record that
+ * would wrap past the end of the queue is preceded by padding to the end,
+ * marked in its header.
+ *
+ * The main thread only writes head, and the writer only writes tail, each
+ * published with release ordering. After writing, the writer sleeps for
+ * LOG_BATCH_WAIT and writes the lines queued since, until the queue is
+ * found empty. Only then does it wait on a pipe, and is woken by the main
+ * thread on the next line, so under load lines are queued without any
+ * system call
+ * */
+
+/* For localtime_r, pthread_sigmask, tzset, O_CLOEXEC */
+#define _POSIX_C_SOURCE 200809L
+
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "utils.h"
+
+#if (LOG_QUEUE_SIZE & (LOG_QUEUE_SIZE - 1)) != 0
+	#error LOG_QUEUE_SIZE must be a power of 2
+#endif
+
+#define LOG_ALIGN(X) (((X) + 7) & ~(size_t)7)
+#define LOG_MASK(X)  ((X) & (LOG_QUEUE_SIZE - 1))
+
+/* Bytes of a record header read to find padding, the least padding aligned */
+#define LOG_RECORD_MIN 8
+
+struct log_record
+{
+	uint32_t size;     /* Bytes of the record, or of padding to the end of the queue */
+	uint16_t pad;      /* Record is padding */
+	uint16_t from_len;
+	uint16_t text_len;
+	uint16_t net_len;
+	uint16_t chan_len;
+	time_t time;
+};
+
+/* Open log file, written only by the writer */
+struct log_file
+{
+	char *net;
+	char *chan;          /* Empty for the network's file */
+	int day;             /* Date of the lines written, as YYYYMMDD */
+	int fd;              /* -1 if the file couldn't be opened */
+	int dirty;           /* Written since last synced */
+	unsigned long used;  /* Batch last written */
+};
+
+static int log_file_open(struct log_file*, struct tm*);
+static long log_now(void);
+static size_t log_drain(void);
+static size_t log_name(char*, size_t, const char*);
+static struct log_file* log_file(const char*, size_t, const char*, size_t, struct tm*);
+static void log_file_close(struct log_file*);
+static void log_sync(int);
+static void log_writev(int, struct iovec*, int);
+static void* log_writer(void*);
+
+static struct
+{
+	char *q;                /* Queue of records, LOG_QUEUE_SIZE bytes */
+	char *dir;
+	int pipe[2];
+	int stop;               /* Set by log_free */
+	int waiting;            /* Set by the writer when waiting on the pipe */
+	size_t head;            /* Written by the main thread */
+	size_t tail;            /* Written by the writer */
+	unsigned long dropped;  /* Lines dropped on a full queue, since last logged */
+	unsigned int sync;      /* Seconds between fsyncs */
+	pthread_t tid;
+} logger = {
+	.pipe = {-1, -1}
+};
+
+/* Writer state */
+static struct log_file log_files[LOG_FILES_MAX];
+static size_t log_files_n;
+static unsigned long log_batches;
+static long log_synced;
+
+void
+log_init(const char *dir, unsigned int sync)
+{
+	/* Start logging to dir, fsyncing files written every sync seconds.
+	 * Logging is disabled while not initialized */
+
+	sigset_t set, oset;
+
+	if (dir == NULL || logger.q)
+		return;
+
+	if ((logger.q = malloc(LOG_QUEUE_SIZE)) == NULL)
+		fatal("malloc");
+
+	if ((logger.dir = strdup(dir)) == NULL)
+		fatal("strdup");
+
+	logger.sync = sync;
+	logger.stop = 0;
+
+	if (pipe(logger.pipe) < 0)
+		fatal("pipe");
+
+	if (fcntl(logger.pipe[0], F_SETFL, O_NONBLOCK) < 0 || fcntl(logger.pipe[1], F_SETFL, O_NONBLOCK) < 0)
+		fatal("fcntl");
+
+	/* Time zone is initialized before the writer's first localtime_r */
+	tzset();
+
+	/* Signals are handled by the main thread */
+	sigfillset(&set);
+
+	if ((errno = pthread_sigmask(SIG_SETMASK, &set, &oset)))
+		fatal("pthread_sigmask");
+
+	if ((errno = pthread_create(&logger.tid, NULL, log_writer, NULL)))
+		fatal("pthread_create");
+
+	if ((errno = pthread_sigmask(SIG_SETMASK, &oset, NULL)))
+		fatal("pthread_sigmask");
+}
+
+void
+log_free(void)
+{
+	/* Stop the writer once the lines queued are written and synced */
+
+	ssize_t ret;
+
+	if (logger.q == NULL)
+		return;
+
+	__atomic_store_n(&logger.stop, 1, __ATOMIC_SEQ_CST);
+
+	ret = write(logger.pipe[1], "", 1);
+
+	(void)(ret);
+
+	if ((errno = pthread_join(logger.tid, NULL)))
+		fatal("pthread_join");
+
+	close(logger.pipe[0]);
+	close(logger.pipe[1]);
+
+	free(logger.q);
+	free(logger.dir);
+
+	logger.q = NULL;
+	logger.dir = NULL;
+	logger.pipe[0] = -1;
+	logger.pipe[1] = -1;
+	logger.head = 0;
+	logger.tail = 0;
+	logger.dropped = 0;
+}
+
+int
+log_line(const char *net, const char *chan, time_t t, const char *from, const char *text, size_t text_len)
+{
+	/* Queue a line to be logged, lines of a network's server buffer have
+	 * no channel. Returns -1 if the line is dropped */
+
+	char *p;
+	size_t head, tail, off, pad, size, net_len, chan_len, from_len;
+	ssize_t ret;
+
+	if (logger.q == NULL)
+		return 0;
+
+	net_len = strlen(net);
+	chan_len = chan ? strlen(chan) : 0;
+	from_len = strlen(from);
+
+	size = LOG_ALIGN(sizeof(struct log_record) + net_len + chan_len + from_len + text_len);
+
+	head = logger.head;
+	tail = __atomic_load_n(&logger.tail, __ATOMIC_ACQUIRE);
+
+	off = LOG_MASK(head);
+	pad = (off + size > LOG_QUEUE_SIZE) ? LOG_QUEUE_SIZE - off : 0;
+
+	if (net_len > UINT16_MAX || chan_len > UINT16_MAX || from_len > UINT16_MAX || text_len > UINT16_MAX
+	 || size > LOG_QUEUE_SIZE / 4
+	 || LOG_QUEUE_SIZE - (head - tail) < pad + size) {
+		__atomic_add_fetch(&logger.dropped, 1, __ATOMIC_RELAXED);
+		return -1;
+	}
+
+	if (pad) {
+		memcpy(logger.q + off, &(struct log_record) { .size = pad, .pad = 1 }, LOG_RECORD_MIN);
+		off = 0;
+	}
+
+	p = logger.q + off;
+
+	memcpy(p, &(struct log_record) {
+		.size = size,
+		.from_len = from_len,
+		.text_len = text_len,
+		.net_len = net_len,
+		.chan_len = chan_len,
+		.time = t
+	}, sizeof(struct log_record));
+
+	p += sizeof(struct log_record);
+
+	memcpy(p, net, net_len);
+	p += net_len;
+
+	if (chan_len)
+		memcpy(p, chan, chan_len);
+	p += chan_len;
+
+	memcpy(p, from, from_len);
+	p += from_len;
+
+	memcpy(p, text, text_len);
+
+	__atomic_store_n(&logger.head, head + pad + size, __ATOMIC_SEQ_CST);
+
+	/* Wake the writer if waiting, a full pipe means it's already pending */
+	if (__atomic_exchange_n(&logger.waiting, 0, __ATOMIC_SEQ_CST)) {
+
+		ret = write(logger.pipe[1], "", 1);
+
+		(void)(ret);
+	}
+
+	return 0;
+}
+
+static void*
+log_writer(void *arg)
+{
+	/* Write lines as they're queued, waiting on the pipe while the queue
+	 * is empty, or until files written are next synced */
+
+	char buf[64];
+	struct pollfd pfd = { .fd = logger.pipe[0], .events = POLLIN };
+
+	(void)(arg);
+
+	mkdir(logger.dir, 0700);
+
+	log_synced = log_now();
+
+	for (;;) {
+
+		if (log_drain()) {
+
+			log_sync(0);
+
+			/* More lines are likely, wait for them to be written in
+			 * batches, without the main thread waking the writer */
+			poll(NULL, 0, LOG_BATCH_WAIT);
+
+			continue;
+		}
+
+		if (__atomic_load_n(&logger.stop, __ATOMIC_SEQ_CST))
+			break;
+
+		__atomic_store_n(&logger.waiting, 1, __ATOMIC_SEQ_CST);
+
+		if (__atomic_load_n(&logger.head, __ATOMIC_SEQ_CST) == logger.tail
+		 && !__atomic_load_n(&logger.stop, __ATOMIC_SEQ_CST)) {
+
+			int i, timeout = -1;
+			long elapsed = log_now() - log_synced;
+
+			for (i = 0; i < (int)log_files_n; i++) {
+				if (log_files[i].dirty)
+					timeout = (elapsed < logger.sync * 1000L) ? (int)(logger.sync * 1000L - elapsed) : 0;
+			}
+
+			if (poll(&pfd, 1, timeout) > 0) {
+				while (read(logger.pipe[0], buf, sizeof(buf)) > 0)
+					;
+			}
+		}
+
+		__atomic_store_n(&logger.waiting, 0, __ATOMIC_SEQ_CST);
+
+		log_sync(0);
+	}
+
+	/* Lines queued before stopping */
+	log_drain();
+	log_sync(1);
+
+	while (log_files_n)
+		log_file_close(&log_files[--log_files_n]);
+
+	return NULL;
+}
+
+static size_t
+log_drain(void)
+{
+	/* Write the lines queued, batching consecutive lines of the same file
+	 * into a single writev. Returns the number of lines written */
+
+	char stamps[LOG_BATCH][sizeof("00:00:00 ")], note[64];
+	char *p, *net, *chan, *from, *text, *batch_net = NULL, *batch_chan = NULL;
+	int day, iovcnt, lines, note_len;
+	size_t head, next, tail = logger.tail, total = 0;
+	struct iovec iov[LOG_BATCH * 5 + 2];
+	struct log_file *f;
+	struct log_record r, batch = {0};
+	struct tm tm;
+	unsigned long dropped;
+
+	head = __atomic_load_n(&logger.head, __ATOMIC_ACQUIRE);
+
+	while (tail != head) {
+
+		f = NULL;
+		day = 0;
+		iovcnt = 0;
+		lines = 0;
+
+		for (next = tail; next != head && lines < LOG_BATCH; next += r.size) {
+
+			p = logger.q + LOG_MASK(next);
+
+			memcpy(&r, p, LOG_RECORD_MIN);
+
+			if (r.pad)
+				continue;
+
+			memcpy(&r, p, sizeof(r));
+
+			net = p + sizeof(r);
+			chan = net + r.net_len;
+			from = chan + r.chan_len;
+			text = from + r.from_len;
+
+			localtime_r(&r.time, &tm);
+
+			if (lines == 0) {
+
+				batch = r;
+				batch_net = net;
+				batch_chan = chan;
+				day = (tm.tm_year + 1900) * 10000 + (tm.tm_mon + 1) * 100 + tm.tm_mday;
+
+				f = log_file(net, r.net_len, chan, r.chan_len, &tm);
+
+			} else if (r.net_len != batch.net_len || r.chan_len != batch.chan_len
+			        || memcmp(net, batch_net, r.net_len) || memcmp(chan, batch_chan, r.chan_len)
+			        || (tm.tm_year + 1900) * 10000 + (tm.tm_mon + 1) * 100 + tm.tm_mday != day) {
+				break;
+			}
+
+			if (f == NULL || f->fd < 0) {
+				lines++;
+				continue;
+			}
+
+			strftime(stamps[lines], sizeof(stamps[lines]), "%H:%M:%S ", &tm);
+
+			/* Lines dropped since last logged are noted in the next file written */
+			if (lines == 0 && (dropped = __atomic_exchange_n(&logger.dropped, 0, __ATOMIC_RELAXED))) {
+
+				note_len = snprintf(note, sizeof(note), "-- %lu lines not logged\n", dropped);
+
+				iov[iovcnt++] = (struct iovec) { stamps[0], sizeof(stamps[0]) - 1 };
+				iov[iovcnt++] = (struct iovec) { note, note_len };
+			}
+
+			iov[iovcnt++] = (struct iovec) { stamps[lines], sizeof(stamps[lines]) - 1 };
+			iov[iovcnt++] = (struct iovec) { from, r.from_len };
+			iov[iovcnt++] = (struct iovec) { " ", 1 };
+			iov[iovcnt++] = (struct iovec) { text, r.text_len };
+			iov[iovcnt++] = (struct iovec) { "\n", 1 };
+
+			lines++;
+		}
+
+		if (iovcnt) {
+			log_writev(f->fd, iov, iovcnt);
+			f->dirty = 1;
+		}
+
+		__atomic_store_n(&logger.tail, next, __ATOMIC_RELEASE);
+
+		tail = next;
+		total += lines;
+	}
+
+	return total;
+}
+
+static struct log_file*
+log_file(const char *net, size_t net_len, const char *chan, size_t chan_len, struct tm *tm)
+{
+	/* Return the open log file of a network or channel for the date of tm,
+	 * rotating it if opened for another date, or closing the least
+	 * recently written file to open it */
+
+	int day = (tm->tm_year + 1900) * 10000 + (tm->tm_mon + 1) * 100 + tm->tm_mday;
+	size_t i;
+	struct log_file *f = NULL;
+
+	log_batches++;
+
+	for (i = 0; i < log_files_n; i++) {
+
+		struct log_file *t = &log_files[i];
+
+		if (strlen(t->net) == net_len && !memcmp(t->net, net, net_len)
+		 && strlen(t->chan) == chan_len && !memcmp(t->chan, chan, chan_len)) {
+			f = t;
+			break;
+		}
+
+		if (f == NULL || t->used < f->used)
+			f = t;
+	}
+
+	if (i < log_files_n) {
+
+		f->used = log_batches;
+
+		if (f->day == day && f->fd >= 0)
+			return f;
+
+		if (f->fd >= 0) {
+			if (f->dirty)
+				fsync(f->fd);
+			close(f->fd);
+		}
+
+		f->day = day;
+		f->dirty = 0;
+
+		log_file_open(f, tm);
+
+		return f;
+	}
+
+	if (log_files_n < LOG_FILES_MAX)
+		f = &log_files[log_files_n++];
+	else
+		log_file_close(f);
+
+	if ((f->net = malloc(net_len + 1)) == NULL || (f->chan = malloc(chan_len + 1)) == NULL) {
+		free(f->net);
+		*f = log_files[--log_files_n];
+		return NULL;
+	}
+
+	memcpy(f->net, net, net_len);
+	memcpy(f->chan, chan, chan_len);
+
+	f->net[net_len] = '\0';
+	f->chan[chan_len] = '\0';
+
+	f->day = day;
+	f->dirty = 0;
+	f->used = log_batches;
+
+	log_file_open(f, tm);
+
+	return f;
+}
+
+static int
+log_file_open(struct log_file *f, struct tm *tm)
+{
+	/* Open a network's or channel's log file for the date of tm */
+
+	char date[sizeof("YYYY-MM-DD")], net[256], chan[256], path[1024];
+	int ret;
+
+	strftime(date, sizeof(date), "%Y-%m-%d", tm);
+
+	log_name(net, sizeof(net), f->net);
+
+	if (*f->chan) {
+
+		log_name(chan, sizeof(chan), f->chan);
+
+		if ((ret = snprintf(path, sizeof(path), "%s/%s", logger.dir, net)) < 0 || (size_t)ret >= sizeof(path))
+			return (f->fd = -1);
+
+		mkdir(path, 0700);
+
+		ret = snprintf(path, sizeof(path), "%s/%s/%s.%s.log", logger.dir, net, chan, date);
+	} else {
+		ret = snprintf(path, sizeof(path), "%s/%s.%s.log", logger.dir, net, date);
+	}
+
+	if (ret < 0 || (size_t)ret >= sizeof(path))
+		return (f->fd = -1);
+
+	return (f->fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600));
+}
+
+static void
+log_file_close(struct log_file *f)
+{
+	if (f->fd >= 0) {
+		if (f->dirty)
+			fsync(f->fd);
+		close(f->fd);
+	}
+
+	free(f->net);
+	free(f->chan);
+
+	f->net = NULL;
+	f->chan = NULL;
+	f->fd = -1;
+}
+
+static size_t
+log_name(char *dst, size_t size, const char *src)
+{
+	/* Copy a network or channel name for use in a path, replacing path
+	 * separators and a leading '.' */
+
+	size_t i;
+
+	for (i = 0; src[i] && i < size - 1; i++)
+		dst[i] = (src[i] == '/' || (i == 0 && src[i] == '.')) ? '_' : src[i];
+
+	dst[i] = '\0';
+
+	return i;
+}
+
+static void
+log_sync(int force)
+{
+	/* Sync files written, if the interval has elapsed since last synced */
+
+	long now = log_now();
+	size_t i;
+
+	if (!force && now - log_synced < logger.sync * 1000L)
+		return;
+
+	for (i = 0; i < log_files_n; i++) {
+		if (log_files[i].dirty && log_files[i].fd >= 0)
+			fsync(log_files[i].fd);
+
+		log_files[i].dirty = 0;
+	}
+
+	log_synced = now;
+}
+
+static void
+log_writev(int fd, struct iovec *iov, int n)
+{
+	/* Write all of iov, lines are lost on error */
+
+	ssize_t ret;
+
+	while (n) {
+
+		if ((ret = writev(fd, iov, n)) < 0) {
+
+			if (errno == EINTR)
+				continue;
+
+			return;
+		}
+
+		for (; n && (size_t)ret >= iov->iov_len; iov++, n--)
+			ret -= iov->iov_len;
+
+		if (n) {
+			iov->iov_base = (char *)iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
+}
+
+static long
+log_now(void)
+{
+	/* Monotonic time in milliseconds */
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
@@ -0,0 +1,47 @@
+#ifndef LOG_H
+#define LOG_H
+
+/* log.h
+ *
+ * Logging of buffer lines to disk, per network and per channel
+ *
+ * Lines are appended by the main thread to a lock-free single producer,
+ * single consumer queue, and written by a dedicated writer thread, so the
+ * main thread never blocks on disk. Lines are dropped, and counted in the
+ * log, if the queue is full.
+ *
+ * The writer batches lines for the same file into a single writev, and
+ * fsyncs files written on an interval. Files are rotated by the date of
+ * the lines written:
+ *
+ *   DIR/NETWORK.YYYY-MM-DD.log          server buffer lines
+ *   DIR/NETWORK/CHANNEL.YYYY-MM-DD.log  channel and private buffer lines
+ * */
+
+#include <time.h>
+
+/* Size of the queue of lines to be written, in bytes, a power of 2 */
+#ifndef LOG_QUEUE_SIZE
+	#define LOG_QUEUE_SIZE (1 << 21)
+#endif
+
+/* Default number of seconds between fsyncs of files written */
+#ifndef LOG_SYNC_INTERVAL
+	#define LOG_SYNC_INTERVAL 5
+#endif
+
+/* Milliseconds the writer waits after writing lines, for more to batch */
+#define LOG_BATCH_WAIT 20
+
+/* Most lines written per writev */
+#define LOG_BATCH 64
+
+/* Most log files kept open, the least recently written are closed */
+#define LOG_FILES_MAX 64
+
+int log_line(const char*, const char*, time_t, const char*, const char*, size_t);
+
+void log_free(void);
+void log_init(const char*, unsigned int);
+
+#endif
@@ -52,6 +52,9 @@
 
 #define IS_ME(X) !strcmp(X, s->nick)
 
+/* Characters accepted in received messages, printable ascii, space and ctcp markup */
+#define RECV_CHAR(C) (((C) >= 0x21 && (C) <= 0x7E) || (C) == ' ' || (C) == 0x01)
+
 /* List of common IRC commands with no explicit handling */
 #define UNHANDLED_SEND_CMDS \
 	X(admin)   X(away)     X(die) \
@@ -111,23 +114,207 @@ static int send_unhandled(char*, char*, char*, channel*);
 struct command { int (*fptr)(char*, char*, channel*); };
 static struct command* new_command(int (*fptr)(char*, char*, channel*));
 
-//TODO: mimic the send handler macros and build/free a tree of handlers
+/* List of commands received from servers which are explicitly handled */
+#define HANDLED_RECV_CMDS \
+	X(BATCH,   recv_batch)  \
+	X(CAP,     recv_cap)    \
+	X(ERROR,   recv_error)  \
+	X(JOIN,    recv_join)   \
+	X(KICK,    recv_kick)   \
+	X(MODE,    recv_mode)   \
+	X(NICK,    recv_nick)   \
+	X(NOTICE,  recv_notice) \
+	X(PART,    recv_part)   \
+	X(PING,    recv_ping)   \
+	X(PONG,    recv_pong)   \
+	X(PRIVMSG, recv_priv)   \
+	X(QUIT,    recv_quit)   \
+	X(TOPIC,   recv_topic)
+
+/* List of numeric replies which are explicitly handled */
+#define HANDLED_RECV_NUMERICS \
+	X(RPL_WELCOME,          recv_rpl_welcome)            \
+	X(RPL_YOURHOST,         recv_rpl_trailing)           \
+	X(RPL_CREATED,          recv_rpl_trailing)           \
+	X(RPL_MYINFO,           recv_rpl_supported)          \
+	X(RPL_ISUPPORT,         recv_rpl_supported)          \
+	X(RPL_STATSCONN,        recv_rpl_trailing)           \
+	X(RPL_LUSERCLIENT,      recv_rpl_trailing)           \
+	X(RPL_LUSEROP,          recv_rpl_lusercount)         \
+	X(RPL_LUSERUNKNOWN,     recv_rpl_lusercount)         \
+	X(RPL_LUSERCHANNELS,    recv_rpl_lusercount)         \
+	X(RPL_LUSERME,          recv_rpl_trailing)           \
+	X(RPL_LOCALUSERS,       recv_rpl_trailing)           \
+	X(RPL_GLOBALUSERS,      recv_rpl_trailing)           \
+	X(RPL_CHANNEL_URL,      recv_rpl_channel_url)        \
+	X(RPL_NOTOPIC,          recv_rpl_ignored)            \
+	X(RPL_TOPIC,            recv_rpl_topic)              \
+	X(RPL_TOPICWHOTIME,     recv_rpl_topicwhotime)       \
+	X(RPL_NAMREPLY,         recv_rpl_namreply)           \
+	X(RPL_ENDOFNAMES,       recv_rpl_endofnames)         \
+	X(RPL_MOTD,             recv_rpl_trailing)           \
+	X(RPL_MOTDSTART,        recv_rpl_trailing)           \
+	X(RPL_ENDOFMOTD,        recv_rpl_ignored)            \
+	X(ERR_NOSUCHNICK,       recv_err_nosuchnick)         \
+	X(ERR_NOSUCHSERVER,     recv_err_nosuchserver)       \
+	X(ERR_NOSUCHCHANNEL,    recv_err_nosuchchannel)      \
+	X(ERR_CANNOTSENDTOCHAN, recv_err_cannotsendtochan)   \
+	X(ERR_ERRONEUSNICKNAME, recv_err_erroneusnickname)   \
+	X(ERR_NICKNAMEINUSE,    recv_err_nicknameinuse)
+
+/* IRCv3 capabilities requested when offered by the server */
+#define RECV_CAPS \
+	X(CAP_BATCH,       "batch") \
+	X(CAP_SERVER_TIME, "server-time")
+
+enum cap_t
+{
+#define X(cap, name) cap,
+	RECV_CAPS
+#undef X
+	CAP_T_SIZE
+};
+
+#define CAP_BIT(C) (1U << (C))
+
+static const char *const cap_names[] = {
+#define X(cap, name) name,
+	RECV_CAPS
+#undef X
+};
+
+/* ISUPPORT tokens parsed, and their values until advertised by the server */
+#define RECV_ISUPPORT \
+	X(ISUPPORT_CASEMAPPING, "CASEMAPPING", "rfc1459") \
+	X(ISUPPORT_CHANMODES,   "CHANMODES",   "beI,k,l,imnpst") \
+	X(ISUPPORT_CHANTYPES,   "CHANTYPES",   "#&") \
+	X(ISUPPORT_MAXTARGETS,  "MAXTARGETS",  "") \
+	X(ISUPPORT_NICKLEN,     "NICKLEN",     "") \
+	X(ISUPPORT_PREFIX,      "PREFIX",      "(ov)@+")
+
+enum isupport_t
+{
+#define X(token, name, value) token,
+	RECV_ISUPPORT
+#undef X
+	ISUPPORT_T_SIZE
+};
+
+static const struct
+{
+	const char *name;
+	const char *value;
+} isupport_tokens[] = {
+#define X(token, name, value) { name, value },
+	RECV_ISUPPORT
+#undef X
+};
+
+/* Case mappings named by ISUPPORT CASEMAPPING */
+static const struct
+{
+	const char *name;
+	const unsigned char *map;
+} casemaps[] = {
+	{ "ascii",          casemap_ascii },
+	{ "rfc1459",        casemap_rfc1459 },
+	{ "strict-rfc1459", casemap_strict_rfc1459 }
+};
+
+/* Open IRCv3 batch. Netsplits and netjoins are applied to the nicklists as
+ * received, counting the nicks quit and joined per channel, other messages
+ * tagged with its reference are held in order of arrival until the batch
+ * ends */
+struct batch
+{
+	char *ref;
+	char *type;
+	char *params;
+	int bulk;              /* Netsplit or netjoin */
+	int ended;             /* Ended early, until BATCH -<reference> */
+	size_t n;              /* Messages held */
+	struct batch *next;
+	struct batch_count
+	{
+		char *chan;
+		int quit;
+		int join;
+	} *counts;
+	size_t counts_n;
+	size_t counts_size;
+	struct batch_line
+	{
+		struct batch_line *next;
+		char mesg[];
+	} *head, *tail;
+};
+
+static struct batch* batch_get(server*, parsed_mesg*);
+static struct batch_count* batch_count(struct batch*, channel*);
+static void batch_bulk(server*, struct batch*, parsed_mesg*);
+static void batch_end(server*, struct batch*);
+static void batch_end_early(server*, struct batch*);
+static void batch_flush(server*, struct batch*);
+static void batch_free(struct batch*);
+
 /* Message receiving handlers */
+typedef int (*recv_handler)(char*, parsed_mesg*, server*);
+
+static void recv_dispatch(parsed_mesg*, server*);
+static time_t recv_server_time(const char*);
+static unsigned int recv_cap_bits(char*);
+static unsigned int recv_mode_params(server*, const char*);
+static void recv_isupport(server*, const char*, const char*);
+
 static int recv_ctcp_req(char*, parsed_mesg*, server*);
 static int recv_ctcp_rpl(char*, parsed_mesg*);
-static int recv_error(char*, parsed_mesg*, server*);
-static int recv_join(char*, parsed_mesg*, server*);
-static int recv_kick(char*, parsed_mesg*, server*);
-static int recv_mode(char*, parsed_mesg*, server*);
-static int recv_nick(char*, parsed_mesg*, server*);
-static int recv_notice(char*, parsed_mesg*, server*);
 static int recv_numeric(char*, parsed_mesg*, server*);
-static int recv_part(char*, parsed_mesg*, server*);
-static int recv_ping(char*, parsed_mesg*, server*);
-static int recv_pong(char*, parsed_mesg*, server*);
-static int recv_priv(char*, parsed_mesg*, server*);
-static int recv_quit(char*, parsed_mesg*, server*);
-static int recv_topic(char*, parsed_mesg*, server*);
+static int recv_err_nosuch(char*, parsed_mesg*, server*, const char*);
+static const char* recv_params(char*, size_t, parsed_mesg*, unsigned int);
+
+#define X(cmd, handler) static int handler(char*, parsed_mesg*, server*);
+HANDLED_RECV_CMDS
+#undef X
+
+/* Numeric reply handlers, some shared by several codes */
+static int recv_rpl_welcome(char*, parsed_mesg*, server*);
+static int recv_rpl_trailing(char*, parsed_mesg*, server*);
+static int recv_rpl_supported(char*, parsed_mesg*, server*);
+static int recv_rpl_lusercount(char*, parsed_mesg*, server*);
+static int recv_rpl_channel_url(char*, parsed_mesg*, server*);
+static int recv_rpl_ignored(char*, parsed_mesg*, server*);
+static int recv_rpl_topic(char*, parsed_mesg*, server*);
+static int recv_rpl_topicwhotime(char*, parsed_mesg*, server*);
+static int recv_rpl_namreply(char*, parsed_mesg*, server*);
+static int recv_rpl_endofnames(char*, parsed_mesg*, server*);
+static int recv_err_nosuchnick(char*, parsed_mesg*, server*);
+static int recv_err_nosuchserver(char*, parsed_mesg*, server*);
+static int recv_err_nosuchchannel(char*, parsed_mesg*, server*);
+static int recv_err_cannotsendtochan(char*, parsed_mesg*, server*);
+static int recv_err_erroneusnickname(char*, parsed_mesg*, server*);
+static int recv_err_nicknameinuse(char*, parsed_mesg*, server*);
+
+/* Handled commands, hashed into a table of RECV_CMD_TABLE_SIZE entries by a
+ * seed chosen in init_mesg such that no two commands collide, so dispatching
+ * a command is a single hash and string compare */
+#define RECV_CMD_TABLE_SIZE 64
+
+static struct recv_cmd
+{
+	const char *cmd;
+	recv_handler handler;
+} recv_cmds[RECV_CMD_TABLE_SIZE];
+
+static unsigned int recv_cmd_seed;
+
+static unsigned int recv_cmd_hash(const char*, unsigned int);
+
+/* Numeric handlers, indexed by code */
+static const recv_handler recv_numerics[1000] = {
+	#define X(code, handler) [code] = handler,
+	HANDLED_RECV_NUMERICS
+	#undef X
+};
 
 static void
 server_fatal(server *s, char *fmt, ...)
@@ -148,15 +335,44 @@ init_mesg(void)
 {
 	/* Build and AVL tree of commands and function pointers to handlers */
 
+	static const struct recv_cmd cmds[] = {
+		#define X(cmd, handler) { #cmd, handler },
+		HANDLED_RECV_CMDS
+		#undef X
+	};
+
+	size_t i;
+	unsigned int h;
+
 	/* Add the unhandled commands with no explicit handler */
-	#define X(cmd) avl_add(&commands, #cmd, NULL);
+	#define X(cmd) avl_add(&commands, #cmd, NULL, casemap_ascii);
 	UNHANDLED_SEND_CMDS
 	#undef X
 
 	/* Add the handled commands with explicit handlers */
-	#define X(cmd) avl_add(&commands, #cmd, new_command(send_##cmd));
+	#define X(cmd) avl_add(&commands, #cmd, new_command(send_##cmd), casemap_ascii);
 	HANDLED_SEND_CMDS
 	#undef X
+
+	/* Find a seed hashing all received commands to distinct entries */
+	for (recv_cmd_seed = 0;; recv_cmd_seed++) {
+
+		if (recv_cmd_seed == 1 << 16)
+			fatal("no perfect hash for received commands");
+
+		memset(recv_cmds, 0, sizeof(recv_cmds));
+
+		for (i = 0; i < sizeof(cmds) / sizeof(cmds[0]); i++) {
+
+			if (recv_cmds[(h = recv_cmd_hash(cmds[i].cmd, recv_cmd_seed))].cmd)
+				break;
+
+			recv_cmds[h] = cmds[i];
+		}
+
+		if (i == sizeof(cmds) / sizeof(cmds[0]))
+			break;
+	}
 }
 
 void
@@ -208,7 +424,7 @@ send_mesg(char *mesg, channel *chan)
 		else if (!(cmd_str = getarg(&mesg, " ")))
 			newline(chan, 0, "-!!-", "Messages beginning with '/' require a command");
 
-		else if (!(cmd = avl_get(commands, cmd_str, strlen(cmd_str))))
+		else if (!(cmd = avl_get(commands, cmd_str, strlen(cmd_str), casemap_ascii)))
 			newlinef(chan, 0, "-!!-", "Unknown command: '%s'", cmd_str);
 
 		else {
@@ -231,9 +447,43 @@ send_mesg(char *mesg, channel *chan)
 void
 send_paste(char *paste)
 {
-	/* TODO: send the paste buffer, which is preformatted with \r\n, and then
-	 * split the messages and newline them into the buffer * */
-	UNUSED(paste);
+	/* Send each line of a confirmed paste to the current channel. The paste
+	 * buffer is preformatted with \r\n separated lines.
+	 *
+	 * Lines are sent with bulk priority, so large pastes are paced by flood
+	 * control without holding back other input */
+
+	char *next, errbuff[MAX_ERROR];
+	channel *c = current_channel();
+
+	if (c->buffer.type == BUFFER_SERVER) {
+		newline(c, 0, "-!!-", "Error: This is not a channel");
+		return;
+	}
+
+	if (c->parted) {
+		newline(c, 0, "-!!-", "Error: Parted from channel");
+		return;
+	}
+
+	for (; paste; paste = next) {
+
+		if ((next = strstr(paste, "\r\n"))) {
+			*next = '\0';
+			next += 2;
+		}
+
+		/* Skip empty lines */
+		if (*paste == '\0')
+			continue;
+
+		if (sendf_prio(errbuff, c->server, SEND_PRIO_BULK, "PRIVMSG %s :%s", c->name, paste)) {
+			newline(c, 0, "-!!-", errbuff);
+			return;
+		}
+
+		newline(c, BUFFER_LINE_CHAT, c->server->nick, paste);
+	}
 }
 
 static int
@@ -365,7 +615,7 @@ send_disconnect(char *err, char *mesg, channel *c)
 	server *s = c->server;
 
 	/* Server isn't connecting, connected or waiting to connect */
-	if (!s || (!s->connecting && s->soc < 0 && !s->reconnect_time))
+	if (!s || (!s->connecting && !s->queued && s->soc < 0 && !timer_pending(&s->reconnect_timer)))
 		fail("Error: Not connected to server");
 
 	server_disconnect(c->server, 0, 0, (*mesg) ? mesg : DEFAULT_QUIT_MESG);
@@ -394,21 +644,33 @@ send_me(char *err, char *mesg, channel *c)
 static int
 send_ignore(char *err, char *mesg, channel *c)
 {
-	/* /ignore [nick] */
+	/* /ignore [mask] */
 
-	char *nick;
+	char *mask;
+	const char *m;
+	int ret;
+	size_t i;
 
 	if (!c->server)
 		fail("Error: Not connected to server");
 
-	if (!(nick = getarg(&mesg, " ")))
-		nicklist_print(c);
+	if (!(mask = getarg(&mesg, " "))) {
+
+		if (!ignore_get(&c->server->ignore, 0))
+			newline(c, 0, "--", "Ignore list is empty");
 
-	else if (!avl_add(&(c->server->ignore), nick, NULL))
-		failf("Error: Already ignoring '%s'", nick);
+		for (i = 0; (m = ignore_get(&c->server->ignore, i)); i++)
+			newlinef(c, 0, "--", "Ignoring '%s'", m);
+	}
+
+	else if ((ret = ignore_add(&c->server->ignore, mask)) < 0)
+		failf("Error: Invalid mask '%s'", mask);
+
+	else if (ret == 0)
+		failf("Error: Already ignoring '%s'", mask);
 
 	else
-		newlinef(c, 0, "--", "Ignoring '%s'", nick);
+		newlinef(c, 0, "--", "Ignoring '%s'", mask);
 
 	return 0;
 }
@@ -450,8 +712,13 @@ send_nick(char *err, char *mesg, channel *c)
 
 	char *nick;
 
-	if ((nick = getarg(&mesg, " ")))
+	if ((nick = getarg(&mesg, " "))) {
+
+		if (c->server && c->server->isupport.nicklen && strlen(nick) > c->server->isupport.nicklen)
+			failf("Error: Nick '%s' is longer than %u characters", nick, c->server->isupport.nicklen);
+
 		return sendf(err, c->server, "NICK %s", nick);
+	}
 
 	if (!c->server)
 		fail("Error: Not connected to server");
@@ -537,21 +804,21 @@ send_topic(char *err, char *mesg, channel *c)
 static int
 send_unignore(char *err, char *mesg, channel *c)
 {
-	/* /unignore [nick] */
+	/* /unignore <mask> */
 
-	char *nick;
+	char *mask;
 
 	if (!c->server)
 		fail("Error: Not connected to server");
 
-	if (!(nick = getarg(&mesg, " ")))
-		nicklist_print(c);
+	if (!(mask = getarg(&mesg, " ")))
+		fail("Error: /unignore requires a mask");
 
-	else if (!avl_del(&(c->server->ignore), nick))
-		failf("Error: '%s' not on ignore list", nick);
+	else if (!ignore_del(&c->server->ignore, mask))
+		failf("Error: '%s' not on ignore list", mask);
 
 	else
-		newlinef(c, 0, "--", "No longer ignoring '%s'", nick);
+		newlinef(c, 0, "--", "No longer ignoring '%s'", mask);
 
 	return 0;
 }
@@ -603,70 +870,621 @@ send_version(char *err, char *mesg, channel *c)
 /* FIXME: lots of incorrect instances of ccur below */
 
 void
-recv_mesg(char *inp, int count, server *s)
+recv_mesg(char *mesg, server *s)
 {
-	char *ptr = s->iptr;
-	char *max = s->input + BUFFSIZE;
+	/* Handle a single message received from a server, NUL terminated with
+	 * the trailing \r\n removed */
 
-	char errbuff[MAX_ERROR];
+	char *ptr = mesg, *c;
 
-	int err = 0;
+	size_t len;
 
 	parsed_mesg p;
 
-	while (count--) {
-		if (*inp == '\r') {
+	struct batch *b;
+	struct batch_line *line = NULL;
+
+	/* Don't accept unprintable characters unless space or ctcp markup,
+	 * only copying the message over itself once one is found */
+	while (RECV_CHAR(*ptr))
+		ptr++;
 
-			*ptr = '\0';
+	if (*ptr) {
+		for (c = ptr; *c; c++) {
+			if (RECV_CHAR(*c))
+				*ptr++ = *c;
+		}
+
+		*ptr = '\0';
+	}
+
+	if (*mesg == '\0')
+		return;
 
 #ifdef DEBUG
-			newline(s->channel, 0, "", "");
-			newline(s->channel, 0, "DEBUG <<", s->input);
+	newline(s->channel, 0, "", "");
+	newline(s->channel, 0, "DEBUG <<", mesg);
 #endif
-			if (!(parse(&p, s->input)))
-				newline(s->channel, 0, "-!!-", "Failed to parse message");
-			else if (isdigit(*p.command))
-				err = recv_numeric(errbuff, &p, s);
-			else if (!strcmp(p.command, "PRIVMSG"))
-				err = recv_priv(errbuff, &p, s);
-			else if (!strcmp(p.command, "JOIN"))
-				err = recv_join(errbuff, &p, s);
-			else if (!strcmp(p.command, "PART"))
-				err = recv_part(errbuff, &p, s);
-			else if (!strcmp(p.command, "QUIT"))
-				err = recv_quit(errbuff, &p, s);
-			else if (!strcmp(p.command, "NOTICE"))
-				err = recv_notice(errbuff, &p, s);
-			else if (!strcmp(p.command, "NICK"))
-				err = recv_nick(errbuff, &p, s);
-			else if (!strcmp(p.command, "PING"))
-				err = recv_ping(errbuff, &p, s);
-			else if (!strcmp(p.command, "PONG"))
-				err = recv_pong(errbuff, &p, s);
-			else if (!strcmp(p.command, "KICK"))
-				err = recv_kick(errbuff, &p, s);
-			else if (!strcmp(p.command, "MODE"))
-				err = recv_mode(errbuff, &p, s);
-			else if (!strcmp(p.command, "ERROR"))
-				err = recv_error(errbuff, &p, s);
-			else if (!strcmp(p.command, "TOPIC"))
-				err = recv_topic(errbuff, &p, s);
-			else
-				newlinef(s->channel, 0, "-!!-", "Message type '%s' unknown", p.command);
+	/* While batches are open the message is copied before it's parsed in
+	 * place, in case it belongs to one and is held */
+	if (s->batches) {
+
+		len = strlen(mesg) + 1;
+
+		if ((line = malloc(sizeof(*line) + len)) == NULL)
+			fatal("malloc");
+
+		memcpy(line->mesg, mesg, len);
+		line->next = NULL;
+	}
+
+	if (!(parse(&p, mesg)))
+		newline(s->channel, 0, "-!!-", "Failed to parse message");
+	else if (!line || (b = batch_get(s, &p)) == NULL)
+		recv_dispatch(&p, s);
+	else if (b->bulk)
+		batch_bulk(s, b, &p);
+	else {
+
+		if (b->tail)
+			b->tail->next = line;
+		else
+			b->head = line;
+
+		b->tail = line;
+
+		if (++b->n >= BATCH_LINES_MAX)
+			batch_end_early(s, b);
+
+		return;
+	}
+
+	free(line);
+}
+
+void
+recv_reset(server *s)
+{
+	/* Free a server's open batches and forget its negotiated capabilities
+	 * and ISUPPORT tokens, when created or disconnected */
+
+	struct batch *b;
+	unsigned int i;
+
+	while ((b = s->batches)) {
+		s->batches = b->next;
+		batch_free(b);
+	}
+
+	s->caps = 0;
+	s->caps_req = 0;
+
+	for (i = 0; i < ISUPPORT_T_SIZE; i++)
+		recv_isupport(s, isupport_tokens[i].name, NULL);
+}
+
+static void
+recv_dispatch(parsed_mesg *p, server *s)
+{
+	/* Call the handler for a parsed message */
+
+	char errbuff[MAX_ERROR];
+
+	int err = 0;
+
+	struct recv_cmd *cmd;
+
+	/* Lines printed by the handler are stamped with the time the server
+	 * received the message, if sent */
+	if ((s->caps & CAP_BIT(CAP_SERVER_TIME)) && p->known[TAG_TIME])
+		newline_set_time(recv_server_time(tag_value(p->known[TAG_TIME])));
+
+	if (isdigit(*p->command))
+		err = recv_numeric(errbuff, p, s);
+	else if ((cmd = &recv_cmds[recv_cmd_hash(p->command, recv_cmd_seed)])->cmd && !strcmp(cmd->cmd, p->command))
+		err = cmd->handler(errbuff, p, s);
+	else
+		newlinef(s->channel, 0, "-!!-", "Message type '%s' unknown", p->command);
+
+	newline_set_time(0);
+
+	if (err)
+		newlinef(s->channel, 0, "-!!-", "%s", errbuff);
+}
+
+static time_t
+recv_server_time(const char *str)
+{
+	/* Convert a server-time timestamp, YYYY-MM-DDThh:mm:ss.sssZ in UTC, to
+	 * time_t, or 0 if invalid.
+	 *
+	 * timegm isn't portable, so days since the epoch are counted from the
+	 * date directly, with years beginning in March so leap days fall last */
+
+	int Y, M, D, h, m, sec;
+	long days, era, yoe;
+
+	if (sscanf(str, "%4d-%2d-%2dT%2d:%2d:%2d", &Y, &M, &D, &h, &m, &sec) != 6)
+		return 0;
+
+	if (Y < 1970 || M < 1 || M > 12 || D < 1 || D > 31 || h > 23 || m > 59 || sec > 60)
+		return 0;
+
+	Y -= (M <= 2);
+	era = Y / 400;
+	yoe = Y - era * 400;
+
+	days = era * 146097 + yoe * 365 + yoe / 4 - yoe / 100
+	     + (153 * (M > 2 ? M - 3 : M + 9) + 2) / 5 + D - 1
+	     - 719468;
+
+	return (time_t)days * 86400 + h * 3600 + m * 60 + sec;
+}
+
+static struct batch*
+batch_get(server *s, parsed_mesg *p)
+{
+	/* Return the open batch a message belongs to, if any.
+	 *
+	 * BATCH messages themselves are never held, so a batch nested within
+	 * another is handled when it ends. Messages of a batch ended early are
+	 * handled unbatched */
+
+	struct batch *b;
+	const char *ref;
+
+	if (p->known[TAG_BATCH] == NULL || !strcmp(p->command, "BATCH"))
+		return NULL;
+
+	ref = tag_value(p->known[TAG_BATCH]);
+
+	for (b = s->batches; b; b = b->next) {
+		if (!strcmp(b->ref, ref))
+			return b->ended ? NULL : b;
+	}
 
-			if (err)
-				newlinef(s->channel, 0, "-!!-", "%s", errbuff);
+	return NULL;
+}
+
+static struct batch_count*
+batch_count(struct batch *b, channel *c)
+{
+	/* Return the nicks counted quit and joined in a channel by a batch */
+
+	size_t i;
+
+	for (i = 0; i < b->counts_n; i++) {
+		if (!strcmp(b->counts[i].chan, c->name))
+			return &b->counts[i];
+	}
+
+	if (b->counts_n == b->counts_size) {
+
+		b->counts_size = b->counts_size ? b->counts_size * 2 : 8;
+
+		if ((b->counts = realloc(b->counts, b->counts_size * sizeof(*b->counts))) == NULL)
+			fatal("realloc");
+	}
+
+	b->counts[b->counts_n] = (struct batch_count) { .chan = strdup(c->name) };
+
+	return &b->counts[b->counts_n++];
+}
+
+static void
+batch_bulk(server *s, struct batch *b, parsed_mesg *p)
+{
+	/* Apply a netsplit or netjoin's QUIT or JOIN to the nicklists without
+	 * printing or drawing it, counting it per channel until the batch ends */
 
-			ptr = s->input;
+	channel *c;
+	size_t j;
+	struct member *m;
+
+	if (p->from && !IS_ME(p->from) && !strcmp(p->command, "QUIT")) {
+
+		for (j = ((m = member_get(s, p->from)) ? m->n : 0); j--;) {
+
+			c = m->channels[j];
 
-		/* Don't accept unprintable characters unless space or ctcp markup */
-		} else if (ptr < max && (isgraph(*inp) || *inp == ' ' || *inp == 0x01))
-			*ptr++ = *inp;
+			if (nicklist_del(c, p->from))
+				batch_count(b, c)->quit++;
+		}
+
+	} else if (p->from && !IS_ME(p->from) && !strcmp(p->command, "JOIN") && p->params[0]) {
 
-		inp++;
+		if ((c = channel_get(p->params[0], s)) && nicklist_add(c, p->from))
+			batch_count(b, c)->join++;
+
+	} else {
+		recv_dispatch(p, s);
 	}
+}
+
+static void
+batch_end(server *s, struct batch *b)
+{
+	/* Handle a batch unlinked from the server at BATCH -<reference> */
 
-	s->iptr = ptr;
+	batch_flush(s, b);
+	batch_free(b);
+}
+
+static void
+batch_end_early(server *s, struct batch *b)
+{
+	/* End a batch before its BATCH -<reference> is received, handling what
+	 * it holds, so a batch left open can't hold messages unbounded. The
+	 * reference is kept, its messages since handled unbatched */
+
+	b->ended = 1;
+
+	batch_flush(s, b);
+}
+
+static void
+batch_flush(server *s, struct batch *b)
+{
+	/* Print a line per channel affected by a netsplit or netjoin, and redraw
+	 * once, or handle the messages held in order as if received unbatched.
+	 *
+	 * The lines held are taken from the batch first, since handling them
+	 * may disconnect the server, freeing its batches */
+
+	channel *c;
+	size_t i;
+	struct batch_line *line, *next;
+
+	if (b->counts_n) {
+
+		for (i = 0; i < b->counts_n; i++) {
+
+			if ((c = channel_get(b->counts[i].chan, s)) == NULL)
+				continue;
+
+			if (b->counts[i].quit)
+				newlinef(c, 0, "<", "%d users have quit (%s %s)",
+					b->counts[i].quit, b->type, b->params);
+
+			if (b->counts[i].join)
+				newlinef(c, 0, ">", "%d users have joined (%s %s)",
+					b->counts[i].join, b->type, b->params);
+		}
+
+		while (b->counts_n)
+			free(b->counts[--b->counts_n].chan);
+
+		draw_status();
+	}
+
+	line = b->head;
+
+	b->head = NULL;
+	b->tail = NULL;
+	b->n = 0;
+
+	for (; line; line = next) {
+
+		next = line->next;
+
+		if (s->soc >= 0)
+			recv_mesg(line->mesg, s);
+
+		free(line);
+	}
+}
+
+static void
+batch_free(struct batch *b)
+{
+	struct batch_line *line;
+
+	while ((line = b->head)) {
+		b->head = line->next;
+		free(line);
+	}
+
+	while (b->counts_n)
+		free(b->counts[--b->counts_n].chan);
+
+	free(b->counts);
+	free(b->ref);
+	free(b->type);
+	free(b->params);
+	free(b);
+}
+
+static unsigned int
+recv_cmd_hash(const char *cmd, unsigned int seed)
+{
+	/* FNV-1a, seeded */
+
+	unsigned int h = 2166136261U ^ seed;
+
+	while (*cmd) {
+		h ^= (unsigned char)*cmd++;
+		h *= 16777619U;
+	}
+
+	return h & (RECV_CMD_TABLE_SIZE - 1);
+}
+
+static const char*
+recv_params(char *buf, size_t size, parsed_mesg *p, unsigned int i)
+{
+	/* Join a message's middle parameters from i, space separated, for printing */
+
+	int ret;
+	size_t len = 0;
+	unsigned int n = p->n_params - (p->trailing != NULL);
+
+	*buf = '\0';
+
+	for (; i < n; i++) {
+
+		ret = snprintf(buf + len, size - len, "%s%s", (len ? " " : ""), p->params[i]);
+
+		if (ret < 0 || (len += ret) >= size)
+			break;
+	}
+
+	return buf;
+}
+
+static int
+recv_batch(char *err, parsed_mesg *p, server *s)
+{
+	/* BATCH +<reference> <type> [parameters]
+	 * BATCH -<reference> */
+
+	char params[BUFFSIZE], *ref;
+	size_t len = 0, n = 0;
+	struct batch *b, **bb, **last;
+	unsigned int i;
+
+	if (!(ref = p->params[0]) || (*ref != '+' && *ref != '-') || !ref[1])
+		fail("BATCH: reference is null");
+
+	if (*ref == '-') {
+
+		for (bb = &s->batches; (b = *bb); bb = &b->next) {
+			if (!strcmp(b->ref, ref + 1))
+				break;
+		}
+
+		if (b == NULL)
+			failf("BATCH: '%s' not open", ref + 1);
+
+		/* A batch ended early holds nothing, its reference is forgotten */
+		*bb = b->next;
+
+		batch_end(s, b);
+
+		return 0;
+	}
+
+	if (!p->params[1])
+		fail("BATCH: type is null");
+
+	/* Make room by ending the open batch opened first, last in the list */
+	for (bb = &s->batches, last = NULL; (b = *bb); bb = &b->next) {
+		if (!b->ended) {
+			last = bb;
+			n++;
+		}
+	}
+
+	if (n >= BATCH_OPEN_MAX)
+		batch_end_early(s, *last);
+
+	/* References of batches ended early are kept until closed, forgetting
+	 * the first ended once there are as many as can be open */
+	for (bb = &s->batches, last = NULL, n = 0; (b = *bb); bb = &b->next) {
+		if (b->ended) {
+			last = bb;
+			n++;
+		}
+	}
+
+	if (n > BATCH_OPEN_MAX) {
+		b = *last;
+		*last = b->next;
+		batch_free(b);
+	}
+
+	*params = '\0';
+
+	for (i = 2; i < p->n_params && len < sizeof(params); i++)
+		len += snprintf(params + len, sizeof(params) - len, "%s%s", (len ? " " : ""), p->params[i]);
+
+	if ((b = calloc(1, sizeof(*b))) == NULL)
+		fatal("calloc");
+
+	b->ref = strdup(ref + 1);
+	b->type = strdup(p->params[1]);
+	b->bulk = !strcmp(b->type, "netsplit") || !strcmp(b->type, "netjoin");
+	b->params = strdup(params);
+	b->next = s->batches;
+	s->batches = b;
+
+	return 0;
+}
+
+static int
+recv_cap(char *err, parsed_mesg *p, server *s)
+{
+	/* CAP <target> LS [*] :<capabilities>
+	 * CAP <target> ACK :<capabilities>
+	 * CAP <target> NAK :<capabilities>
+	 * CAP <target> NEW :<capabilities>
+	 * CAP <target> DEL :<capabilities>
+	 *
+	 * Capabilities in RECV_CAPS are requested when listed, registration
+	 * continues with CAP END once all requested are ACKed or NAKed */
+
+	char buf[BUFFSIZE], *cmd, *caps;
+	int more;
+	size_t len = 0;
+	unsigned int bits, i;
+
+	if (!(cmd = p->params[1]))
+		fail("CAP: subcommand is null");
+
+	/* Listing continued on following messages */
+	more = (p->n_params > 3 && !strcmp(p->params[2], "*"));
+
+	if (!(caps = p->params[more ? 3 : 2]))
+		fail("CAP: capabilities are null");
+
+	if (!strcmp(cmd, "ACK") || !strcmp(cmd, "NAK")) {
+
+		newlinef(s->channel, 0, "--", "Capabilities %s: %s",
+			(*cmd == 'A' ? "enabled" : "rejected"), caps);
+
+		bits = recv_cap_bits(caps);
+
+		if (*cmd == 'A')
+			s->caps |= bits;
+
+		s->caps_req &= ~bits;
+
+		return s->caps_req ? 0 : sendf_prio(err, s, SEND_PRIO_HIGH, "CAP END");
+	}
+
+	if (!strcmp(cmd, "DEL")) {
+		s->caps &= ~recv_cap_bits(caps);
+		return 0;
+	}
+
+	if (strcmp(cmd, "LS") && strcmp(cmd, "NEW"))
+		failf("CAP: unknown subcommand '%s'", cmd);
+
+	s->caps_req |= recv_cap_bits(caps) & ~s->caps;
+
+	if (more)
+		return 0;
+
+	if (!s->caps_req)
+		return (*cmd == 'L') ? sendf_prio(err, s, SEND_PRIO_HIGH, "CAP END") : 0;
+
+	for (i = 0; i < CAP_T_SIZE; i++) {
+		if (s->caps_req & CAP_BIT(i))
+			len += snprintf(buf + len, sizeof(buf) - len, "%s%s", (len ? " " : ""), cap_names[i]);
+	}
+
+	return sendf_prio(err, s, SEND_PRIO_HIGH, "CAP REQ :%s", buf);
+}
+
+static void
+recv_isupport(server *s, const char *name, const char *value)
+{
+	/* Set an ISUPPORT token parsed, to its default if value is NULL */
+
+	const char *p;
+	size_t i, len;
+	struct isupport *isupport = &s->isupport;
+
+	for (i = 0; i < ISUPPORT_T_SIZE && strcmp(name, isupport_tokens[i].name); i++)
+		;
+
+	if (value == NULL && i < ISUPPORT_T_SIZE)
+		value = isupport_tokens[i].value;
+
+	switch (i) {
+
+		case ISUPPORT_CASEMAPPING:
+			for (i = 0; i < sizeof(casemaps) / sizeof(casemaps[0]) && strcmp(value, casemaps[i].name); i++)
+				;
+			/* Unknown case mappings are left unchanged */
+			if (i < sizeof(casemaps) / sizeof(casemaps[0]))
+				server_set_casemap(s, casemaps[i].map);
+			break;
+
+		case ISUPPORT_CHANMODES:
+			/* <list>,<always>,<set-only>,<flag>[,<unknown>]* */
+			for (i = 0; i < 4; i++) {
+				len = strcspn(value, ",");
+				snprintf(isupport->chanmodes[i], MODE_SIZE, "%.*s", (int)len, value);
+				value += len + (value[len] == ',');
+			}
+			break;
+
+		case ISUPPORT_CHANTYPES:
+			snprintf(isupport->chantypes, MODE_SIZE, "%s", value);
+			break;
+
+		case ISUPPORT_MAXTARGETS:
+			isupport->maxtargets = strtoul(value, NULL, 10);
+			break;
+
+		case ISUPPORT_NICKLEN:
+			isupport->nicklen = strtoul(value, NULL, 10);
+			break;
+
+		case ISUPPORT_PREFIX:
+			/* (<modes>)<prefixes>, modes and their prefixes in matching order */
+			if (*value == '(' && (p = strchr(value, ')')) && strlen(p + 1) == (len = p - value - 1)) {
+				snprintf(isupport->prefix_modes, MODE_SIZE, "%.*s", (int)len, value + 1);
+				snprintf(isupport->prefix_chars, MODE_SIZE, "%s", p + 1);
+			} else {
+				*isupport->prefix_modes = '\0';
+				*isupport->prefix_chars = '\0';
+			}
+			break;
+
+		default:
+			break;
+	}
+}
+
+static unsigned int
+recv_mode_params(server *s, const char *modes)
+{
+	/* Count the parameters taken by a string of channel modes, e.g.: +ov-k
+	 *
+	 * Nick prefix modes, list modes and always parameterized modes take one
+	 * when set or unset, set-only modes only when set */
+
+	int set = 1;
+	struct isupport *isupport = &s->isupport;
+	unsigned int n = 0;
+
+	for (; *modes; modes++) {
+
+		if (*modes == '+' || *modes == '-')
+			set = (*modes == '+');
+
+		else if (strchr(isupport->prefix_modes, *modes)
+		      || strchr(isupport->chanmodes[0], *modes)
+		      || strchr(isupport->chanmodes[1], *modes)
+		      || (set && strchr(isupport->chanmodes[2], *modes)))
+			n++;
+	}
+
+	return n;
+}
+
+static unsigned int
+recv_cap_bits(char *caps)
+{
+	/* Return the bits of the capabilities in RECV_CAPS found in a space
+	 * separated list, ignoring values, e.g. "sasl=PLAIN" */
+
+	char *cap;
+	size_t len;
+	unsigned int bits = 0, i;
+
+	while ((cap = getarg(&caps, " "))) {
+
+		len = strcspn(cap, "=");
+
+		for (i = 0; i < CAP_T_SIZE; i++) {
+			if (!strncmp(cap, cap_names[i], len) && cap_names[i][len] == '\0')
+				bits |= CAP_BIT(i);
+		}
+	}
+
+	return bits;
 }
 
 static int
@@ -683,14 +1501,12 @@ recv_ctcp_req(char *err, parsed_mesg *p, server *s)
 	if (!p->from)
 		fail("CTCP: sender's nick is null");
 
-	/* CTCP request from ignored user, do nothing */
-	if (avl_get(ccur->server->ignore, p->from, strlen(p->from)))
-		return 0;
-
-	if (!(targ = getarg(&p->params, " ")))
+	if (!(targ = p->params[0]))
 		fail("CTCP: target is null");
 
-	if (!(mesg = getarg(&p->trailing, "\x01")))
+	mesg = p->params[1];
+
+	if (!(mesg = getarg(&mesg, "\x01")))
 		fail("CTCP: invalid markup");
 
 	/* Markup is valid, get command */
@@ -728,7 +1544,7 @@ recv_ctcp_req(char *err, parsed_mesg *p, server *s)
 
 		newlinef(s->channel, 0, "--", "CTCP CLIENTINFO request from %s", p->from);
 
-		return sendf(err, s, "NOTICE %s :\x01""CLIENTINFO ACTION PING VERSION TIME\x01", p->from);
+		return sendf_prio(err, s, SEND_PRIO_BULK, "NOTICE %s :\x01""CLIENTINFO ACTION PING VERSION TIME\x01", p->from);
 	}
 
 	if (!strcmp(cmd, "PING")) {
@@ -744,7 +1560,7 @@ recv_ctcp_req(char *err, parsed_mesg *p, server *s)
 
 		newlinef(s->channel, 0, "--", "CTCP PING request from %s", p->from);
 
-		return sendf(err, s, "NOTICE %s :\x01""PING %lld\x01", p->from, milliseconds);
+		return sendf_prio(err, s, SEND_PRIO_BULK, "NOTICE %s :\x01""PING %lld\x01", p->from, milliseconds);
 	}
 
 	if (!strcmp(cmd, "VERSION")) {
@@ -754,7 +1570,7 @@ recv_ctcp_req(char *err, parsed_mesg *p, server *s)
 
 		newlinef(s->channel, 0, "--", "CTCP VERSION request from %s", p->from);
 
-		return sendf(err, s,
+		return sendf_prio(err, s, SEND_PRIO_BULK,
 			"NOTICE %s :\x01""VERSION rirc v"VERSION", http://rcr.io/rirc.html\x01", p->from);
 	}
 
@@ -775,11 +1591,11 @@ recv_ctcp_req(char *err, parsed_mesg *p, server *s)
 
 		newlinef(s->channel, 0, "--", "CTCP TIME request from %s", p->from);
 
-		return sendf(err, s, "NOTICE %s :\x01""TIME %s\x01", p->from, time_str);
+		return sendf_prio(err, s, SEND_PRIO_BULK, "NOTICE %s :\x01""TIME %s\x01", p->from, time_str);
 	}
 
 	/* Unsupported CTCP request */
-	fail_if(sendf(err, s, "NOTICE %s :\x01""ERRMSG %s not supported\x01", p->from, cmd));
+	fail_if(sendf_prio(err, s, SEND_PRIO_BULK, "NOTICE %s :\x01""ERRMSG %s not supported\x01", p->from, cmd));
 	failf("CTCP: Unknown command '%s' from %s", cmd, p->from);
 }
 
@@ -794,11 +1610,9 @@ recv_ctcp_rpl(char *err, parsed_mesg *p)
 	if (!p->from)
 		fail("CTCP: sender's nick is null");
 
-	/* CTCP reply from ignored user, do nothing */
-	if (avl_get(ccur->server->ignore, p->from, strlen(p->from)))
-		return 0;
+	mesg = p->params[1];
 
-	if (!(mesg = getarg(&p->trailing, "\x01")))
+	if (!(mesg = getarg(&mesg, "\x01")))
 		fail("CTCP: invalid markup");
 
 	/* Markup is valid, get command */
@@ -817,7 +1631,7 @@ recv_error(char *err, parsed_mesg *p, server *s)
 
 	UNUSED(err);
 
-	server_disconnect(s, 1, 0, p->trailing ? p->trailing : "Remote hangup");
+	server_disconnect(s, 1, 0, p->params[0] ? p->params[0] : "Remote hangup");
 
 	return 0;
 }
@@ -833,7 +1647,7 @@ recv_join(char *err, parsed_mesg *p, server *s)
 	if (!p->from)
 		fail("JOIN: sender's nick is null");
 
-	if (!(chan = getarg(&p->params, " ")) && !(chan = getarg(&p->trailing, " ")))
+	if (!(chan = p->params[0]))
 		fail("JOIN: channel is null");
 
 	if (IS_ME(p->from)) {
@@ -849,11 +1663,9 @@ recv_join(char *err, parsed_mesg *p, server *s)
 		if ((c = channel_get(chan, s)) == NULL)
 			failf("JOIN: channel '%s' not found", chan);
 
-		if (!avl_add(&(c->nicklist), p->from, NULL))
+		if (!nicklist_add(c, p->from))
 			failf("JOIN: nick '%s' already in '%s'", p->from, chan);
 
-		c->nick_count++;
-
 		if (c->nick_count < config.join_part_quit_threshold)
 			newlinef(c, 0, ">", "%s!%s has joined %s", p->from, p->hostinfo, chan);
 
@@ -868,16 +1680,16 @@ recv_kick(char *err, parsed_mesg *p, server *s)
 {
 	/* :nick!user@hostname.domain KICK <channel> <user> :comment */
 
-	char *chan, *user;
+	char *chan, *user, *comment;
 	channel *c;
 
 	if (!p->from)
 		fail("KICK: sender's nick is null");
 
-	if (!(chan = getarg(&p->params, " ")))
+	if (!(chan = p->params[0]))
 		fail("KICK: channel is null");
 
-	if (!(user = getarg(&p->params, " ")))
+	if (!(user = p->params[1]))
 		fail("KICK: user is null");
 
 	if ((c = channel_get(chan, s)) == NULL)
@@ -888,26 +1700,24 @@ recv_kick(char *err, parsed_mesg *p, server *s)
 	 * If a "comment" is given, this will be sent instead of the default message,
 	 * the nickname of the user issuing the KICK.
 	 * */
-	if (!strcmp(p->from, p->trailing))
-		p->trailing = NULL;
+	if ((comment = p->params[2]) && !strcmp(p->from, comment))
+		comment = NULL;
 
 	if (IS_ME(user)) {
 
 		part_channel(c);
 
-		if (p->trailing)
-			newlinef(c, 0, "--", "You've been kicked by %s (%s)", p->from, p->trailing);
+		if (comment)
+			newlinef(c, 0, "--", "You've been kicked by %s (%s)", p->from, comment);
 		else
 			newlinef(c, 0, "--", "You've been kicked by %s", p->from, user);
 	} else {
 
-		if (!avl_del(&c->nicklist, user))
+		if (!nicklist_del(c, user))
 			failf("KICK: nick '%s' not found in '%s'", user, chan);
 
-		c->nick_count--;
-
-		if (p->trailing)
-			newlinef(c, 0, "--", "%s has kicked %s (%s)", p->from, user, p->trailing);
+		if (comment)
+			newlinef(c, 0, "--", "%s has kicked %s (%s)", p->from, user, comment);
 		else
 			newlinef(c, 0, "--", "%s has kicked %s", p->from, user);
 	}
@@ -923,36 +1733,43 @@ recv_mode(char *err, parsed_mesg *p, server *s)
 	/* :nick!user@hostname.domain MODE <targ> *( ( "-" / "+" ) *<modes> *<modeparams> ) */
 
 	channel *c;
-	char *targ;
+	char modeparams[BUFFSIZE], *targ, *modes;
+	size_t j, len;
+	struct member *m;
+	unsigned int i, n;
 
-	if (!(targ = getarg(&p->params, " ")))
+	if (!(targ = p->params[0]))
 		fail("MODE: target is null");
 
 	/* If the target channel isn't found,  */
 	if (IS_ME(targ))
 		c = s->channel;
-	else
+	else if (strchr(s->isupport.chantypes, *targ))
 		c = channel_get(targ, s);
+	else
+		c = NULL;
 
-	char *modes, *modeparams, *modetmp = NULL;
-
-	/* FIXME: Some servers do this...
+	/* Modes may be sent in the trailing parameter, e.g.:
 	 * MODE user :+abc
 	 * MODE #chan +abc
-	 *
-	 * instead, getarg(parsed_mesg) should try params, then trailing
 	 * */
-	while ((modes = modetmp) || (modes = getarg(&p->params, " ")) || (modes = getarg(&p->trailing, " "))) {
+	for (i = 1; i < p->n_params; i++) {
+
+		modes = p->params[i];
 
 		if (!(*modes == '+') && !(*modes == '-'))
 			fail("MODE: invalid mode format");
 
-		/* Modeparams are optional, and only used for printing when present */
-		if ((modeparams = getarg(&p->params, " ")) && (*modeparams == '+' || *modeparams == '-'))
-			/* modeparam here is actually a modestring, set modetmp for the next iteration to use */
-			modetmp = modeparams;
+		/* Modeparams are only used for printing when present. The number
+		 * taken by channel modes is known from ISUPPORT, otherwise any
+		 * single parameter that follows is taken */
+		if (c && !IS_ME(targ))
+			n = recv_mode_params(s, modes);
 		else
-			modetmp = NULL;
+			n = (i + 1 < p->n_params && *p->params[i + 1] != '+' && *p->params[i + 1] != '-');
+
+		for (*modeparams = '\0', len = 0; n-- && i + 1 < p->n_params && len < sizeof(modeparams); i++)
+			len += snprintf(modeparams + len, sizeof(modeparams) - len, " %s", p->params[i + 1]);
 
 		/* Having c set means the target is the server modes or a specific channel's modes */
 		if (c) {
@@ -962,32 +1779,26 @@ recv_mode(char *err, parsed_mesg *p, server *s)
 				channel_set_mode(c, modes);
 
 			/* [<user> set ]<target> mode: [<mode>][ <modeparams>] */
-			newlinef(c, 0, "--", "%s%s%s mode: [%s%s%s]",
+			newlinef(c, 0, "--", "%s%s%s mode: [%s%s]",
 				(p->from ? p->from : ""),
 				(p->from ? " set " : ""),
 				targ,
 				modes,
-				(modeparams ? " " : ""),
-				(modeparams ? modeparams : "")
+				modeparams
 			);
 		} else {
 
-			/* If the channel isn't found, search for the target as a user in all channels
-			 * and print where found */
-			c = s->channel;
-
-			do {
-				if (avl_get(c->nicklist, targ, strlen(targ)))
-					/* [<user> set ]<target> mode: [<mode>][ <modeparams>] */
-					newlinef(c, 0, "--", "%s%s%s mode: [%s%s%s]",
-						(p->from ? p->from : ""),
-						(p->from ? " set " : ""),
-						targ,
-						modes,
-						(modeparams ? " " : ""),
-						(modeparams ? modeparams : "")
-					);
-			} while ((c = c->next) != s->channel);
+			/* If the channel isn't found, print to the channels the target
+			 * is in as a user */
+			for (j = 0, m = member_get(s, targ); m && j < m->n; j++)
+				/* [<user> set ]<target> mode: [<mode>][ <modeparams>] */
+				newlinef(m->channels[j], 0, "--", "%s%s%s mode: [%s%s]",
+					(p->from ? p->from : ""),
+					(p->from ? " set " : ""),
+					targ,
+					modes,
+					modeparams
+				);
 		}
 	}
 
@@ -999,13 +1810,15 @@ recv_nick(char *err, parsed_mesg *p, server *s)
 {
 	/* :nick!user@hostname.domain NICK [:]<new nick> */
 
+	channel *c;
 	char *nick;
+	size_t i;
+	struct member *m;
 
 	if (!p->from)
 		fail("NICK: old nick is null");
 
-	/* Some servers seem to send the new nick in the trailing */
-	if (!(nick = getarg(&p->params, " ")) && !(nick = getarg(&p->trailing, " ")))
+	if (!(nick = p->params[0]))
 		fail("NICK: new nick is null");
 
 	if (IS_ME(p->from)) {
@@ -1013,13 +1826,19 @@ recv_nick(char *err, parsed_mesg *p, server *s)
 		newlinef(s->channel, 0, "--", "You are now known as %s", nick);
 	}
 
-	channel *c = s->channel;
-	do {
-		if (avl_del(&c->nicklist, p->from)) {
-			avl_add(&c->nicklist, nick, NULL);
-			newlinef(c, 0, "--", "%s  >>  %s", p->from, nick);
-		}
-	} while ((c = c->next) != s->channel);
+	if ((m = member_get(s, p->from)) == NULL)
+		return 0;
+
+	/* Channels are removed from the end of the membership and, for a change
+	 * of case only, appended back to it, so those not yet renamed in are
+	 * never moved */
+	for (i = m->n; i--;) {
+
+		nicklist_del((c = m->channels[i]), p->from);
+		nicklist_add(c, nick);
+
+		newlinef(c, 0, "--", "%s  >>  %s", p->from, nick);
+	}
 
 	return 0;
 }
@@ -1029,30 +1848,29 @@ recv_notice(char *err, parsed_mesg *p, server *s)
 {
 	/* :nick.hostname.domain NOTICE <target> :<message> */
 
-	char *targ;
+	char *targ, *mesg;
 	channel *c;
 
-	if (!p->trailing)
+	if (!(mesg = p->params[1]))
 		fail("NOTICE: message is null");
 
+	/* Notice or CTCP reply from ignored user, do nothing */
+	if (ignore_match(&s->ignore, p->from, p->hostinfo))
+		return 0;
+
 	/* CTCP reply */
-	if (*p->trailing == 0x01)
+	if (*mesg == 0x01)
 		return recv_ctcp_rpl(err, p);
 
 	if (!p->from)
 		fail("NOTICE: sender's nick is null");
 
-	/* Notice from ignored user, do nothing */
-	if (avl_get(ccur->server->ignore, p->from, strlen(p->from)))
-		return 0;
-
-	if (!(targ = getarg(&p->params, " ")))
-		fail("NOTICE: target is null");
+	targ = p->params[0];
 
 	if ((c = channel_get(targ, s)))
-		newline(c, 0, p->from, p->trailing);
+		newline(c, 0, p->from, mesg);
 	else
-		newline(s->channel, 0, p->from, p->trailing);
+		newline(s->channel, 0, p->from, mesg);
 
 	return 0;
 }
@@ -1062,21 +1880,21 @@ recv_numeric(char *err, parsed_mesg *p, server *s)
 {
 	/* :server <code> <target> [args] */
 
-	channel *c;
-	char *targ, *nick, *chan, *time, *type, *num;
-	int code, ret;
+	char *targ, *ptr, buf[BUFFSIZE];
+	int code;
+	recv_handler handler;
 
 	/* Extract numeric code */
-	for (code = 0; isdigit(*p->command); p->command++) {
+	for (code = 0, ptr = p->command; isdigit(*ptr); ptr++) {
 
-		code = code * 10 + (*p->command - '0');
+		code = code * 10 + (*ptr - '0');
 
 		if (code > 999)
 			fail("NUMERIC: greater than 999");
 	}
 
 	/* Message target is only used to establish s->nick when registering with a server */
-	if (!(targ = getarg(&p->params, " "))) {
+	if (!(targ = p->params[0])) {
 		server_fatal(s, "NUMERIC: target is null");
 		return 1;
 	}
@@ -1087,264 +1905,367 @@ recv_numeric(char *err, parsed_mesg *p, server *s)
 		return 1;
 	}
 
-	/* Shortcuts */
 	if (!code)
 		fail("NUMERIC: code is null");
-	else if (code > 400) goto num_400;
-	else if (code > 200) goto num_200;
-
-	/* Numeric types (000, 200) */
-	switch (code) {
-
-	/* 001 :<Welcome message> */
-	case RPL_WELCOME:
-		/* Establishing new connection with a server, set initial nick,
-		 * handle any channel auto-join or rejoins */
 
+	/* 001 establishes the nick the server knows us by */
+	if (code == RPL_WELCOME)
 		strncpy(s->nick, targ, NICKSIZE);
 
-		/* Reset list of auto nicks */
-		s->nptr = s->nicks;
+	if ((handler = recv_numerics[code]))
+		return handler(err, p, s);
 
-		/* Auto join channels if first time connecting */
-		if (s->join) {
-			ret = sendf(err, s, "JOIN %s", s->join);
-			free(s->join);
-			s->join = NULL;
-			fail_if(ret);
-		} else {
-			/* If reconnecting to server, join any non-parted channels */
-			c = s->channel;
-			do {
-				if (c->buffer.type == BUFFER_CHANNEL && !c->parted)
-					fail_if(sendf(err, s, "JOIN %s", c->name));
-				c = c->next;
-			} while (c != s->channel);
-		}
+	newlinef(s->channel, 0, "UNHANDLED", "%d %s :%s", code, recv_params(buf, sizeof(buf), p, 1), p->trailing);
+	return 0;
+}
 
-		if (p->trailing)
-			newline(s->channel, 0, "--", p->trailing);
+static int
+recv_rpl_welcome(char *err, parsed_mesg *p, server *s)
+{
+	/* 001 :<Welcome message>
+	 *
+	 * Establishing new connection with a server, handle any channel
+	 * auto-join or rejoins */
 
-		newlinef(s->channel, 0, "--", "You are known as %s", s->nick);
-		return 0;
+	channel *c;
+	int ret;
 
+	/* Reset list of auto nicks */
+	s->nptr = s->nicks;
 
-	case RPL_YOURHOST:  /* 002 :<Host info, server version, etc> */
-	case RPL_CREATED:   /* 003 :<Server creation date message> */
+	/* Auto join channels if first time connecting */
+	if (s->join) {
+		ret = sendf_prio(err, s, SEND_PRIO_BULK, "JOIN %s", s->join);
+		free(s->join);
+		s->join = NULL;
+		fail_if(ret);
+	} else {
+		/* If reconnecting to server, join any non-parted channels */
+		c = s->channel;
+		do {
+			if (c->buffer.type == BUFFER_CHANNEL && !c->parted)
+				fail_if(sendf_prio(err, s, SEND_PRIO_BULK, "JOIN %s", c->name));
+			c = c->next;
+		} while (c != s->channel);
+	}
 
+	if (p->trailing)
 		newline(s->channel, 0, "--", p->trailing);
-		return 0;
 
+	newlinef(s->channel, 0, "--", "You are known as %s", s->nick);
+	return 0;
+}
 
-	case RPL_MYINFO:    /* 004 <params> :Are supported by this server */
-	case RPL_ISUPPORT:  /* 005 <params> :Are supported by this server */
+static int
+recv_rpl_trailing(char *err, parsed_mesg *p, server *s)
+{
+	/* Numerics printed as their trailing message:
+	 *
+	 * 002 :<Host info, server version, etc>
+	 * 003 :<Server creation date message>
+	 * 250 :<Message>
+	 * 251 :<Message>
+	 * 255 :I have <int> clients and <int> servers
+	 * 265 <int> <int> :Local users <int>, max <int>
+	 * 266 <int> <int> :Global users <int>, max <int>
+	 * 372 :- <text>
+	 * 375 :- <server> Message of the day -
+	 */
 
-		newlinef(s->channel, 0, "--", "%s ~ supported by this server", p->params);
-		return 0;
+	UNUSED(err);
+
+	newline(s->channel, 0, "--", p->trailing);
+	return 0;
+}
+
+static int
+recv_rpl_supported(char *err, parsed_mesg *p, server *s)
+{
+	/* 004 <params> :Are supported by this server
+	 * 005 <params> :Are supported by this server */
+
+	char buf[BUFFSIZE], *token, *value;
+	unsigned int i, n = p->n_params - (p->trailing != NULL);
 
+	UNUSED(err);
 
-	default:
+	newlinef(s->channel, 0, "--", "%s ~ supported by this server", recv_params(buf, sizeof(buf), p, 1));
 
-		newlinef(s->channel, 0, "UNHANDLED", "%d %s :%s", code, p->params, p->trailing);
+	if (strcmp(p->command, "005"))
 		return 0;
+
+	/* <token>[=<value>] sets a token, -<token> negates it */
+	for (i = 1; i < n; i++) {
+
+		token = p->params[i];
+
+		if (*token == '-') {
+			recv_isupport(s, token + 1, NULL);
+			continue;
+		}
+
+		if ((value = strchr(token, '=')))
+			*value++ = '\0';
+
+		recv_isupport(s, token, value ? value : "");
 	}
 
-num_200:
+	return 0;
+}
 
-	/* Numeric types (200, 400) */
-	switch (code) {
+static int
+recv_rpl_lusercount(char *err, parsed_mesg *p, server *s)
+{
+	/* 252 <int> :IRC Operators online
+	 * 253 <int> :Unknown connections
+	 * 254 <int> :Channels formed */
 
-	/* 328 <channel> :<url> */
-	case RPL_CHANNEL_URL:
+	char *num;
 
-		if (!(chan = getarg(&p->params, " ")))
-			fail("RPL_CHANNEL_URL: channel is null");
+	UNUSED(err);
 
-		if ((c = channel_get(chan, s)) == NULL)
-			failf("RPL_CHANNEL_URL: channel '%s' not found", chan);
+	if (!(num = p->params[1]) || num == p->trailing)
+		num = "NULL";
 
-		newlinef(c, 0, "--", "URL for %s is: \"%s\"", chan, p->trailing);
-		return 0;
+	newlinef(s->channel, 0, "--", "%s %s", num, p->trailing);
+	return 0;
+}
 
+static int
+recv_rpl_channel_url(char *err, parsed_mesg *p, server *s)
+{
+	/* 328 <channel> :<url> */
 
-	/* 332 <channel> :<topic> */
-	case RPL_TOPIC:
+	char *chan;
+	channel *c;
 
-		if (!(chan = getarg(&p->params, " ")))
-			fail("RPL_TOPIC: channel is null");
+	if (!(chan = p->params[1]))
+		fail("RPL_CHANNEL_URL: channel is null");
 
-		if ((c = channel_get(chan, s)) == NULL)
-			failf("RPL_TOPIC: channel '%s' not found", chan);
+	if ((c = channel_get(chan, s)) == NULL)
+		failf("RPL_CHANNEL_URL: channel '%s' not found", chan);
 
-		newlinef(c, 0, "--", "Topic for %s is \"%s\"", chan, p->trailing);
-		return 0;
+	newlinef(c, 0, "--", "URL for %s is: \"%s\"", chan, p->trailing);
+	return 0;
+}
 
+static int
+recv_rpl_ignored(char *err, parsed_mesg *p, server *s)
+{
+	/* Not printing these:
+	 *
+	 * 331 <chan> :<Message>
+	 * 366 <chan> :<Message>
+	 * 376 :End of MOTD command
+	 */
 
-	/* 333 <channel> <nick> <time> */
-	case RPL_TOPICWHOTIME:
+	UNUSED(err);
+	UNUSED(p);
+	UNUSED(s);
 
-		if (!(chan = getarg(&p->params, " ")))
-			fail("RPL_TOPICWHOTIME: channel is null");
+	return 0;
+}
 
-		if (!(nick = getarg(&p->params, " ")))
-			fail("RPL_TOPICWHOTIME: nick is null");
+static int
+recv_rpl_topic(char *err, parsed_mesg *p, server *s)
+{
+	/* 332 <channel> :<topic> */
 
-		if (!(time = getarg(&p->params, " ")))
-			fail("RPL_TOPICWHOTIME: time is null");
+	char *chan;
+	channel *c;
 
-		if ((c = channel_get(chan, s)) == NULL)
-			failf("RPL_TOPICWHOTIME: channel '%s' not found", chan);
+	if (!(chan = p->params[1]))
+		fail("RPL_TOPIC: channel is null");
 
-		time_t raw_time = atoi(time);
-		time = ctime(&raw_time);
+	if ((c = channel_get(chan, s)) == NULL)
+		failf("RPL_TOPIC: channel '%s' not found", chan);
 
-		newlinef(c, 0, "--", "Topic set by %s, %s", nick, time);
-		return 0;
+	newlinef(c, 0, "--", "Topic for %s is \"%s\"", chan, p->trailing);
+	return 0;
+}
 
+static int
+recv_rpl_topicwhotime(char *err, parsed_mesg *p, server *s)
+{
+	/* 333 <channel> <nick> <time> */
 
-	/* 353 ("="/"*"/"@") <channel> :*([ "@" / "+" ]<nick>) */
-	case RPL_NAMREPLY:
+	char *chan, *nick, *time;
+	channel *c;
+	time_t raw_time;
 
-		/* @:secret   *:private   =:public */
-		if (!(type = getarg(&p->params, " ")))
-			fail("RPL_NAMEREPLY: type is null");
+	if (!(chan = p->params[1]))
+		fail("RPL_TOPICWHOTIME: channel is null");
 
-		if (!(chan = getarg(&p->params, " ")))
-			fail("RPL_NAMEREPLY: channel is null");
+	if (!(nick = p->params[2]))
+		fail("RPL_TOPICWHOTIME: nick is null");
 
-		if ((c = channel_get(chan, s)) == NULL)
-			failf("RPL_NAMEREPLY: channel '%s' not found", chan);
+	if (!(time = p->params[3]))
+		fail("RPL_TOPICWHOTIME: time is null");
 
-		c->type_flag = *type;
+	if ((c = channel_get(chan, s)) == NULL)
+		failf("RPL_TOPICWHOTIME: channel '%s' not found", chan);
 
-		while ((nick = getarg(&p->trailing, " "))) {
-			if (*nick == '@' || *nick == '+')
-				nick++;
-			if (avl_add(&c->nicklist, nick, NULL))
-				c->nick_count++;
-		}
+	raw_time = atoi(time);
+	time = ctime(&raw_time);
 
-		draw_status();
-		return 0;
+	newlinef(c, 0, "--", "Topic set by %s, %s", nick, time);
+	return 0;
+}
 
+static int
+recv_rpl_namreply(char *err, parsed_mesg *p, server *s)
+{
+	/* 353 ("="/"*"/"@") <channel> :*([ "@" / "+" ]<nick>) */
 
-	case RPL_STATSCONN:    /* 250 :<Message> */
-	case RPL_LUSERCLIENT:  /* 251 :<Message> */
+	char *chan, *nick, *nicks, *type;
+	channel *c;
 
-		newline(s->channel, 0, "--", p->trailing);
-		return 0;
+	/* @:secret   *:private   =:public */
+	if (!(type = p->params[1]))
+		fail("RPL_NAMEREPLY: type is null");
 
+	if (!(chan = p->params[2]))
+		fail("RPL_NAMEREPLY: channel is null");
 
-	case RPL_LUSEROP:        /* 252 <int> :IRC Operators online */
-	case RPL_LUSERUNKNOWN:   /* 253 <int> :Unknown connections */
-	case RPL_LUSERCHANNELS:  /* 254 <int> :Channels formed */
+	if ((c = channel_get(chan, s)) == NULL)
+		failf("RPL_NAMEREPLY: channel '%s' not found", chan);
 
-		if (!(num = getarg(&p->params, " ")))
-			num = "NULL";
+	c->type_flag = *type;
 
-		newlinef(s->channel, 0, "--", "%s %s", num, p->trailing);
-		return 0;
+	nicks = p->params[3];
 
+	/* Held until RPL_ENDOFNAMES, then added at once */
+	while ((nick = getarg(&nicks, " "))) {
+		/* Skip any nick prefixes, all are sent with multi-prefix */
+		nick += strspn(nick, s->isupport.prefix_chars);
+		nicklist_names_add(c, nick);
+	}
 
-	case RPL_LUSERME:      /* 255 :I have <int> clients and <int> servers */
-	case RPL_LOCALUSERS:   /* 265 <int> <int> :Local users <int>, max <int> */
-	case RPL_GLOBALUSERS:  /* 266 <int> <int> :Global users <int>, max <int> */
-	case RPL_MOTD:         /* 372 :- <text> */
-	case RPL_MOTDSTART:    /* 375 :- <server> Message of the day - */
+	return 0;
+}
 
-		newline(s->channel, 0, "--", p->trailing);
-		return 0;
+static int
+recv_rpl_endofnames(char *err, parsed_mesg *p, server *s)
+{
+	/* 366 <channel> :End of NAMES list */
+
+	char *chan;
+	channel *c;
 
+	if (!(chan = p->params[1]))
+		fail("RPL_ENDOFNAMES: channel is null");
 
-	/* Not printing these */
-	case RPL_NOTOPIC:     /* 331 <chan> :<Message> */
-	case RPL_ENDOFNAMES:  /* 366 <chan> :<Message> */
-	case RPL_ENDOFMOTD:   /* 376 :End of MOTD command */
+	/* Channel not found, e.g. the reply to /names for a channel not joined */
+	if ((c = channel_get(chan, s)) == NULL)
 		return 0;
 
+	nicklist_names_end(c);
 
-	default:
+	draw_status();
+	return 0;
+}
 
-		newlinef(s->channel, 0, "UNHANDLED", "%d %s :%s", code, p->params, p->trailing);
-		return 0;
-	}
+static int
+recv_err_nosuch(char *err, parsed_mesg *p, server *s, const char *null_err)
+{
+	/* <nick/server/channel> :<reason> */
+
+	char *targ;
+	channel *c;
 
-num_400:
+	if (!(targ = p->params[1]) || targ == p->trailing)
+		fail(null_err);
 
-	/* Numeric types (400, 600) */
-	switch (code) {
+	/* Private buffer might not exist */
+	if ((c = channel_get(targ, s)) == NULL)
+		c = s->channel;
 
-	case ERR_NOSUCHNICK:    /* <nick> :<reason> */
-	case ERR_NOSUCHSERVER:  /* <server> :<reason> */
-	case ERR_NOSUCHCHANNEL: /* <channel> :<reason> */
+	if (p->trailing)
+		newlinef(c, 0, "--", "Cannot send to '%s': %s", targ, p->trailing);
+	else
+		newlinef(c, 0, "--", "Cannot send to '%s'", targ);
+	return 0;
+}
 
-		if (!(targ = getarg(&p->params, " "))) {
-			if (code == ERR_NOSUCHNICK)
-				fail("ERR_NOSUCHNICK: nick is null");
-			if (code == ERR_NOSUCHSERVER)
-				fail("ERR_NOSUCHSERVER: server is null");
-			if (code == ERR_NOSUCHCHANNEL)
-				fail("ERR_NOSUCHCHANNEL: channel is null");
-		}
+static int
+recv_err_nosuchnick(char *err, parsed_mesg *p, server *s)
+{
+	/* 401 <nick> :<reason> */
 
-		/* Private buffer might not exist */
-		if ((c = channel_get(targ, s)) == NULL)
-			c = s->channel;
+	return recv_err_nosuch(err, p, s, "ERR_NOSUCHNICK: nick is null");
+}
 
-		if (p->trailing)
-			newlinef(c, 0, "--", "Cannot send to '%s': %s", targ, p->trailing);
-		else
-			newlinef(c, 0, "--", "Cannot send to '%s'", targ);
-		return 0;
+static int
+recv_err_nosuchserver(char *err, parsed_mesg *p, server *s)
+{
+	/* 402 <server> :<reason> */
 
+	return recv_err_nosuch(err, p, s, "ERR_NOSUCHSERVER: server is null");
+}
 
-	case ERR_CANNOTSENDTOCHAN:  /* <channel> :<reason> */
+static int
+recv_err_nosuchchannel(char *err, parsed_mesg *p, server *s)
+{
+	/* 403 <channel> :<reason> */
 
-		if (!(chan = getarg(&p->params, " ")))
-			fail("ERR_CANNOTSENDTOCHAN: channel is null");
+	return recv_err_nosuch(err, p, s, "ERR_NOSUCHCHANNEL: channel is null");
+}
 
-		/* Channel buffer might not exist */
-		if ((c = channel_get(chan, s)) == NULL)
-			c = s->channel;
+static int
+recv_err_cannotsendtochan(char *err, parsed_mesg *p, server *s)
+{
+	/* 404 <channel> :<reason> */
 
-		if (p->trailing)
-			newlinef(c, 0, "--", "Cannot send to '%s': %s", chan, p->trailing);
-		else
-			newlinef(c, 0, "--", "Cannot send to '%s'", chan);
-		return 0;
+	char *chan;
+	channel *c;
 
+	if (!(chan = p->params[1]) || chan == p->trailing)
+		fail("ERR_CANNOTSENDTOCHAN: channel is null");
 
-	case ERR_ERRONEUSNICKNAME:  /* 432 <nick> :<reason> */
+	/* Channel buffer might not exist */
+	if ((c = channel_get(chan, s)) == NULL)
+		c = s->channel;
 
-		if (!(nick = getarg(&p->params, " ")))
-			fail("ERR_ERRONEUSNICKNAME: nick is null");
+	if (p->trailing)
+		newlinef(c, 0, "--", "Cannot send to '%s': %s", chan, p->trailing);
+	else
+		newlinef(c, 0, "--", "Cannot send to '%s'", chan);
+	return 0;
+}
 
-		newlinef(s->channel, 0, "-!!-", "'%s' - %s", nick, p->trailing);
-		return 0;
+static int
+recv_err_erroneusnickname(char *err, parsed_mesg *p, server *s)
+{
+	/* 432 <nick> :<reason> */
 
-	case ERR_NICKNAMEINUSE:  /* 433 <nick> :Nickname is already in use */
+	char *nick;
 
-		if (!(nick = getarg(&p->params, " ")))
-			fail("ERR_NICKNAMEINUSE: nick is null");
+	if (!(nick = p->params[1]) || nick == p->trailing)
+		fail("ERR_ERRONEUSNICKNAME: nick is null");
 
-		newlinef(s->channel, 0, "-!!-", "Nick '%s' in use", nick);
+	newlinef(s->channel, 0, "-!!-", "'%s' - %s", nick, p->trailing);
+	return 0;
+}
 
-		if (IS_ME(nick)) {
-			auto_nick(&(s->nptr), s->nick);
+static int
+recv_err_nicknameinuse(char *err, parsed_mesg *p, server *s)
+{
+	/* 433 <nick> :Nickname is already in use */
 
-			newlinef(s->channel, 0, "-!!-", "Trying again with '%s'", s->nick);
+	char *nick;
 
-			return sendf(err, s, "NICK %s", s->nick);
-		}
-		return 0;
+	if (!(nick = p->params[1]) || nick == p->trailing)
+		fail("ERR_NICKNAMEINUSE: nick is null");
 
+	newlinef(s->channel, 0, "-!!-", "Nick '%s' in use", nick);
 
-	default:
+	if (IS_ME(nick)) {
+		auto_nick(&(s->nptr), s->nick);
 
-		newlinef(s->channel, 0, "UNHANDLED", "%d %s :%s", code, p->params, p->trailing);
-		return 0;
-	}
+		newlinef(s->channel, 0, "-!!-", "Trying again with '%s'", s->nick);
 
+		return sendf_prio(err, s, SEND_PRIO_HIGH, "NICK %s", s->nick);
+	}
 	return 0;
 }
 
@@ -1353,15 +2274,17 @@ recv_part(char *err, parsed_mesg *p, server *s)
 {
 	/* :nick!user@hostname.domain PART <channel> [:message] */
 
-	char *targ;
+	char *targ, *mesg;
 	channel *c;
 
 	if (!p->from)
 		fail("PART: sender's nick is null");
 
-	if (!(targ = getarg(&p->params, " ")))
+	if (!(targ = p->params[0]))
 		fail("PART: target is null");
 
+	mesg = p->params[1];
+
 	if (IS_ME(p->from)) {
 
 		/* If receving a PART message from myself channel isn't found, assume it was closed */
@@ -1369,8 +2292,8 @@ recv_part(char *err, parsed_mesg *p, server *s)
 
 			part_channel(c);
 
-			if (p->trailing)
-				newlinef(c, 0, "<", "you have left %s (%s)", targ, p->trailing);
+			if (mesg)
+				newlinef(c, 0, "<", "you have left %s (%s)", targ, mesg);
 			else
 				newlinef(c, 0, "<", "you have left %s", targ);
 		}
@@ -1383,14 +2306,12 @@ recv_part(char *err, parsed_mesg *p, server *s)
 	if ((c = channel_get(targ, s)) == NULL)
 		failf("PART: channel '%s' not found", targ);
 
-	if (!avl_del(&c->nicklist, p->from))
+	if (!nicklist_del(c, p->from))
 		failf("PART: nick '%s' not found in '%s'", p->from, targ);
 
-	c->nick_count--;
-
 	if (c->nick_count < config.join_part_quit_threshold) {
-		if (p->trailing)
-			newlinef(c, 0, "<", "%s!%s has left %s (%s)", p->from, p->hostinfo, targ, p->trailing);
+		if (mesg)
+			newlinef(c, 0, "<", "%s!%s has left %s (%s)", p->from, p->hostinfo, targ, mesg);
 		else
 			newlinef(c, 0, "<", "%s!%s has left %s", p->from, p->hostinfo, targ);
 	}
@@ -1403,12 +2324,12 @@ recv_part(char *err, parsed_mesg *p, server *s)
 static int
 recv_ping(char *err, parsed_mesg *p, server *s)
 {
-	/* PING :<server> */
+	/* PING [:]<server> */
 
-	if (!p->trailing)
+	if (!p->params[0])
 		fail("PING: server is null");
 
-	return sendf(err, s, "PONG %s", p->trailing);
+	return sendf_prio(err, s, SEND_PRIO_HIGH, "PONG %s", p->params[0]);
 }
 
 static int
@@ -1416,11 +2337,13 @@ recv_pong(char *err, parsed_mesg *p, server *s)
 {
 	/*  PONG <server> [<server2>] */
 
+	char buf[BUFFSIZE];
+
 	UNUSED(err);
 
 	/*  PING sent explicitly by the user */
 	if (!s->pinging)
-		newlinef(ccur, 0, "!!", "PONG %s", p->params);
+		newlinef(ccur, 0, "!!", "PONG %s", recv_params(buf, sizeof(buf), p, 0));
 
 	s->pinging = 0;
 
@@ -1432,25 +2355,24 @@ recv_priv(char *err, parsed_mesg *p, server *s)
 {
 	/* :nick!user@hostname.domain PRIVMSG <target> :<message> */
 
-	char *targ;
+	char *targ, *mesg;
 	channel *c;
 
-	if (!p->trailing)
+	if (!(mesg = p->params[1]))
 		fail("PRIVMSG: message is null");
 
+	/* Privmesg or CTCP request from ignored user, do nothing */
+	if (ignore_match(&s->ignore, p->from, p->hostinfo))
+		return 0;
+
 	/* CTCP request */
-	if (*p->trailing == 0x01)
+	if (*mesg == 0x01)
 		return recv_ctcp_req(err, p, s);
 
 	if (!p->from)
 		fail("PRIVMSG: sender's nick is null");
 
-	/* Privmesg from ignored user, do nothing */
-	if (avl_get(ccur->server->ignore, p->from, strlen(p->from)))
-		return 0;
-
-	if (!(targ = getarg(&p->params, " ")))
-		fail("PRIVMSG: target is null");
+	targ = p->params[0];
 
 	/* Find the target channel */
 	if (IS_ME(targ)) {
@@ -1464,14 +2386,14 @@ recv_priv(char *err, parsed_mesg *p, server *s)
 	} else if ((c = channel_get(targ, s)) == NULL)
 		failf("PRIVMSG: channel '%s' not found", targ);
 
-	if (check_pinged(p->trailing, s->nick)) {
+	if (check_pinged(mesg, s->nick, s->casemap)) {
 
 		if (c != ccur)
 			c->active = ACTIVITY_PINGED;
 
-		newline(c, BUFFER_LINE_PINGED, p->from, p->trailing);
+		newline(c, BUFFER_LINE_PINGED, p->from, mesg);
 	} else
-		newline(c, BUFFER_LINE_CHAT, p->from, p->trailing);
+		newline(c, BUFFER_LINE_CHAT, p->from, mesg);
 
 	return 0;
 }
@@ -1481,22 +2403,29 @@ recv_quit(char *err, parsed_mesg *p, server *s)
 {
 	/* :nick!user@hostname.domain QUIT [:message] */
 
+	channel *c;
+	size_t i;
+	struct member *m;
+
 	if (!p->from)
 		fail("QUIT: sender's nick is null");
 
-	channel *c = s->channel;
-	do {
-		if (avl_del(&c->nicklist, p->from)) {
-			c->nick_count--;
-			if (c->nick_count < config.join_part_quit_threshold) {
-				if (p->trailing)
-					newlinef(c, 0, "<", "%s!%s has quit (%s)", p->from, p->hostinfo, p->trailing);
-				else
-					newlinef(c, 0, "<", "%s!%s has quit", p->from, p->hostinfo);
-			}
+	if ((m = member_get(s, p->from)) == NULL)
+		return 0;
+
+	/* Channels are removed from the end of the membership, which is freed
+	 * along with the last */
+	for (i = m->n; i--;) {
+
+		nicklist_del((c = m->channels[i]), p->from);
+
+		if (c->nick_count < config.join_part_quit_threshold) {
+			if (p->params[0])
+				newlinef(c, 0, "<", "%s!%s has quit (%s)", p->from, p->hostinfo, p->params[0]);
+			else
+				newlinef(c, 0, "<", "%s!%s has quit", p->from, p->hostinfo);
 		}
-		c = c->next;
-	} while (c != s->channel);
+	}
 
 	draw_status();
 
@@ -1509,23 +2438,23 @@ recv_topic(char *err, parsed_mesg *p, server *s)
 	/* :nick!user@hostname.domain TOPIC <channel> :[topic] */
 
 	channel *c;
-	char *targ;
+	char *targ, *topic;
 
 	if (!p->from)
 		fail("TOPIC: sender's nick is null");
 
-	if (!(targ = getarg(&p->params, " ")))
+	if (!(targ = p->params[0]))
 		fail("TOPIC: target is null");
 
-	if (!p->trailing)
+	if (!(topic = p->params[1]))
 		fail("TOPIC: topic is null");
 
 	if ((c = channel_get(targ, s)) == NULL)
 		failf("TOPIC: channel '%s' not found", targ);
 
-	if (*p->trailing) {
+	if (*topic) {
 		newlinef(c, 0, "--", "%s has changed the topic:", p->from);
-		newlinef(c, 0, "--", "\"%s\"", p->trailing);
+		newlinef(c, 0, "--", "\"%s\"", topic);
 	} else {
 		newlinef(c, 0, "--", "%s has unset the topic", p->from);
 	}
@@ -4,17 +4,18 @@
  * shouldnt be calling newline, new_channel, auto_nick, etc
  * */
 
-/* For addrinfo, getaddrinfo, getnameinfo */
+/* For getnameinfo, gai_strerror */
 #define _POSIX_C_SOURCE 200112L
 
 #include <fcntl.h>
 #include <netdb.h>
-#include <pthread.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/uio.h>
 
 #ifdef __FreeBSD__
 #include <sys/types.h>
@@ -23,7 +24,9 @@
 #endif
 
 #include "common.h"
+#include "dns.h"
 #include "state.h"
+#include "timer.h"
 
 #define SERVER_TIMEOUT_S 255 /* Latency time at which a server is considered to be timed out and a disconnect is issued */
 #define SERVER_LATENCY_S 125 /* Latency time at which to begin showing in the status bar */
@@ -37,32 +40,117 @@
 #error Server latency display time too low
 #endif
 
-/* Connection thread info */
-typedef struct connection_thread {
-	int socket;
-	int socket_tmp;
-	char *host;
-	char *port;
-	char error[MAX_ERROR];
-	char ipstr[INET6_ADDRSTRLEN];
-	pthread_t tid;
-} connection_thread;
+#define RECV_MESG_MAX (8191 + 512) /* Maximum received message length, IRCv3 tags and a 512 byte message */
+#define RECV_BUFFSIZE (32 * 1024)  /* Size of a server's receive buffer */
+
+#if RECV_BUFFSIZE <= RECV_MESG_MAX
+#error Receive buffer must be larger than the maximum message length
+#endif
+
+#define SENDQ_MAX (256 * 1024) /* Maximum number of bytes queued for sending to a server */
+#define SENDQ_IOV 64           /* Maximum number of lines written per writev */
 
-/* DLL of current servers */
+/* Line queued for sending, including the trailing \r\n */
+struct sendq_line
+{
+	size_t len;
+	struct sendq_line *next;
+	char buf[];
+};
+
+/* Delay between staggered connection attempts, RFC 8305 recommends 250ms */
+#define CONNECT_ATTEMPT_DELAY_MS 250
+
+/* Maximum number of servers connecting at once, others wait in a queue */
+#define CONNECT_INFLIGHT_MAX 4
+
+/* Connection attempt state
+ *
+ * The server's host is resolved asynchronously, then the addresses are raced
+ * with staggered non-blocking connect()s, alternating address families
+ * (RFC 8305, Happy Eyeballs). A new attempt is started every
+ * CONNECT_ATTEMPT_DELAY_MS, or immediately when an attempt fails, while
+ * earlier attempts are left in progress. The first socket to connect is kept
+ * and the rest are closed.
+ *
+ * Attempts in progress are polled for writability by the main loop, at which
+ * point their result is checked */
+typedef struct connection {
+	char error[MAX_ERROR];   /* Most recent attempt failure */
+	int *sockets;            /* Socket per address, -1 if not in progress */
+	size_t addr_i;           /* Next address to attempt */
+	size_t addr_n;
+	size_t pending;          /* Number of attempts in progress */
+	size_t polled;           /* Number of attempts in the main loop's pollfd set */
+	struct dns_addr *addrs;  /* Resolved addresses, in attempt order */
+	struct dns_query *query; /* Pending lookup */
+	struct timer attempt;    /* Next staggered attempt */
+} connection;
+
+/* DLL of current servers, in display order */
 static server *server_head;
 
-static server* new_server(char*, char*, char*, char*);
-static void free_server(server*);
+/* Registry of current servers, indexed by "host:port", and listed in no
+ * particular order for polling */
+static struct
+{
+	server **list;
+	size_t n;
+	size_t size;
+	struct hmap index;
+} servers;
+
+/* Servers waiting to connect, FIFO */
+static struct
+{
+	server *head;
+	server *tail;
+	unsigned int inflight; /* Number of servers connecting */
+} connect_queue;
 
-static int check_connect(server*);
-static int check_latency(server*, time_t);
-static int check_reconnect(server*, time_t);
-static int check_socket(server*, time_t);
+/* Number of servers waiting to auto reconnect, and the timer updating
+ * their countdown in the status bar */
+static unsigned int reconnect_n;
+static struct timer reconnect_tick_timer;
 
-static void connected(server*);
+static server* new_server(char*, char*, char*, char*);
+static void free_server(server*);
 
-static void* threaded_connect(void*);
-static void threaded_connect_cleanup(void*);
+static server* server_get(const char*, const char*);
+static void server_key(char*, const char*, const char*);
+static void server_register(server*);
+static void server_unregister(server*);
+
+static int check_connect(server*, struct pollfd*, size_t);
+static int check_socket(server*);
+
+static void check_latency(void*);
+static void check_reconnect(void*);
+
+static void reconnect_cancel(server*);
+static void reconnect_schedule(server*);
+static void reconnect_tick(void*);
+
+static void recv_lines(server*);
+static void recv_overlong(server*);
+
+static int connect_next(server*);
+static int vsendf(char*, server*, enum send_prio, const char*, va_list);
+static int sendq_flush(server*);
+static void sendq_release(server*);
+static void sendq_timer(void*);
+static void sendq_free(server*);
+
+static void connected(server*, size_t);
+static void connect_attempt(void*);
+static void connect_dequeue(void);
+static void connect_enqueue(server*);
+static void connect_start(server*);
+static void connect_unqueue(server*);
+static void connect_fail(server*);
+static void connect_free(server*);
+static void connect_order(struct dns_addr*, const struct dns_addr*, size_t, int);
+static void connect_resolved(void*, const struct dns_result*);
 
 /* FIXME: reorganize, this is a temporary fix in order to retrieve
  * the first/last channels for drawing purposes. */
@@ -82,7 +170,7 @@ new_server(char *host, char *port, char *join, char *nicks)
 
 	/* Set non-zero default fields */
 	s->soc = -1;
-	s->iptr = s->input;
+	s->pfd = -1;
 	s->host = strdup(host);
 	s->port = strdup(port);
 
@@ -96,12 +184,23 @@ new_server(char *host, char *port, char *join, char *nicks)
 
 	s->nptr = s->nicks;
 
+	s->flood_burst = config.flood_burst;
+	s->flood_interval = config.flood_interval;
+
+	timer_init(&s->latency_timer, check_latency, s);
+	timer_init(&s->reconnect_timer, check_reconnect, s);
+	timer_init(&s->sendq_timer, sendq_timer, s);
+
 	auto_nick(&(s->nptr), s->nick);
 
 	s->channel = new_channel(host, s, NULL, BUFFER_SERVER);
 
+	recv_reset(s);
+
 	DLL_ADD(server_head, s);
 
+	server_register(s);
+
 	return s;
 }
 
@@ -116,6 +215,17 @@ free_server(server *s)
 		free_channel(t);
 	} while (c != s->channel);
 
+	timer_cancel(&s->latency_timer);
+	timer_cancel(&s->sendq_timer);
+
+	reconnect_cancel(s);
+
+	hmap_free(&s->channels);
+	hmap_free(&s->members);
+	ignore_free(&s->ignore);
+
+	free(s->recv.buf);
+	free(s->key);
 	free(s->host);
 	free(s->port);
 	free(s->join);
@@ -123,27 +233,133 @@ free_server(server *s)
 	free(s);
 }
 
+static void
+server_key(char *key, const char *host, const char *port)
+{
+	/* Write a server's registry key, "host:port" */
+
+	size_t len = strlen(host);
+
+	memcpy(key, host, len);
+	key[len] = ':';
+	strcpy(key + len + 1, port);
+}
+
+static server*
+server_get(const char *host, const char *port)
+{
+	/* Return the server matching host:port, if any */
+
+	char buf[256], *key = buf;
+	size_t len = strlen(host) + strlen(port) + 2;
+	server *s;
+
+	if (len > sizeof(buf) && (key = malloc(len)) == NULL)
+		fatal("malloc");
+
+	server_key(key, host, port);
+
+	s = hmap_get(&servers.index, key);
+
+	if (key != buf)
+		free(key);
+
+	return s;
+}
+
+static void
+server_register(server *s)
+{
+	if ((s->key = malloc(strlen(s->host) + strlen(s->port) + 2)) == NULL)
+		fatal("malloc");
+
+	server_key(s->key, s->host, s->port);
+
+	if (!hmap_add(&servers.index, s->key, s))
+		fatal("server already registered");
+
+	if (servers.n == servers.size) {
+
+		servers.size = servers.size ? servers.size * 2 : 16;
+
+		if ((servers.list = realloc(servers.list, servers.size * sizeof(*servers.list))) == NULL)
+			fatal("realloc");
+	}
+
+	s->registry_i = servers.n;
+	servers.list[servers.n++] = s;
+}
+
+static void
+server_unregister(server *s)
+{
+	/* Remove a server from the registry, the last listed server takes its place */
+
+	hmap_del(&servers.index, s->key);
+
+	servers.list[s->registry_i] = servers.list[--servers.n];
+	servers.list[s->registry_i]->registry_i = s->registry_i;
+
+	if (servers.n == 0) {
+		hmap_free(&servers.index);
+		free(servers.list);
+		servers.list = NULL;
+		servers.size = 0;
+	}
+}
+
 int
 sendf(char *err, server *s, const char *fmt, ...)
 {
-	/* Send a formatted message to a server.
+	/* Send a formatted message to a server, with user priority */
+
+	int ret;
+	va_list ap;
+
+	va_start(ap, fmt);
+	ret = vsendf(err, s, SEND_PRIO_USER, fmt, ap);
+	va_end(ap);
+
+	return ret;
+}
+
+int
+sendf_prio(char *err, server *s, enum send_prio prio, const char *fmt, ...)
+{
+	/* Send a formatted message to a server, with the given priority */
+
+	int ret;
+	va_list ap;
+
+	va_start(ap, fmt);
+	ret = vsendf(err, s, prio, fmt, ap);
+	va_end(ap);
+
+	return ret;
+}
+
+static int
+vsendf(char *err, server *s, enum send_prio prio, const char *fmt, va_list ap)
+{
+	/* Queue a formatted message to be sent to a server.
+	 *
+	 * Messages are queued by priority and released to the socket as the
+	 * server's flood control allows, see sendq_release.
 	 *
 	 * Returns non-zero on failure and prints the error message to the buffer pointed
 	 * to by err.
 	 */
 
 	char sendbuff[BUFFSIZE];
-	int soc, len;
-	va_list ap;
+	int len;
+	struct sendq_line *l;
 
-	if (s == NULL || (soc = s->soc) < 0) {
+	if (s == NULL || s->soc < 0) {
 		strncpy(err, "Error: Not connected to server", MAX_ERROR);
 		return 1;
 	}
 
-	va_start(ap, fmt);
 	len = vsnprintf(sendbuff, BUFFSIZE-2, fmt, ap);
-	va_end(ap);
 
 	if (len < 0) {
 		strncpy(err, "Error: Invalid message format", MAX_ERROR);
@@ -155,6 +371,13 @@ sendf(char *err, server *s, const char *fmt, ...)
 		return 1;
 	}
 
+	/* Lines are never dropped, refuse to queue more than the socket will accept */
+	if (s->sendq.bytes + len + 2 > SENDQ_MAX && (sendq_flush(s) || s->sendq.bytes + len + 2 > SENDQ_MAX)) {
+		if (err)
+			snprintf(err, MAX_ERROR, "Error: Send queue full (%zu lines pending)", s->sendq.lines);
+		return 1;
+	}
+
 #ifdef DEBUG
 	newline(s->channel, 0, "DEBUG >>", sendbuff);
 #endif
@@ -162,36 +385,206 @@ sendf(char *err, server *s, const char *fmt, ...)
 	sendbuff[len++] = '\r';
 	sendbuff[len++] = '\n';
 
-	if (send(soc, sendbuff, len, 0) < 0) {
-		snprintf(err, MAX_ERROR, "Error: %s", strerror(errno));
-		return 1;
+	if ((l = malloc(sizeof(*l) + len)) == NULL)
+		fatal("malloc");
+
+	memcpy(l->buf, sendbuff, len);
+	l->len = len;
+	l->next = NULL;
+
+	if (s->sendq.prio[prio].tail)
+		s->sendq.prio[prio].tail->next = l;
+	else
+		s->sendq.prio[prio].head = l;
+
+	s->sendq.prio[prio].tail = l;
+	s->sendq.bytes += len;
+	s->sendq.lines++;
+
+	/* Protocol messages are never held back */
+	if (prio == SEND_PRIO_HIGH)
+		sendq_release(s);
+
+	return 0;
+}
+
+static void
+sendq_release(server *s)
+{
+	/* Move queued lines to the socket's queue, highest priority first, as
+	 * the server's token bucket allows.
+	 *
+	 * The bucket holds up to flood_burst tokens and gains one every
+	 * flood_interval milliseconds. Sending a line costs a token. High priority
+	 * lines are always released, and may leave the bucket in debt.
+	 *
+	 * When lines are held back, the sendq timer is armed for the next token */
+
+	enum send_prio prio;
+	long now, max;
+	struct sendq_line *l;
+
+	now = timer_now();
+	max = (long)s->flood_burst * s->flood_interval;
+
+	/* Tokens are counted in milliseconds of sending time */
+	s->sendq.tokens += now - s->sendq.refill;
+	s->sendq.refill = now;
+
+	if (s->sendq.tokens > max)
+		s->sendq.tokens = max;
+
+	for (prio = SEND_PRIO_HIGH; prio < SEND_PRIO_T_SIZE; prio++) {
+
+		while ((l = s->sendq.prio[prio].head)) {
+
+			/* Wait for the next token */
+			if (prio != SEND_PRIO_HIGH && s->sendq.tokens < (long)s->flood_interval) {
+
+				if (!timer_pending(&s->sendq_timer))
+					timer_set(&s->sendq_timer, s->flood_interval - s->sendq.tokens);
+
+				return;
+			}
+
+			s->sendq.tokens -= s->flood_interval;
+
+			if ((s->sendq.prio[prio].head = l->next) == NULL)
+				s->sendq.prio[prio].tail = NULL;
+
+			l->next = NULL;
+
+			if (s->sendq.tail)
+				s->sendq.tail->next = l;
+			else
+				s->sendq.head = l;
+
+			s->sendq.tail = l;
+		}
+	}
+}
+
+static void
+sendq_timer(void *arg)
+{
+	/* Flood control allows releasing more lines, they're written by flush_servers */
+
+	sendq_release(arg);
+}
+
+static int
+sendq_flush(server *s)
+{
+	/* Write as much of a server's released lines as the socket accepts, batching
+	 * up to SENDQ_IOV lines per writev.
+	 *
+	 * Returns 0 when the queue is empty or the socket is full, otherwise the
+	 * write error */
+
+	struct iovec iov[SENDQ_IOV];
+	struct sendq_line *l;
+	size_t n, total;
+	ssize_t ret;
+	int iovcnt;
+
+	while (s->sendq.head) {
+
+		/* The first line may have been partially written */
+		iov[0].iov_base = s->sendq.head->buf + s->sendq.offset;
+		iov[0].iov_len = s->sendq.head->len - s->sendq.offset;
+
+		total = iov[0].iov_len;
+
+		for (iovcnt = 1, l = s->sendq.head->next; l && iovcnt < SENDQ_IOV; l = l->next, iovcnt++) {
+			iov[iovcnt].iov_base = l->buf;
+			iov[iovcnt].iov_len = l->len;
+			total += l->len;
+		}
+
+		if ((ret = writev(s->soc, iov, iovcnt)) < 0) {
+
+			if (errno == EINTR)
+				continue;
+
+			/* Socket is full, resumed when polled writable */
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+
+			return errno;
+		}
+
+		/* Free the lines written in full, keeping the offset into a partial write */
+		for (n = ret; n && n >= s->sendq.head->len - s->sendq.offset;) {
+
+			l = s->sendq.head;
+
+			n -= l->len - s->sendq.offset;
+
+			s->sendq.bytes -= l->len;
+			s->sendq.lines--;
+			s->sendq.offset = 0;
+
+			if ((s->sendq.head = l->next) == NULL)
+				s->sendq.tail = NULL;
+
+			free(l);
+		}
+
+		s->sendq.offset += n;
+
+		/* Short write, the socket is full */
+		if ((size_t)ret < total)
+			return 0;
 	}
 
 	return 0;
 }
 
+static void
+sendq_free(server *s)
+{
+	/* Discard all lines queued for sending to a server */
+
+	enum send_prio prio;
+	struct sendq_line *l;
+
+	while ((l = s->sendq.head)) {
+		s->sendq.head = l->next;
+		free(l);
+	}
+
+	for (prio = SEND_PRIO_HIGH; prio < SEND_PRIO_T_SIZE; prio++) {
+		while ((l = s->sendq.prio[prio].head)) {
+			s->sendq.prio[prio].head = l->next;
+			free(l);
+		}
+	}
+
+	memset(&s->sendq, 0, sizeof(s->sendq));
+
+	timer_cancel(&s->sendq_timer);
+}
+
 //FIXME: move the stateful stuff to state.c, only the connection relavent stuff should be here
-void
+server*
 server_connect(char *host, char *port, char *nicks, char *join)
 {
-	connection_thread *ct;
-	server *tmp, *s = NULL;
+	/* Connect to host:port, returning the server */
 
-	/* Check if server matching host:port already exists */
-	if ((tmp = server_head) != NULL) {
-		do {
-			if (!strcmp(tmp->host, host) && !strcmp(tmp->port, port)) {
-				s = tmp;
-				break;
-			}
-		} while ((tmp = tmp->next) != server_head);
-	}
+	server *s = server_get(host, port);
 
 	/* Check if server is already connected */
 	if (s && s->soc >= 0) {
 		channel_set_current(s->channel);
 		newlinef(s->channel, 0, "-!!-", "Already connected to %s:%s", host, port);
-		return;
+		return s;
+	}
+
+	/* Check if server is already connecting */
+	if (s && (s->connecting || s->queued)) {
+		channel_set_current(s->channel);
+		newlinef(s->channel, 0, "-!!-", "Already connecting to %s:%s", host, port);
+		return s;
 	}
 
 	if (s == NULL)
@@ -199,122 +592,351 @@ server_connect(char *host, char *port, char *nicks, char *join)
 
 	channel_set_current(s->channel);
 
+	/* Connecting manually replaces any pending auto reconnect */
+	reconnect_cancel(s);
+
+	connect_enqueue(s);
+
+	return s;
+}
+
+static void
+connect_enqueue(server *s)
+{
+	/* Begin connecting to a server, or queue it if too many are connecting */
+
+	if (connect_queue.inflight < CONNECT_INFLIGHT_MAX && connect_queue.head == NULL) {
+		connect_start(s);
+		return;
+	}
+
+	s->queued = 1;
+	s->queue_next = NULL;
+	s->queue_prev = connect_queue.tail;
+
+	if (connect_queue.tail)
+		connect_queue.tail->queue_next = s;
+	else
+		connect_queue.head = s;
+
+	connect_queue.tail = s;
+
+	newlinef(s->channel, 0, "--", "Waiting to connect to '%s' port %s", s->host, s->port);
+
+	if (current_channel()->server == s)
+		draw_status();
+}
+
+static void
+connect_dequeue(void)
+{
+	/* Begin connecting to queued servers, while under the limit.
+	 *
+	 * Connections that complete immediately call this again, the outermost
+	 * call continues dequeuing */
+
+	static int dequeuing;
+
+	server *s;
+
+	if (dequeuing)
+		return;
+
+	dequeuing = 1;
+
+	while (connect_queue.inflight < CONNECT_INFLIGHT_MAX && (s = connect_queue.head)) {
+
+		if ((connect_queue.head = s->queue_next) == NULL)
+			connect_queue.tail = NULL;
+		else
+			connect_queue.head->queue_prev = NULL;
+
+		s->queued = 0;
+
+		if (current_channel()->server == s)
+			draw_status();
+
+		connect_start(s);
+	}
+
+	dequeuing = 0;
+}
+
+static void
+connect_unqueue(server *s)
+{
+	/* Remove a server from the connection queue */
+
+	if (s->queue_prev)
+		s->queue_prev->queue_next = s->queue_next;
+	else
+		connect_queue.head = s->queue_next;
+
+	if (s->queue_next)
+		s->queue_next->queue_prev = s->queue_prev;
+	else
+		connect_queue.tail = s->queue_prev;
+
+	s->queued = 0;
+}
+
+static void
+connect_start(server *s)
+{
+	/* Begin a server's connection attempt by resolving its host */
+
+	connection *ct;
+	struct dns_query *q;
+
 	if ((ct = calloc(1, sizeof(*ct))) == NULL)
 		fatal("calloc");
 
-	ct->socket = -1;
-	ct->socket_tmp = -1;
-	ct->host = s->host;
-	ct->port = s->port;
+	timer_init(&ct->attempt, connect_attempt, s);
 
 	s->connecting = ct;
 
-	newlinef(s->channel, 0, "--", "Connecting to '%s' port %s", host, port);
+	connect_queue.inflight++;
+
+	newlinef(s->channel, 0, "--", "Connecting to '%s' port %s", s->host, s->port);
 
-	if ((pthread_create(&ct->tid, NULL, threaded_connect, ct)))
-		fatal("pthread_create");
+	/* Resolve host, cached results complete immediately and the connection
+	 * attempt state can't be assumed to still exist */
+	if ((q = dns_lookup(s->host, s->port, connect_resolved, s)))
+		ct->query = q;
 }
 
 static void
-connected(server *s)
+connect_resolved(void *arg, const struct dns_result *result)
 {
-	/* Server successfully connected, send IRC init messages */
+	/* Host lookup completed, begin connecting to the resolved addresses */
 
-	connection_thread *ct = s->connecting;
+	server *s = arg;
+	connection *ct = s->connecting;
 
-	if ((pthread_join(ct->tid, NULL)))
-		fatal("pthread_join");
+	size_t i;
 
-	if (*ct->ipstr)
-		newlinef(s->channel, 0, "--", "Connected to [%s]", ct->ipstr);
-	else
-		newlinef(s->channel, 0, "--", "Error determining server IP: %s", ct->error);
+	ct->query = NULL;
 
-	s->soc = ct->socket;
+	if (result->error) {
+		strncpy(ct->error, gai_strerror(result->error), MAX_ERROR - 1);
+		connect_fail(s);
+		return;
+	}
 
-	/* Set reconnect parameters to 0 in case this was an auto-reconnect */
-	s->reconnect_time = 0;
-	s->reconnect_delta = 0;
+	if ((ct->addrs = malloc(result->count * sizeof(*result->addrs))) == NULL)
+		fatal("malloc");
 
-	s->latency_time = time(NULL);
-	s->latency_delta = 0;
+	if ((ct->sockets = malloc(result->count * sizeof(*ct->sockets))) == NULL)
+		fatal("malloc");
 
-	//TODO: refactor these to mesg.c
-	sendf(NULL, s, "NICK %s", s->nick);
-	sendf(NULL, s, "USER %s 8 * :%s", config.username, config.realname);
+	for (i = 0; i < result->count; i++)
+		ct->sockets[i] = -1;
 
-	//FIXME: should the server send nick as is? compare the nick when it's received?
-	//or should auto_nick take a server argument and write to a buffer of NICKSIZE length?
+	/* Try the family that last connected successfully first, otherwise
+	 * the resolver's preferred family */
+	connect_order(ct->addrs, result->addrs, result->count,
+		s->af_pref ? s->af_pref : result->addrs[0].family);
+
+	ct->addr_i = 0;
+	ct->addr_n = result->count;
+
+	connect_next(s);
 }
 
-static void*
-threaded_connect(void *arg)
+static void
+connect_order(struct dns_addr *dst, const struct dns_addr *src, size_t n, int family)
 {
-	int ret;
-	struct addrinfo hints, *p, *servinfo = NULL;
+	/* Copy the addresses from src to dst, alternating between the given
+	 * family and all others, starting with the given family. The relative
+	 * order of addresses within each is kept */
 
-	/* Thread cleanup on error or external thread cancel */
-	pthread_cleanup_push(threaded_connect_cleanup, &servinfo);
+	size_t i = 0, j = 0, k = 0;
 
-	memset(&hints, 0, sizeof(hints));
+	while (k < n) {
 
-	/* IPv4 and/or IPv6 */
-	hints.ai_family = AF_UNSPEC;
-	hints.ai_flags = AI_PASSIVE;
-	hints.ai_socktype = SOCK_STREAM;
+		for (; i < n && src[i].family != family; i++)
+			;
 
-	connection_thread *ct = (connection_thread *)arg;
+		if (i < n)
+			dst[k++] = src[i++];
 
-	/* Resolve host */
-	if ((ret = getaddrinfo(ct->host, ct->port, &hints, &servinfo))) {
-		strncpy(ct->error, gai_strerror(ret), MAX_ERROR);
-		pthread_exit(NULL);
+		for (; j < n && src[j].family == family; j++)
+			;
+
+		if (j < n)
+			dst[k++] = src[j++];
 	}
+}
+
+static int
+connect_next(server *s)
+{
+	/* Begin a non-blocking connection attempt on the next resolved address.
+	 *
+	 * Addresses that fail immediately are skipped. On immediate success the
+	 * server is connected, and when no attempts remain the connection fails.
+	 * Otherwise the attempt's socket is left pending for the main loop to poll
+	 * and the next attempt is scheduled.
+	 *
+	 * Returns non-zero if the connection attempt state was freed */
+
+	connection *ct = s->connecting;
+	struct dns_addr *addr;
 
-	/* Attempt to connect to all address results */
-	for (p = servinfo; p != NULL; p = p->ai_next) {
+	int soc;
 
-		if ((ct->socket_tmp = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0)
+	for (; ct->addr_i < ct->addr_n; ct->addr_i++) {
+
+		addr = &ct->addrs[ct->addr_i];
+
+		if ((soc = socket(addr->family, addr->socktype, addr->protocol)) < 0) {
+			strerror_r(errno, ct->error, MAX_ERROR);
 			continue;
+		}
 
-		/* Break on success */
-		if (connect(ct->socket_tmp, p->ai_addr, p->ai_addrlen) == 0)
-			break;
+		/* Set non-blocking */
+		if (fcntl(soc, F_SETFL, O_NONBLOCK) < 0) {
+			strerror_r(errno, ct->error, MAX_ERROR);
+			close(soc);
+			continue;
+		}
 
-		close(ct->socket_tmp);
-	}
+		ct->sockets[ct->addr_i] = soc;
+
+		if (connect(soc, (struct sockaddr*)&addr->addr, addr->addrlen) == 0) {
+			connected(s, ct->addr_i);
+			return 1;
+		}
+
+		/* Connection pending, resumed by check_connect */
+		if (errno == EINPROGRESS) {
+			ct->pending++;
+			ct->addr_i++;
+			timer_set(&ct->attempt, CONNECT_ATTEMPT_DELAY_MS);
+			return 0;
+		}
 
-	if (p == NULL) {
 		strerror_r(errno, ct->error, MAX_ERROR);
-		pthread_exit(NULL);
+		ct->sockets[ct->addr_i] = -1;
+		close(soc);
 	}
 
-	/* Failing to get the numeric IP isn't a fatal connection error */
-	if ((ret = getnameinfo(p->ai_addr, p->ai_addrlen, ct->ipstr,
-					INET6_ADDRSTRLEN, NULL, 0, NI_NUMERICHOST))) {
-		strncpy(ct->error, gai_strerror(ret), MAX_ERROR);
-	}
+	if (ct->pending)
+		return 0;
 
-	/* Set non-blocking */
-	if ((ret = fcntl(ct->socket_tmp, F_SETFL, O_NONBLOCK)) < 0) {
-		strerror_r(errno, ct->error, MAX_ERROR);
-		pthread_exit(NULL);
+	connect_fail(s);
+
+	return 1;
+}
+
+static void
+connect_attempt(void *arg)
+{
+	/* Start the next staggered connection attempt */
+
+	connect_next(arg);
+}
+
+static void
+connect_free(server *s)
+{
+	/* Free a server's connection attempt state, closing any attempts in progress */
+
+	connection *ct = s->connecting;
+
+	size_t i;
+
+	if (ct->query)
+		dns_cancel(ct->query);
+
+	timer_cancel(&ct->attempt);
+
+	for (i = 0; ct->sockets && i < ct->addr_n; i++) {
+		if (ct->sockets[i] >= 0)
+			close(ct->sockets[i]);
 	}
 
-	ct->socket = ct->socket_tmp;
+	free(ct->addrs);
+	free(ct->sockets);
+	free(ct);
 
-	pthread_cleanup_pop(1);
+	s->connecting = NULL;
 
-	return NULL;
+	/* Let the next queued server connect */
+	connect_queue.inflight--;
+
+	connect_dequeue();
 }
 
 static void
-threaded_connect_cleanup(void *arg)
+connect_fail(server *s)
 {
-	struct addrinfo *servinfo = *(struct addrinfo **)arg;
+	/* All connection attempts have failed */
+
+	connection *ct = s->connecting;
+
+	newline(s->channel, 0, "-!!-", ct->error);
 
-	if (servinfo)
-		freeaddrinfo(servinfo);
+	/* If server was auto-reconnecting, increase the backoff */
+	if (s->reconnect_delta) {
+
+		if ((s->reconnect_delta *= 2) > RECONNECT_DELTA_MAX)
+			s->reconnect_delta = RECONNECT_DELTA_MAX;
+
+		reconnect_schedule(s);
+	}
+
+	connect_free(s);
+}
+
+static void
+connected(server *s, size_t i)
+{
+	/* Server successfully connected on the i'th address, send IRC init messages */
+
+	connection *ct = s->connecting;
+	struct dns_addr *addr = &ct->addrs[i];
+
+	int ret;
+	char ipstr[INET6_ADDRSTRLEN];
+
+	/* Failing to get the numeric IP isn't a fatal connection error */
+	if ((ret = getnameinfo((struct sockaddr*)&addr->addr, addr->addrlen, ipstr,
+					INET6_ADDRSTRLEN, NULL, 0, NI_NUMERICHOST)))
+		newlinef(s->channel, 0, "--", "Error determining server IP: %s", gai_strerror(ret));
+	else
+		newlinef(s->channel, 0, "--", "Connected to [%s]", ipstr);
+
+	/* Keep this socket, the other attempts are closed */
+	s->soc = ct->sockets[i];
+
+	if (s->recv.buf == NULL && (s->recv.buf = malloc(RECV_BUFFSIZE)) == NULL)
+		fatal("malloc");
+	s->af_pref = addr->family;
+
+	ct->sockets[i] = -1;
+
+	connect_free(s);
+
+	/* Reset the backoff in case this was an auto-reconnect */
+	s->reconnect_delta = 0;
+
+	s->latency_time = timer_now();
+	s->latency_delta = 0;
+
+	timer_set(&s->latency_timer, SERVER_LATENCY_PING_S * 1000L);
+
+	/* Start with a full token bucket */
+	s->sendq.tokens = (long)s->flood_burst * s->flood_interval;
+	s->sendq.refill = timer_now();
+
+	//TODO: refactor these to mesg.c
+	sendf_prio(NULL, s, SEND_PRIO_HIGH, "CAP LS 302");
+	sendf_prio(NULL, s, SEND_PRIO_HIGH, "NICK %s", s->nick);
+	sendf_prio(NULL, s, SEND_PRIO_HIGH, "USER %s 8 * :%s", config.username, config.realname);
+
+	//FIXME: should the server send nick as is? compare the nick when it's received?
+	//or should auto_nick take a server argument and write to a buffer of NICKSIZE length?
 }
 
 //TODO:
@@ -331,20 +953,15 @@ server_disconnect(server *s, int err, int kill, char *mesg)
 	 *   Free the server, update current channel
 	 */
 
-	/* Server connection in progress, cancel the connection attempt */
-	if (s->connecting) {
-
-		connection_thread *ct = s->connecting;
+	/* Server connection in progress or queued, cancel the connection attempt */
+	if (s->connecting || s->queued) {
 
-		if ((pthread_cancel(ct->tid)))
-			fatal("pthread_cancel");
-
-		/* There's a chance the thread is canceled with an open socket */
-		if (ct->socket_tmp)
-			close(ct->socket_tmp);
+		if (s->connecting)
+			connect_free(s);
+		else
+			connect_unqueue(s);
 
-		free(ct);
-		s->connecting = NULL;
+		s->reconnect_delta = 0;
 
 		newlinef(s->channel, 0, "--", "Connection to '%s' port %s canceled", s->host, s->port);
 	}
@@ -356,22 +973,29 @@ server_disconnect(server *s, int err, int kill, char *mesg)
 			/* If disconnecting due to error, attempt a reconnect */
 
 			newlinef(s->channel, 0, "ERROR", "%s", mesg);
-			newlinef(s->channel, 0, "--", "Attempting reconnect in %ds", RECONNECT_DELTA);
 
-			s->reconnect_time = time(NULL) + RECONNECT_DELTA;
 			s->reconnect_delta = RECONNECT_DELTA;
+
+			reconnect_schedule(s);
 		} else if (mesg) {
-			sendf(NULL, s, "QUIT :%s", mesg);
+			/* Best effort to send any pending lines along with the QUIT */
+			sendf_prio(NULL, s, SEND_PRIO_HIGH, "QUIT :%s", mesg);
+			sendq_flush(s);
 		}
 
 		close(s->soc);
+		sendq_free(s);
 
 		/* Set all server attributes back to default */
 		memset(s->usermodes, 0, MODE_SIZE);
 		s->soc = -1;
-		s->iptr = s->input;
+		s->recv.len = 0;
+		s->recv.discard = 0;
 		s->nptr = s->nicks;
 		s->latency_delta = 0;
+		s->pinging = 0;
+
+		timer_cancel(&s->latency_timer);
 
 		/* Reset the nick that reconnects will attempt to register with */
 		auto_nick(&(s->nptr), s->nick);
@@ -384,18 +1008,24 @@ server_disconnect(server *s, int err, int kill, char *mesg)
 			reset_channel(c);
 
 		} while ((c = c->next) != s->channel);
+
+		/* Drop open batches, negotiated capabilities and ISUPPORT tokens,
+		 * once the nicklists are emptied */
+		recv_reset(s);
 	}
 
 	/* Server was waiting to reconnect, cancel future attempt */
-	else if (s->reconnect_time) {
+	else if (timer_pending(&s->reconnect_timer)) {
 		newlinef(s->channel, 0, "--", "Auto reconnect attempt canceled");
 
-		s->reconnect_time = 0;
+		reconnect_cancel(s);
+
 		s->reconnect_delta = 0;
 	}
 
 	if (kill) {
 		DLL_DEL(server_head, s);
+		server_unregister(s);
 		free_server(s);
 	}
 }
@@ -404,158 +1034,405 @@ server_disconnect(server *s, int err, int kill, char *mesg)
  * Server polling functions
  * */
 
+size_t
+server_pollfds(struct pollfd *fds, size_t n)
+{
+	/* Fill fds with the sockets of all connected and connecting servers for the
+	 * main loop to poll, returning the number of entries required.
+	 *
+	 * A connecting server's attempts in progress occupy consecutive entries.
+	 * Entries beyond n are counted but not written, in which case the caller
+	 * should grow fds and call again */
+
+	connection *ct;
+	server *s;
+	size_t i = 0, j, k;
+
+	for (k = 0; k < servers.n; k++) {
+
+		s = servers.list[k];
+		s->pfd = -1;
+
+		/* Connection attempts in progress, poll for completion */
+		if ((ct = s->connecting)) {
+
+			ct->polled = 0;
+
+			for (j = 0; j < ct->addr_i; j++) {
+
+				if (ct->sockets[j] < 0)
+					continue;
+
+				if (i < n) {
+					fds[i].fd = ct->sockets[j];
+					fds[i].events = POLLOUT;
+					fds[i].revents = 0;
+
+					if (s->pfd < 0)
+						s->pfd = i;
+
+					ct->polled++;
+				}
+
+				i++;
+			}
+		}
+
+		else if (s->soc >= 0) {
+
+			if (i < n) {
+				fds[i].fd = s->soc;
+				fds[i].events = s->sendq.head ? (POLLIN | POLLOUT) : POLLIN;
+				fds[i].revents = 0;
+				s->pfd = i;
+			}
+
+			i++;
+		}
+	}
+
+	return i;
+}
+
 void
-check_servers(void)
+check_servers(struct pollfd *fds, size_t n)
 {
 	/* For each server, check the following, in order:
 	 *
 	 *  - Connection status. Skip the rest if unresolved
-	 *  - Ping timeout.      Skip the rest detected
-	 *  - Reconnect attempt. Skip the rest if successful
-	 *  - Socket input.      Consume all input
+	 *  - Socket input.      Consume the input if the socket was polled ready
+	 *
+	 * Deadlines (ping, timeout, reconnect) are handled by each server's timers
 	 *  */
 
-	/* TODO: there's probably a better order to check these */
-
 	server *s;
+	size_t i;
 
-	if ((s = server_head) == NULL)
-		return;
+	for (i = 0; i < servers.n; i++) {
 
-	time_t t = time(NULL);
+		s = servers.list[i];
 
-	do {
-		if (check_connect(s))
+		if (check_connect(s, fds, n))
 			continue;
 
-		if (check_latency(s, t))
+		if (s->pfd >= 0 && (size_t)s->pfd < n && fds[s->pfd].fd == s->soc
+				&& (fds[s->pfd].revents & (POLLIN | POLLERR | POLLHUP)))
+			check_socket(s);
+	}
+}
+
+void
+flush_servers(void)
+{
+	/* Write the lines queued for each connected server since the last flush,
+	 * or while its socket was full, as its flood control allows. Unsent lines
+	 * are left queued, and the socket is polled for writability or the main
+	 * loop wakes when more can be released */
+
+	int ret;
+	server *s;
+	size_t i;
+
+	for (i = 0; i < servers.n; i++) {
+
+		s = servers.list[i];
+
+		if (s->soc < 0)
 			continue;
 
-		if (check_reconnect(s, t))
+		sendq_release(s);
+
+		if (s->sendq.head && (ret = sendq_flush(s))) {
+			server_disconnect(s, 1, 0, strerror(ret));
 			continue;
+		}
 
-		check_socket(s, t);
+		/* Update the queue depth shown in the status bar */
+		if (s->sendq.backlog != s->sendq.lines) {
+			s->sendq.backlog = s->sendq.lines;
 
-	} while ((s = s->next) != server_head);
+			if (current_channel()->server == s)
+				draw_status();
+		}
+	}
 }
 
 static int
-check_connect(server *s)
+check_connect(server *s, struct pollfd *fds, size_t n)
 {
-	/* Check the server's connection thread status for success or failure */
+	/* Check the results of a server's connection attempts polled writable.
+	 *
+	 * The first successful attempt connects the server, failed attempts are
+	 * closed and immediately followed by the next address */
 
-	if (!s->connecting)
+	connection *ct;
+	size_t i, j;
+
+	int soc_err;
+	socklen_t len;
+
+	if ((ct = s->connecting) == NULL)
 		return 0;
 
-	connection_thread *ct = (connection_thread*)s->connecting;
+	/* Host lookup in progress */
+	if (ct->addrs == NULL)
+		return 1;
 
-	/* Connection Success */
-	if (ct->socket >= 0) {
-		connected(s);
+	for (j = 0; s->pfd >= 0 && j < ct->polled && s->pfd + j < n; j++) {
 
-	/* Connection failure */
-	} else if (*ct->error) {
-		newline(s->channel, 0, "-!!-", ct->error);
+		struct pollfd *pfd = &fds[s->pfd + j];
 
-		/* If server was auto-reconnecting, increase the backoff */
-		if (s->reconnect_time) {
-			s->reconnect_delta *= 2;
-			s->reconnect_time += s->reconnect_delta;
+		if (!pfd->revents)
+			continue;
+
+		for (i = 0; i < ct->addr_i && ct->sockets[i] != pfd->fd; i++)
+			;
+
+		/* Attempt already closed */
+		if (i == ct->addr_i)
+			continue;
 
-			newlinef(s->channel, 0, "--", "Attempting reconnect in %ds", s->reconnect_delta);
+		len = sizeof(soc_err);
+
+		if (getsockopt(pfd->fd, SOL_SOCKET, SO_ERROR, &soc_err, &len) < 0)
+			soc_err = errno;
+
+		/* Connection success */
+		if (soc_err == 0) {
+			connected(s, i);
+			return 1;
 		}
 
-	/* Connection in progress */
-	} else {
-		return 1;
-	}
+		/* Connection failure, start the next attempt without waiting */
+		strerror_r(soc_err, ct->error, MAX_ERROR);
+		close(ct->sockets[i]);
 
-	free(ct);
-	s->connecting = NULL;
+		ct->sockets[i] = -1;
+		ct->pending--;
+
+		if (connect_next(s))
+			return 1;
+	}
 
 	return 1;
 }
 
-static int
-check_latency(server *s, time_t t)
+static void
+check_latency(void *arg)
 {
-	/* Check time since last message */
-
-	time_t delta;
+	/* Latency timer, armed for the next threshold since the last message was
+	 * received. Input doesn't re-arm the timer, so it may fire early, and is
+	 * then re-armed from the time of the last message:
+	 *
+	 *  - SERVER_LATENCY_PING_S: send a PING
+	 *  - SERVER_LATENCY_S:      show the latency in the status bar, updated every second
+	 *  - SERVER_TIMEOUT_S:      disconnect
+	 */
 
-	if (s->soc < 0)
-		return 0;
+	server *s = arg;
 
-	delta = t - s->latency_time;
+	long delta = timer_now() - s->latency_time;
 
-	/* Server has timed out */
-	if (delta > SERVER_TIMEOUT_S) {
-		server_disconnect(s, 1, 0, "Ping timeout (" STR(SERVER_TIMEOUT_S) ")");
-		return 1;
+	if (delta < SERVER_LATENCY_PING_S * 1000L) {
+		timer_set(&s->latency_timer, SERVER_LATENCY_PING_S * 1000L - delta);
+		return;
 	}
 
 	/* Server might be timing out, attempt to PING */
-	if (delta > SERVER_LATENCY_PING_S && !s->pinging) {
-		sendf(NULL, s, "PING :%s", s->host);
+	if (!s->pinging) {
+		sendf_prio(NULL, s, SEND_PRIO_HIGH, "PING :%s", s->host);
 		s->pinging = 1;
 	}
 
+	if (delta < SERVER_LATENCY_S * 1000L) {
+		timer_set(&s->latency_timer, SERVER_LATENCY_S * 1000L - delta);
+		return;
+	}
+
+	/* Server has timed out */
+	if (delta > SERVER_TIMEOUT_S * 1000L) {
+		server_disconnect(s, 1, 0, "Ping timeout (" STR(SERVER_TIMEOUT_S) ")");
+		return;
+	}
+
 	/* Server hasn't responded to PING, display latency in status */
-	if (delta > SERVER_LATENCY_S && current_channel()->server == s) {
-		s->latency_delta = delta;
+	s->latency_delta = delta / 1000;
+
+	if (current_channel()->server == s)
 		draw_status();
+
+	timer_set(&s->latency_timer, 1000);
+}
+
+static void
+check_reconnect(void *arg)
+{
+	/* Auto reconnect attempt is due */
+
+	server *s = arg;
+
+	reconnect_n--;
+
+	connect_enqueue(s);
+}
+
+static void
+reconnect_schedule(server *s)
+{
+	/* Schedule an auto reconnect attempt after a random delay of up to the
+	 * server's current backoff (full jitter), so that servers disconnected
+	 * together don't all reconnect together */
+
+	long ms = (long)((double)rand() / RAND_MAX * s->reconnect_delta * 1000);
+
+	if (!timer_pending(&s->reconnect_timer))
+		reconnect_n++;
+
+	timer_set(&s->reconnect_timer, ms);
+
+	newlinef(s->channel, 0, "--", "Attempting reconnect in %lds", (ms + 999) / 1000);
+
+	if (!timer_pending(&reconnect_tick_timer)) {
+		timer_init(&reconnect_tick_timer, reconnect_tick, NULL);
+		timer_set(&reconnect_tick_timer, 0);
 	}
+}
 
-	return 0;
+static void
+reconnect_cancel(server *s)
+{
+	if (timer_pending(&s->reconnect_timer)) {
+		timer_cancel(&s->reconnect_timer);
+		reconnect_n--;
+	}
 }
 
-static int
-check_reconnect(server *s, time_t t)
+static void
+reconnect_tick(void *arg)
 {
-	/* Check if the server is in auto-reconnect mode, and issue a reconnect if needed */
+	/* Update the reconnect countdown in the status bar, each time the current
+	 * server's remaining seconds change, while any server is waiting */
 
-	if (s->reconnect_time && t > s->reconnect_time) {
-		server_connect(s->host, s->port, NULL, NULL);
-		return 1;
+	long ms = 1000;
+	server *s = current_channel()->server;
+
+	UNUSED(arg);
+
+	if (reconnect_n == 0)
+		return;
+
+	if (s && timer_pending(&s->reconnect_timer)) {
+
+		draw_status();
+
+		if ((ms = (s->reconnect_timer.expire - timer_now()) % 1000) <= 0)
+			ms = 1000;
 	}
 
-	return 0;
+	timer_set(&reconnect_tick_timer, ms);
 }
 
 static int
-check_socket(server *s, time_t t)
+check_socket(server *s)
 {
-	/* Check the status of the server's socket */
+	/* Read the input on a server's socket and handle all complete messages.
+	 *
+	 * The socket is read again only if a read fills the receive buffer, any
+	 * remaining input is read when next polled */
 
 	ssize_t count;
-	char recv_buff[BUFFSIZE];
+	size_t space;
 
-	/* Consume all input on the socket */
-	while (s->soc >= 0 && (count = read(s->soc, recv_buff, BUFFSIZE)) >= 0) {
+	do {
+		space = RECV_BUFFSIZE - s->recv.len;
 
-		if (count == 0) {
-			server_disconnect(s, 1, 0, "Remote hangup");
+		if ((count = read(s->soc, s->recv.buf + s->recv.len, space)) <= 0)
 			break;
-		}
 
 		/* Set time since last message */
-		s->latency_time = t;
+		s->latency_time = timer_now();
 		s->latency_delta = 0;
 
-		recv_mesg(recv_buff, count, s);
+		s->recv.len += count;
+
+		recv_lines(s);
+
+	} while (s->soc >= 0 && (size_t)count == space);
+
+	if (count == 0) {
+		server_disconnect(s, 1, 0, "Remote hangup");
+		return 0;
 	}
 
-	/* Server received ERROR message or remote hangup */
-	if (s->soc < 0)
+	/* Server received ERROR message */
+	if (s->soc < 0 || count > 0)
 		return 0;
 
 	/* Socket is non-blocking, all other errors cause a disconnect */
-	if (errno != EWOULDBLOCK && errno != EAGAIN) {
-		if (errno)
-			server_disconnect(s, 1, 0, strerror(errno));
-		else
-			server_disconnect(s, 1, 0, "Remote hangup");
-	}
+	if (errno != EWOULDBLOCK && errno != EAGAIN && errno != EINTR)
+		server_disconnect(s, 1, 0, strerror(errno));
 
 	return 0;
 }
+
+static void
+recv_lines(server *s)
+{
+	/* Handle each complete message in a server's receive buffer in place,
+	 * then move any partial message to the front of the buffer.
+	 *
+	 * Messages are terminated by \n, with an optional preceding \r. Messages
+	 * exceeding RECV_MESG_MAX bytes are discarded up to their terminator */
+
+	char *end, *nl, *p = s->recv.buf;
+
+	end = s->recv.buf + s->recv.len;
+
+	while ((nl = memchr(p, '\n', end - p))) {
+
+		if (s->recv.discard) {
+			/* Remainder of an overlong message */
+			s->recv.discard = 0;
+		} else if ((size_t)(nl - p) >= RECV_MESG_MAX) {
+			recv_overlong(s);
+			s->recv.discard = 0;
+		} else {
+			nl[0] = '\0';
+
+			if (nl > p && nl[-1] == '\r')
+				nl[-1] = '\0';
+
+			recv_mesg(p, s);
+
+			/* Disconnected while handling the message */
+			if (s->soc < 0)
+				return;
+		}
+
+		p = nl + 1;
+	}
+
+	s->recv.len = end - p;
+
+	/* Partial message can't be terminated within the maximum length */
+	if (s->recv.discard || s->recv.len >= RECV_MESG_MAX) {
+
+		if (!s->recv.discard)
+			recv_overlong(s);
+
+		s->recv.len = 0;
+	}
+
+	if (s->recv.len && p != s->recv.buf)
+		memmove(s->recv.buf, p, s->recv.len);
+}
+
+static void
+recv_overlong(server *s)
+{
+	/* Begin discarding a message exceeding the maximum length */
+
+	newlinef(s->channel, 0, "-!!-", "Message exceeds maximum length of %d bytes, discarding", RECV_MESG_MAX);
+
+	s->recv.discard = 1;
+}
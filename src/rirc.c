@@ -6,13 +6,19 @@
 #define __BSD_VISIBLE 1
 #endif
 
+#include <fcntl.h>
 #include <getopt.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <termios.h>
+#include <unistd.h>
 
 #include "common.h"
+#include "dns.h"
+#include "log.h"
+#include "spill.h"
 #include "state.h"
 
 #define opt_error(MESG) \
@@ -25,15 +31,34 @@ static void usage(void);
 static void signal_sigwinch(int);
 
 static struct termios oterm, nterm;
+static struct sigaction sa_sigpipe;
 static struct sigaction sa_sigwinch;
-static volatile sig_atomic_t flag_sigwinch;
+
+/* Minimum time between redraws */
+#define DRAW_INTERVAL_MS 15
+
+static void draw_wake(void*);
+
+static long draw_time;
+static struct timer draw_timer;
+
+/* Self-pipe written by the SIGWINCH handler to wake the main loop */
+static int sigwinch_pipe[2] = {-1, -1};
 
 /* Global configuration */
 struct config config =
 {
 	.username = "rirc_v" VERSION,
 	.realname = "rirc v" VERSION,
-	.join_part_quit_threshold = 100
+	.join_part_quit_threshold = 100,
+	.flood_burst = FLOOD_BURST,
+	.flood_interval = FLOOD_INTERVAL,
+	.scrollback.lines = {
+		[BUFFER_OTHER]   = SCROLLBACK_SERVER,
+		[BUFFER_CHANNEL] = SCROLLBACK_CHANNEL,
+		[BUFFER_SERVER]  = SCROLLBACK_SERVER,
+		[BUFFER_PRIVATE] = SCROLLBACK_PRIVATE
+	}
 };
 
 int
@@ -64,19 +89,29 @@ usage(void)
 	"  -p, --port=PORT        Connect using PORT\n"
 	"  -j, --join=CHANNELS    Comma separated list of channels to join\n"
 	"  -n, --nicks=NICKS      Comma and/or space separated list of nicks to use\n"
+	"  -f, --flood=B:MS       Send at most B lines at once, then one line per MS milliseconds\n"
+	"  -s, --scrollback=B:N   Keep N lines of history, a power of 2, in buffers B:\n"
+	"                         server, channel, private, or a channel or nick by name\n"
+	"  -l, --log=DIR          Log buffers to files in DIR, per network and channel\n"
+	"  -L, --log-sync=SECS    Sync log files written every SECS seconds, 0 after every write\n"
+	"  -S, --spill=DIR        Keep history older than scrollback on disk in DIR, or 'off'\n"
 	"  -v, --version          Print rirc version and exit\n"
 	"\n"
 	"Examples:\n"
 	"  rirc -c server -j '#chan'\n"
 	"  rirc -c server -j '#chan' -c server2 -j '#chan2'\n"
 	"  rirc -c server -p 1234 -j '#chan1,#chan2' -n 'nick, nick_, nick__'\n"
+	"  rirc -c server -f 10:1000\n"
+	"  rirc -s private:64 -s '#chan:65536' -c server -j '#chan'\n"
+	"  rirc -l ~/irclogs -c server -j '#chan'\n"
+	"  rirc -S off -c server -j '#chan'\n"
 	);
 }
 
 static void
 startup(int argc, char **argv)
 {
-	int c, i, opt_i = 0, server_i = -1;
+	int c, i, opt_i = 0, server_i = -1, server_n = 0;
 
 	struct option long_opts[] =
 	{
@@ -84,6 +119,11 @@ startup(int argc, char **argv)
 		{"port",    required_argument, 0, 'p'},
 		{"join",    required_argument, 0, 'j'},
 		{"nick",    required_argument, 0, 'n'},
+		{"flood",   required_argument, 0, 'f'},
+		{"scrollback", required_argument, 0, 's'},
+		{"log",     required_argument, 0, 'l'},
+		{"log-sync", required_argument, 0, 'L'},
+		{"spill",   required_argument, 0, 'S'},
 		{"version", no_argument,       0, 'v'},
 		{"help",    no_argument,       0, 'h'},
 		{0, 0, 0, 0}
@@ -94,9 +134,15 @@ startup(int argc, char **argv)
 		char *port;
 		char *join;
 		char *nicks;
-	} auto_servers[MAX_SERVERS] = {{0, 0, 0, 0}};
+		unsigned long flood_burst;
+		unsigned long flood_interval;
+	} *auto_servers = NULL;
 
-	while ((c = getopt_long(argc, argv, "c:p:n:j:vh", long_opts, &opt_i))) {
+	char *endptr, *sep, *log_dir = NULL, *spill_dir = NULL;
+	server *s;
+	unsigned long lines, log_sync = LOG_SYNC_INTERVAL;
+
+	while ((c = getopt_long(argc, argv, "c:p:n:j:f:s:l:L:S:vh", long_opts, &opt_i))) {
 
 		if (c == -1)
 			break;
@@ -108,8 +154,15 @@ startup(int argc, char **argv)
 				if (*optarg == '-')
 					opt_error("-c/--connect requires an argument");
 
-				if (++server_i == MAX_SERVERS)
-					opt_error("exceeded maximum number of servers (" STR(MAX_SERVERS) ")");
+				if (++server_i == server_n) {
+
+					server_n = server_n ? server_n * 2 : 4;
+
+					if ((auto_servers = realloc(auto_servers, server_n * sizeof(*auto_servers))) == NULL)
+						fatal("realloc");
+				}
+
+				memset(&auto_servers[server_i], 0, sizeof(*auto_servers));
 
 				auto_servers[server_i].host = optarg;
 				break;
@@ -147,6 +200,92 @@ startup(int argc, char **argv)
 				auto_servers[server_i].join = optarg;
 				break;
 
+			/* Flood control, burst of lines and interval in milliseconds */
+			case 'f':
+				if (*optarg == '-')
+					opt_error("-f/--flood requires an argument");
+
+				if (server_i < 0)
+					opt_error("-f/--flood requires a server argument first");
+
+				auto_servers[server_i].flood_burst = strtoul(optarg, &endptr, 10);
+
+				if (*endptr++ != ':')
+					opt_error("-f/--flood requires the form BURST:INTERVAL");
+
+				auto_servers[server_i].flood_interval = strtoul(endptr, &endptr, 10);
+
+				if (*endptr != '\0' || auto_servers[server_i].flood_burst == 0)
+					opt_error("-f/--flood requires the form BURST:INTERVAL");
+				break;
+
+			/* Lines of history kept in buffers, by type or name */
+			case 's':
+				if (*optarg == '-')
+					opt_error("-s/--scrollback requires an argument");
+
+				if ((sep = strrchr(optarg, ':')) == NULL || sep == optarg)
+					opt_error("-s/--scrollback requires the form BUFFERS:LINES");
+
+				*sep++ = '\0';
+
+				lines = strtoul(sep, &endptr, 10);
+
+				if (*sep == '\0' || *endptr != '\0' || lines > BUFFER_LINES_MAX || !buffer_lines_valid(lines))
+					opt_error("-s/--scrollback requires LINES to be a power of 2, at most 2^20");
+
+				if (!strcmp(optarg, "server"))
+					config.scrollback.lines[BUFFER_SERVER] = config.scrollback.lines[BUFFER_OTHER] = lines;
+
+				else if (!strcmp(optarg, "channel"))
+					config.scrollback.lines[BUFFER_CHANNEL] = lines;
+
+				else if (!strcmp(optarg, "private"))
+					config.scrollback.lines[BUFFER_PRIVATE] = lines;
+
+				else {
+					if (config.scrollback.n == config.scrollback.size) {
+
+						config.scrollback.size = config.scrollback.size ? config.scrollback.size * 2 : 4;
+
+						if ((config.scrollback.chans = realloc(config.scrollback.chans,
+								config.scrollback.size * sizeof(*config.scrollback.chans))) == NULL)
+							fatal("realloc");
+					}
+
+					config.scrollback.chans[config.scrollback.n].name = optarg;
+					config.scrollback.chans[config.scrollback.n].lines = lines;
+					config.scrollback.n++;
+				}
+				break;
+
+			/* Log buffers to files in directory */
+			case 'l':
+				if (*optarg == '-' || *optarg == '\0')
+					opt_error("-l/--log requires an argument");
+
+				log_dir = optarg;
+				break;
+
+			/* Seconds between syncs of log files written */
+			case 'L':
+				if (*optarg == '-')
+					opt_error("-L/--log-sync requires an argument");
+
+				log_sync = strtoul(optarg, &endptr, 10);
+
+				if (*optarg == '\0' || *endptr != '\0' || log_sync > 86400)
+					opt_error("-L/--log-sync requires SECS, at most 86400");
+				break;
+
+			/* Directory of history spilled to disk, or off */
+			case 'S':
+				if (*optarg == '-' || *optarg == '\0')
+					opt_error("-S/--spill requires an argument");
+
+				spill_dir = optarg;
+				break;
+
 			/* Print rirc version and exit */
 			case 'v':
 				puts("rirc version " VERSION);
@@ -182,29 +321,57 @@ startup(int argc, char **argv)
 
 	srand(time(NULL));
 
+	/* Set up the signal handler's self-pipe, both ends non-blocking */
+	if (pipe(sigwinch_pipe) < 0)
+		fatal("pipe");
+
+	if (fcntl(sigwinch_pipe[0], F_SETFL, O_NONBLOCK) < 0 || fcntl(sigwinch_pipe[1], F_SETFL, O_NONBLOCK) < 0)
+		fatal("fcntl");
+
 	/* Set up signal handlers */
 	sa_sigwinch.sa_handler = signal_sigwinch;
 	if (sigaction(SIGWINCH, &sa_sigwinch, NULL) == -1)
 		fatal("sigaction - SIGWINCH");
 
+	/* Write errors on closed server sockets are handled when flushing */
+	sa_sigpipe.sa_handler = SIG_IGN;
+	if (sigaction(SIGPIPE, &sa_sigpipe, NULL) == -1)
+		fatal("sigaction - SIGPIPE");
+
 	errno = 0; /* doesn't set errno */
 	if (atexit(cleanup) != 0)
 		fatal("atexit");
 
 	/* Initialize submodules */
+	dns_init();
 	init_mesg();
 	init_state();
 
+	/* History older than a buffer's scrollback is spilled to disk */
+	if (spill_dir == NULL)
+		spill_dir = getenv("TMPDIR") ? getenv("TMPDIR") : "/var/tmp";
+
+	spill_init(strcmp(spill_dir, "off") ? spill_dir : NULL);
+
+	log_init(log_dir, log_sync);
+
 	config.default_nick = getenv("USER");
 
 	for (i = 0; i <= server_i; i++) {
-		server_connect(
+		s = server_connect(
 			auto_servers[i].host,
 			auto_servers[i].port ? auto_servers[i].port : "6667",
 			auto_servers[i].nicks,
 			auto_servers[i].join
 		);
+
+		if (auto_servers[i].flood_burst) {
+			s->flood_burst = auto_servers[i].flood_burst;
+			s->flood_interval = auto_servers[i].flood_interval;
+		}
 	}
+
+	free(auto_servers);
 }
 
 static void
@@ -215,8 +382,11 @@ cleanup(void)
 		fatal("tcsetattr");
 
 	/* Free submodules */
+	dns_free();
 	free_mesg();
 	free_state();
+	timer_free();
+	log_free();
 
 	/* Reset terminal colours */
 	printf("\x1b[38;0;m");
@@ -231,29 +401,107 @@ cleanup(void)
 static void
 signal_sigwinch(int signum)
 {
+	/* Wake the main loop. If the pipe is full a resize is already pending */
+
 	UNUSED(signum);
 
-	flag_sigwinch = 1;
+	int errno_save = errno;
+
+	ssize_t ret = write(sigwinch_pipe[1], "", 1);
+
+	UNUSED(ret);
+
+	errno = errno_save;
+}
+
+static void
+draw_wake(void *arg)
+{
+	/* Wake the main loop to draw changes held back by the redraw throttle */
+
+	UNUSED(arg);
 }
 
 static void
 main_loop(void)
 {
+	/* Sleep until any of the following is ready, and handle only those:
+	 *
+	 *  - User input on stdin
+	 *  - A SIGWINCH was caught
+	 *  - A host lookup has completed
+	 *  - Input on a server socket, or a full socket became writable
+	 *  - A timer is due (ping, timeout, reconnect, flood control, redraw)
+	 * */
+
+	char drain[64];
+	int ret;
+	long now;
+	size_t n, nfds_max = 16;
+	struct pollfd *fds;
+
+	if ((fds = malloc(sizeof(*fds) * nfds_max)) == NULL)
+		fatal("malloc");
+
+	timer_init(&draw_timer, draw_wake, NULL);
+
 	for (;;) {
 
-		/* Check for input on stdin, sleep 200ms */
-		poll_input();
+		fds[0] = (struct pollfd) { .fd = STDIN_FILENO,    .events = POLLIN };
+		fds[1] = (struct pollfd) { .fd = sigwinch_pipe[0], .events = POLLIN };
+		fds[2] = (struct pollfd) { .fd = dns_fd(),         .events = POLLIN };
+
+		/* Grow the pollfd set when the number of server sockets exceeds it */
+		while ((n = server_pollfds(fds + 3, nfds_max - 3)) > nfds_max - 3) {
 
-		/* For each server, check connection status, and input */
-		check_servers();
+			nfds_max = n + 3;
+
+			if ((fds = realloc(fds, sizeof(*fds) * nfds_max)) == NULL)
+				fatal("realloc");
+		}
+
+		if ((ret = poll(fds, n + 3, timer_timeout())) < 0) {
+
+			/* Interrupted by a signal, the self-pipe is ready on the next poll */
+			if (errno == EINTR)
+				continue;
+
+			fatal("poll");
+		}
 
 		/* Window has changed size */
-		if (flag_sigwinch) {
-			flag_sigwinch = 0;
+		if (fds[1].revents) {
+
+			while (read(sigwinch_pipe[0], drain, sizeof(drain)) > 0)
+				;
+
 			resize();
 		}
 
-		/* Redraw the ui (skipped if nothing has changed) */
-		draw();
+		/* Complete host lookups, beginning their connection attempts */
+		if (fds[2].revents)
+			dns_dispatch();
+
+		/* For each server, check connection status, socket input and deadlines */
+		check_servers(fds + 3, n);
+
+		/* Fire all timers that are due */
+		timer_run();
+
+		/* Handle user input last, it may close servers */
+		if (fds[0].revents)
+			read_input();
+
+		/* Write all lines queued for sending to servers */
+		flush_servers();
+
+		/* Redraw the ui (skipped if nothing has changed), at most once per
+		 * DRAW_INTERVAL_MS while input is arriving faster */
+		if ((now = timer_now()) - draw_time >= DRAW_INTERVAL_MS) {
+			draw();
+			draw_time = now;
+		} else if (!timer_pending(&draw_timer)) {
+			timer_set(&draw_timer, DRAW_INTERVAL_MS - (now - draw_time));
+		}
 	}
 }
@@ -0,0 +1,419 @@
+/* spill.c
+ *
+ * Scrollback spilled to disk, see spill.h
+ *
+ * Segments are allocated from the spill file as needed, and reused once
+ * freed, or once a buffer reaches SPILL_SEGMENTS_MAX, its oldest segment is
+ * reused, dropping its lines. Each segment is laid out as:
+ *
+ *   |record 0|record 1|...|record n-1|  (free)  |offset n-1|...|offset 0|
+ *
+ * Records are aligned to 8 bytes, a header followed by the line's 'from'
+ * and text, each NUL terminated. Offsets are 32 bits
+ * */
+
+/* For mkstemp, pwrite */
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "spill.h"
+
+#define SPILL_ALIGN(X) (((X) + 7) & ~(size_t)7)
+
+#define SPILL_OFFSET(M, K) \
+	(((uint32_t *)((M) + SPILL_SEGMENT_SIZE))[-(long)(K) - 1])
+
+struct spill_record
+{
+	time_t time;
+	uint16_t text_len;
+	uint8_t from_len;
+	uint8_t type;
+};
+
+static char* spill_map(unsigned int, int);
+static struct spill_segment* spill_segment(struct spill*, unsigned int);
+static int spill_reserve(unsigned int);
+static int spill_segment_new(struct spill*, unsigned int);
+static unsigned int spill_segment_drop(struct spill*);
+static void spill_segment_free(unsigned int);
+
+static char *spill_dir;
+static int spill_fd = -1;
+
+/* errno of the failure that disabled spilling, until returned by spill_error */
+static int spill_err;
+
+/* Segments allocated from the spill file, and those since freed */
+static unsigned int spill_segs;
+static struct {
+	size_t n;
+	size_t size;
+	unsigned int *ids;
+} spill_free_segs;
+
+/* Mapping of the segment last read, if not being written */
+static struct {
+	char *map;
+	unsigned int id;
+} spill_read;
+
+/* Lines read, by index */
+static struct {
+	struct spill *s;
+	unsigned int i;
+	struct buffer_line line;
+	char from[FROM_LENGTH_MAX + 1];
+	char text[TEXT_LENGTH_MAX + 1];
+} spill_cache[SPILL_CACHE_SIZE];
+
+void
+spill_init(const char *dir)
+{
+	/* Set the directory of the spill file, created when first needed.
+	 * Spilling is disabled while NULL */
+
+	free(spill_dir);
+
+	spill_dir = dir ? strdup(dir) : NULL;
+}
+
+int
+spill_error(void)
+{
+	/* Return the errno of the failure that disabled spilling, once */
+
+	int err = spill_err;
+
+	spill_err = 0;
+
+	return err;
+}
+
+struct spill*
+spill_new(void)
+{
+	struct spill *s;
+
+	if (spill_dir == NULL)
+		return NULL;
+
+	if ((s = calloc(1, sizeof(*s))) == NULL)
+		fatal("calloc");
+
+	return s;
+}
+
+void
+spill_free(struct spill *s)
+{
+	/* Free a buffer's spilled lines, returning its segments for reuse */
+
+	size_t i;
+
+	if (s == NULL)
+		return;
+
+	if (s->map)
+		munmap(s->map, SPILL_SEGMENT_SIZE);
+
+	for (i = 0; i < s->segs.n; i++)
+		spill_segment_free(s->segs.segs[i].id);
+
+	for (i = 0; i < SPILL_CACHE_SIZE; i++) {
+		if (spill_cache[i].s == s)
+			spill_cache[i].s = NULL;
+	}
+
+	free(s->segs.segs);
+	free(s);
+}
+
+int
+spill_push(struct spill *s, unsigned int i, const struct buffer_line *line)
+{
+	/* Append the line indexed by i, following the last line spilled.
+	 * Returns -1 if the spill file can't be written */
+
+	char *p;
+	size_t len = SPILL_ALIGN(sizeof(struct spill_record) + line->from_len + line->text_len + 2);
+	struct spill_segment *seg = s->segs.n ? &s->segs.segs[s->segs.n - 1] : NULL;
+	struct spill_record r = {
+		.time = line->time,
+		.text_len = line->text_len,
+		.from_len = line->from_len,
+		.type = line->type
+	};
+
+	if (s->n == 0)
+		s->first = i;
+
+	if (i != s->first + s->n)
+		fatal("line not spilled in order");
+
+	if (seg == NULL || seg->used + len + sizeof(uint32_t) * (seg->n + 1) > SPILL_SEGMENT_SIZE) {
+
+		/* Spilling is disabled for all buffers on the first failure,
+		 * rather than retrying the failed system calls for every line */
+		if (spill_dir == NULL)
+			return -1;
+
+		if (spill_segment_new(s, i) < 0) {
+			spill_err = errno ? errno : EIO;
+			spill_init(NULL);
+			return -1;
+		}
+
+		seg = &s->segs.segs[s->segs.n - 1];
+	}
+
+	p = s->map + seg->used;
+
+	memcpy(p, &r, sizeof(r));
+	p += sizeof(r);
+
+	memcpy(p, line->from ? line->from : "", line->from_len);
+	p[line->from_len] = '\0';
+	p += line->from_len + 1;
+
+	memcpy(p, line->text ? line->text : "", line->text_len);
+	p[line->text_len] = '\0';
+
+	SPILL_OFFSET(s->map, seg->n) = seg->used;
+
+	seg->used += len;
+	seg->n++;
+	s->n++;
+
+	return 0;
+}
+
+struct buffer_line*
+spill_line(struct spill *s, unsigned int i)
+{
+	/* Return the spilled line indexed by i, or NULL */
+
+	char *map, *p;
+	struct spill_record r;
+	struct spill_segment *seg;
+	unsigned int k = i & (SPILL_CACHE_SIZE - 1);
+
+	if (s == NULL || (seg = spill_segment(s, i)) == NULL)
+		return NULL;
+
+	if (spill_cache[k].s == s && spill_cache[k].i == i)
+		return &spill_cache[k].line;
+
+	if (seg == &s->segs.segs[s->segs.n - 1]) {
+		map = s->map;
+	} else {
+
+		if (spill_read.map == NULL || spill_read.id != seg->id) {
+
+			if (spill_read.map)
+				munmap(spill_read.map, SPILL_SEGMENT_SIZE);
+
+			if ((spill_read.map = spill_map(seg->id, PROT_READ)) == NULL)
+				return NULL;
+
+			spill_read.id = seg->id;
+		}
+
+		map = spill_read.map;
+	}
+
+	p = map + SPILL_OFFSET(map, i - seg->first);
+
+	memcpy(&r, p, sizeof(r));
+	p += sizeof(r);
+
+	spill_cache[k].s = s;
+	spill_cache[k].i = i;
+
+	memcpy(spill_cache[k].from, p, r.from_len + 1);
+	p += r.from_len + 1;
+
+	memcpy(spill_cache[k].text, p, r.text_len + 1);
+
+	spill_cache[k].line = (struct buffer_line) {
+		.from = spill_cache[k].from,
+		.text = spill_cache[k].text,
+		.time = r.time,
+		.type = r.type,
+		.from_len = r.from_len,
+		.text_len = r.text_len
+	};
+
+	return &spill_cache[k].line;
+}
+
+static struct spill_segment*
+spill_segment(struct spill *s, unsigned int i)
+{
+	/* Binary search a buffer's segments for the one holding line i */
+
+	size_t lo = 0, hi = s->segs.n, mid;
+
+	if (i - s->first >= s->n)
+		return NULL;
+
+	while (hi - lo > 1) {
+
+		mid = lo + (hi - lo) / 2;
+
+		if (i - s->first >= s->segs.segs[mid].first - s->first)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	return &s->segs.segs[lo];
+}
+
+static int
+spill_segment_new(struct spill *s, unsigned int first)
+{
+	/* Start a new segment at line first, unmapping the last */
+
+	char path[4096];
+	int ret;
+	unsigned int id;
+
+	if (spill_fd < 0) {
+
+		if ((ret = snprintf(path, sizeof(path), "%s/rirc-spill-XXXXXX", spill_dir)) < 0 || (size_t)ret >= sizeof(path))
+			return -1;
+
+		if ((spill_fd = mkstemp(path)) < 0)
+			return -1;
+
+		/* Removed when closed, at exit */
+		unlink(path);
+	}
+
+	if (s->segs.n == SPILL_SEGMENTS_MAX) {
+		id = spill_segment_drop(s);
+	} else if (spill_free_segs.n) {
+		id = spill_free_segs.ids[--spill_free_segs.n];
+	} else {
+
+		if (spill_reserve(spill_segs) < 0)
+			return -1;
+
+		id = spill_segs++;
+	}
+
+	if (s->map)
+		munmap(s->map, SPILL_SEGMENT_SIZE);
+
+	if ((s->map = spill_map(id, PROT_READ | PROT_WRITE)) == NULL) {
+		spill_segment_free(id);
+		return -1;
+	}
+
+	if (s->segs.n == s->segs.size) {
+
+		s->segs.size = s->segs.size ? s->segs.size * 2 : 4;
+
+		if ((s->segs.segs = realloc(s->segs.segs, s->segs.size * sizeof(*s->segs.segs))) == NULL)
+			fatal("realloc");
+	}
+
+	s->segs.segs[s->segs.n++] = (struct spill_segment) { .id = id, .first = first };
+
+	return 0;
+}
+
+static unsigned int
+spill_segment_drop(struct spill *s)
+{
+	/* Drop a buffer's oldest segment and its lines, returning its id */
+
+	size_t i;
+	unsigned int id = s->segs.segs[0].id;
+
+	s->first += s->segs.segs[0].n;
+	s->n -= s->segs.segs[0].n;
+	s->segs.n--;
+
+	memmove(s->segs.segs, s->segs.segs + 1, s->segs.n * sizeof(*s->segs.segs));
+
+	if (spill_read.map && spill_read.id == id) {
+		munmap(spill_read.map, SPILL_SEGMENT_SIZE);
+		spill_read.map = NULL;
+	}
+
+	for (i = 0; i < SPILL_CACHE_SIZE; i++) {
+		if (spill_cache[i].s == s && spill_cache[i].i - s->first >= s->n)
+			spill_cache[i].s = NULL;
+	}
+
+	return id;
+}
+
+static int
+spill_reserve(unsigned int id)
+{
+	/* Extend the spill file by a segment of zeros. Written rather than
+	 * truncated, since writing a sparse mapping raises SIGBUS if the disk
+	 * is full, and posix_fallocate is neither portable nor supported by
+	 * every filesystem */
+
+	static const char zeros[SPILL_SEGMENT_SIZE];
+
+	off_t off = (off_t)id * SPILL_SEGMENT_SIZE;
+	size_t n = 0;
+	ssize_t ret;
+
+	while (n < sizeof(zeros)) {
+
+		if ((ret = pwrite(spill_fd, zeros + n, sizeof(zeros) - n, off + n)) < 0) {
+
+			if (errno == EINTR)
+				continue;
+
+			return -1;
+		}
+
+		n += ret;
+	}
+
+	return 0;
+}
+
+static void
+spill_segment_free(unsigned int id)
+{
+	/* Return a segment for reuse, unmapping it if last read */
+
+	if (spill_read.map && spill_read.id == id) {
+		munmap(spill_read.map, SPILL_SEGMENT_SIZE);
+		spill_read.map = NULL;
+	}
+
+	if (spill_free_segs.n == spill_free_segs.size) {
+
+		spill_free_segs.size = spill_free_segs.size ? spill_free_segs.size * 2 : 16;
+
+		if ((spill_free_segs.ids = realloc(spill_free_segs.ids,
+				spill_free_segs.size * sizeof(*spill_free_segs.ids))) == NULL)
+			fatal("realloc");
+	}
+
+	spill_free_segs.ids[spill_free_segs.n++] = id;
+}
+
+static char*
+spill_map(unsigned int id, int prot)
+{
+	void *map = mmap(NULL, SPILL_SEGMENT_SIZE, prot, MAP_SHARED, spill_fd, (off_t)id * SPILL_SEGMENT_SIZE);
+
+	return (map == MAP_FAILED) ? NULL : map;
+}
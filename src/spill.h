@@ -0,0 +1,64 @@
+#ifndef SPILL_H
+#define SPILL_H
+
+/* spill.h
+ *
+ * Scrollback spilled to disk: lines evicted from the tail of a buffer's ring
+ * are appended to segments of a single unlinked file, shared by all buffers,
+ * so history is kept on disk while only the segments being written, and the
+ * one last read, are mapped. Buffers are limited to SPILL_SEGMENTS_MAX
+ * segments, the oldest reused once reached.
+ *
+ * Segments hold records from the front, and the offsets of records from the
+ * back, so any line is found by a search of a buffer's segments, and read
+ * without scanning. Lines read are copied out of the mapping to a small
+ * cache, so they remain valid as other segments are mapped */
+
+#include "buffer.h"
+
+/* Size of each segment of the spill file, records are at most ~640 bytes */
+#define SPILL_SEGMENT_SIZE (1 << 16)
+
+/* Most segments spilled per buffer, 16 MiB by default */
+#ifndef SPILL_SEGMENTS_MAX
+	#define SPILL_SEGMENTS_MAX 256
+#endif
+
+#if SPILL_SEGMENTS_MAX < 2
+	#error "SPILL_SEGMENTS_MAX must be at least 2"
+#endif
+
+/* Number of lines read that are cached, a power of 2 */
+#define SPILL_CACHE_SIZE (1 << 6)
+
+struct spill_segment
+{
+	unsigned int id;    /* Offset in the spill file, in segments */
+	unsigned int first; /* Index of the segment's first line */
+	unsigned int n;     /* Lines in the segment */
+	size_t used;        /* Bytes of records in the segment */
+};
+
+struct spill
+{
+	char *map;      /* Mapping of the last segment, being written */
+	unsigned int first;
+	unsigned int n; /* Lines spilled, indexed [first, first + n) */
+	struct {
+		size_t n;
+		size_t size;
+		struct spill_segment *segs;
+	} segs;
+};
+
+int spill_error(void);
+int spill_push(struct spill*, unsigned int, const struct buffer_line*);
+
+struct buffer_line* spill_line(struct spill*, unsigned int);
+
+struct spill* spill_new(void);
+
+void spill_free(struct spill*);
+void spill_init(const char*);
+
+#endif
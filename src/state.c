@@ -8,12 +8,13 @@
 #include <ctype.h>
 #include <stdlib.h>
 #include <string.h>
-#include <strings.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <sys/ioctl.h>
 
 #include "common.h"
+#include "log.h"
+#include "spill.h"
 #include "state.h"
 
 /* State of rirc */
@@ -26,12 +27,22 @@ static struct
 
 	unsigned int term_cols;
 	unsigned int term_rows;
+
+	time_t line_time; /* Time new lines are stamped with, 0 for the current time */
 } state;
 
 static int action_close_server(char);
 
 static void _newline(channel*, enum buffer_line_t, const char*, const char*, size_t);
 
+/* Nick membership index functions */
+static void member_add(channel*, const char*);
+static void member_del(channel*, const char*);
+static void member_key(char*, const char*, const unsigned char*);
+static void nicklist_clear(channel*, avl_node*);
+static void nicklist_names_free(channel*);
+static void nicklist_names_hold(channel*, avl_node*);
+
 channel* current_channel(void) { return state.current_channel; }
 channel* default_channel(void) { return state.default_channel; }
 
@@ -89,6 +100,15 @@ newline(channel *c, enum buffer_line_t type, const char *from, const char *mesg)
 	_newline(c, type, from, mesg, strlen(mesg)); /* FIXME: sizeof for static strings? */
 }
 
+void
+newline_set_time(time_t t)
+{
+	/* Stamp lines added from now on with t, e.g. a message's server-time,
+	 * or with the current time when 0 */
+
+	state.line_time = t;
+}
+
 void
 newlinef(channel *c, enum buffer_line_t type, const char *from, const char *fmt, ...)
 {
@@ -102,6 +122,14 @@ newlinef(channel *c, enum buffer_line_t type, const char *from, const char *fmt,
 	len = vsnprintf(buff, BUFFSIZE, fmt, ap);
 	va_end(ap);
 
+	if (len < 0)
+		len = 0;
+
+	if (len >= BUFFSIZE)
+		len = BUFFSIZE - 1;
+
+	buff[len] = '\0';
+
 	_newline(c, type, from, buff, len);
 }
 
@@ -120,7 +148,18 @@ _newline(channel *c, enum buffer_line_t type, const char *from, const char *mesg
 	if (c == NULL)
 		fatal("channel is null");
 
-	buffer_newline(&c->buffer, type, from, mesg);
+	int err;
+	time_t t = state.line_time ? state.line_time : time(NULL);
+
+	buffer_newline(&c->buffer, type, from, mesg, t);
+
+	/* Spilling is disabled on the first failure, noted once */
+	if ((err = spill_error()))
+		newlinef(state.default_channel, 0, "-!!-", "Scrollback no longer kept on disk: %s", strerror(err));
+
+	/* Lines of a server's buffer are logged per network */
+	if (c->server)
+		log_line(c->server->host, (c->buffer.type == BUFFER_SERVER) ? NULL : c->name, t, from, mesg, len);
 
 	if (c->active < ACTIVITY_ACTIVE)
 		c->active = ACTIVITY_ACTIVE;
@@ -131,6 +170,24 @@ _newline(channel *c, enum buffer_line_t type, const char *from, const char *mesg
 		draw_nav();
 }
 
+static unsigned int
+channel_scrollback(const char *name, server *s, enum buffer_t type)
+{
+	/* Lines kept in a channel's history, as configured for its name, or
+	 * otherwise its buffer type */
+
+	size_t i;
+
+	if (type == BUFFER_CHANNEL || type == BUFFER_PRIVATE) {
+		for (i = 0; i < config.scrollback.n; i++) {
+			if (!casemap_cmp(s->casemap, config.scrollback.chans[i].name, name))
+				return config.scrollback.chans[i].lines;
+		}
+	}
+
+	return config.scrollback.lines[type];
+}
+
 channel*
 new_channel(char *name, server *server, channel *chanlist, enum buffer_t type)
 {
@@ -139,14 +196,16 @@ new_channel(char *name, server *server, channel *chanlist, enum buffer_t type)
 	if ((c = calloc(1, sizeof(*c))) == NULL)
 		fatal("calloc");
 
-	c->buffer = buffer(type);
-	c->input = new_input();
+	c->buffer = buffer(type, channel_scrollback(name, server, type));
 	c->name = strdup(name);
 	c->server = server;
 
 	/* Append the new channel to the list */
 	DLL_ADD(chanlist, c);
 
+	if (server)
+		hmap_add(&server->channels, c->name, c);
+
 	draw_all();
 
 	return c;
@@ -155,8 +214,13 @@ new_channel(char *name, server *server, channel *chanlist, enum buffer_t type)
 void
 free_channel(channel *c)
 {
+	nicklist_clear(c, c->nicklist);
+	nicklist_names_free(c);
 	free_avl(c->nicklist);
-	free_input(c->input);
+	if (c->input)
+		free_input(c->input);
+
+	buffer_free(&c->buffer);
 	free(c->name);
 	free(c);
 }
@@ -167,15 +231,7 @@ channel_get(char *chan, server *s)
 	if (!s)
 		return NULL;
 
-	channel *c = s->channel;
-
-	do {
-		if (!strcasecmp(c->name, chan))
-			return c;
-
-	} while ((c = c->next) != s->channel);
-
-	return NULL;
+	return hmap_get(&s->channels, chan);
 }
 
 /* FIXME: functions that operate on a buffer should just take the buffer as an argument */
@@ -213,10 +269,229 @@ action_close_server(char c)
 	return 0;
 }
 
+int
+nicklist_add(channel *c, const char *nick)
+{
+	/* Add a nick to a channel, returning 0 if already present */
+
+	if (!avl_add(&c->nicklist, nick, NULL, c->server->casemap))
+		return 0;
+
+	c->nick_count++;
+
+	member_add(c, nick);
+
+	return 1;
+}
+
+int
+nicklist_del(channel *c, const char *nick)
+{
+	/* Remove a nick from a channel, returning 0 if not present */
+
+	if (!avl_del(&c->nicklist, nick, c->server->casemap))
+		return 0;
+
+	c->nick_count--;
+
+	member_del(c, nick);
+
+	return 1;
+}
+
+void
+nicklist_names_add(channel *c, const char *nick)
+{
+	/* Hold a nick listed by RPL_NAMREPLY until nicklist_names_end */
+
+	if (c->names.n == c->names.size) {
+
+		c->names.size = c->names.size ? c->names.size * 2 : 64;
+
+		if ((c->names.nicks = realloc(c->names.nicks, c->names.size * sizeof(*c->names.nicks))) == NULL)
+			fatal("realloc");
+	}
+
+	c->names.nicks[c->names.n++] = str_intern(nick);
+}
+
+void
+nicklist_names_end(channel *c)
+{
+	/* Add the nicks held since the last RPL_ENDOFNAMES to a channel at once */
+
+	size_t i;
+
+	c->nick_count += avl_merge(&c->nicklist, c->names.nicks, c->names.n, c->server->casemap);
+
+	/* Nicks not already in the channel remain, now owned by the nicklist */
+	for (i = 0; i < c->names.n; i++) {
+		if (c->names.nicks[i])
+			member_add(c, c->names.nicks[i]);
+	}
+
+	c->names.n = 0;
+}
+
+struct member*
+member_get(server *s, const char *nick)
+{
+	/* Return the channels a nick is in, or NULL if none */
+
+	char key[NICKSIZE + 1];
+
+	member_key(key, nick, s->casemap);
+
+	return hmap_get(&s->members, key);
+}
+
+static void
+member_add(channel *c, const char *nick)
+{
+	char key[NICKSIZE + 1];
+	struct member *m;
+
+	member_key(key, nick, c->server->casemap);
+
+	if ((m = hmap_get(&c->server->members, key)) == NULL) {
+
+		if ((m = calloc(1, sizeof(*m))) == NULL)
+			fatal("calloc");
+
+		m->key = str_intern(key);
+
+		hmap_add(&c->server->members, m->key, m);
+	}
+
+	if (m->n == m->size) {
+
+		m->size = m->size ? m->size * 2 : 4;
+
+		if ((m->channels = realloc(m->channels, m->size * sizeof(*m->channels))) == NULL)
+			fatal("realloc");
+	}
+
+	m->channels[m->n++] = c;
+}
+
+static void
+member_del(channel *c, const char *nick)
+{
+	/* Remove a channel from a nick's membership, replacing it with the last
+	 * channel listed, and free the membership when none remain */
+
+	char key[NICKSIZE + 1];
+	size_t i;
+	struct member *m;
+
+	member_key(key, nick, c->server->casemap);
+
+	if ((m = hmap_get(&c->server->members, key)) == NULL)
+		return;
+
+	for (i = 0; i < m->n && m->channels[i] != c; i++)
+		;
+
+	if (i == m->n)
+		return;
+
+	m->channels[i] = m->channels[--m->n];
+
+	if (m->n == 0) {
+		hmap_del(&c->server->members, m->key);
+		free(m->channels);
+		str_release(m->key);
+		free(m);
+	}
+}
+
+static void
+member_key(char *key, const char *nick, const unsigned char *map)
+{
+	/* Casefold a nick as compared by the nicklists, truncated to NICKSIZE */
+
+	size_t i;
+
+	for (i = 0; i < NICKSIZE && nick[i]; i++)
+		key[i] = map[(unsigned char)nick[i]];
+
+	key[i] = '\0';
+}
+
+static void
+nicklist_names_free(channel *c)
+{
+	while (c->names.n)
+		str_release(c->names.nicks[--c->names.n]);
+
+	free(c->names.nicks);
+
+	c->names.nicks = NULL;
+	c->names.size = 0;
+}
+
+static void
+nicklist_names_hold(channel *c, avl_node *n)
+{
+	/* Hold a copy of each nick in a nicklist, as if listed by RPL_NAMREPLY */
+
+	if (n == NULL)
+		return;
+
+	nicklist_names_hold(c, n->l);
+	nicklist_names_hold(c, n->r);
+
+	nicklist_names_add(c, n->key);
+}
+
 void
-nicklist_print(channel *c)
+server_set_casemap(server *s, const unsigned char *map)
+{
+	/* Change the case mapping of a server's nicks and channel names.
+	 *
+	 * Nicklists are ordered, and memberships, channels and ignore masks
+	 * keyed, by the case mapping, so any already joined are emptied and
+	 * rebuilt under the new one */
+
+	channel *c = s->channel;
+
+	if (s->casemap == map)
+		return;
+
+	hmap_free(&s->channels);
+
+	do {
+		nicklist_names_hold(c, c->nicklist);
+		nicklist_clear(c, c->nicklist);
+		free_avl(c->nicklist);
+
+		c->nick_count = 0;
+		c->nicklist = NULL;
+	} while ((c = c->next) != s->channel);
+
+	s->casemap = map;
+	s->channels.map = map;
+
+	ignore_set_casemap(&s->ignore, map);
+
+	do {
+		hmap_add(&s->channels, c->name, c);
+		nicklist_names_end(c);
+	} while ((c = c->next) != s->channel);
+}
+
+static void
+nicklist_clear(channel *c, avl_node *n)
 {
-	newline(c, 0, "TODO", "Print ignore list to channel");
+	/* Remove a channel from the membership of each nick in its nicklist */
+
+	if (n == NULL || c->server == NULL)
+		return;
+
+	nicklist_clear(c, n->l);
+	nicklist_clear(c, n->r);
+
+	member_del(c, n->key);
 }
 
 void
@@ -224,6 +499,8 @@ reset_channel(channel *c)
 {
 	memset(c->chanmodes, 0, MODE_SIZE);
 
+	nicklist_clear(c, c->nicklist);
+	nicklist_names_free(c);
 	free_avl(c->nicklist);
 
 	c->nick_count = 0;
@@ -278,6 +555,11 @@ channel_close(channel *c)
 		}
 
 		DLL_DEL(c->server->channel, c);
+
+		/* Unless shadowed by a channel of the same name */
+		if (hmap_get(&c->server->channels, c->name) == c)
+			hmap_del(&c->server->channels, c->name);
+
 		free_channel(c);
 	}
 }
@@ -324,7 +606,7 @@ buffer_scrollback_back(channel *c)
 	struct buffer_line *line = buffer_line(b, buffer_i);
 
 	/* Skip redraw */
-	if (line == buffer_tail(b))
+	if (line == NULL || buffer_i == buffer_first(b))
 		return;
 
 	/* Find top line */
@@ -337,7 +619,7 @@ buffer_scrollback_back(channel *c)
 		if (count >= rows)
 			break;
 
-		if (line == buffer_tail(b))
+		if (buffer_i == buffer_first(b))
 			return;
 
 		line = buffer_line(b, --buffer_i);
@@ -346,7 +628,7 @@ buffer_scrollback_back(channel *c)
 	b->scrollback = buffer_i;
 
 	/* Top line is partial */
-	if (count == rows)
+	if (count == rows && buffer_i != buffer_first(b))
 		b->scrollback--;
 
 	draw_buffer();
@@ -434,10 +716,12 @@ auto_nick(char **autonick, char *nick)
 }
 
 static void
-set_mode_str(char mode_str[MODE_SIZE], const char *modes)
+set_mode_str(char mode_str[MODE_SIZE], const char *modes, const char *skip)
 {
 	/* Given a string of modes, eg: +abc, add or remove flags
-	 * from the mode_str set, maintaining alphabetic order */
+	 * from the mode_str set, maintaining alphabetic order.
+	 *
+	 * Modes in skip are ignored, e.g. those setting no flag */
 
 	char *ptr, pm = 0;
 
@@ -447,7 +731,7 @@ set_mode_str(char mode_str[MODE_SIZE], const char *modes)
 			pm = *modes;
 
 		/* Silently skip invalid flags */
-		else if (!isalpha(*modes) || !pm)
+		else if (!isalpha(*modes) || !pm || strchr(skip, *modes))
 			;
 
 		/* Add flags */
@@ -480,7 +764,7 @@ set_mode_str(char mode_str[MODE_SIZE], const char *modes)
 void
 server_set_mode(server *s, const char *modes)
 {
-	set_mode_str(s->usermodes, modes);
+	set_mode_str(s->usermodes, modes, "");
 
 	if (ccur->server == s)
 		draw_status();
@@ -489,7 +773,14 @@ server_set_mode(server *s, const char *modes)
 void
 channel_set_mode(channel *c, const char *modes)
 {
-	set_mode_str(c->chanmodes, modes);
+	char skip[MODE_SIZE + MODE_SIZE];
+
+	/* List modes and nick prefix modes set no flag on the channel */
+	snprintf(skip, sizeof(skip), "%s%s",
+		c->server->isupport.chanmodes[0],
+		c->server->isupport.prefix_modes);
+
+	set_mode_str(c->chanmodes, modes, skip);
 
 	if (ccur == c)
 		draw_status();
@@ -44,10 +44,16 @@ void channel_set_current(channel*);
 void channel_set_mode(channel*, const char*);
 void free_channel(channel*);
 void newline(channel*, enum buffer_line_t, const char*, const char*);
+void newline_set_time(time_t);
 void newlinef(channel*, enum buffer_line_t, const char*, const char*, ...);
-void nicklist_print(channel*);
+int nicklist_add(channel*, const char*);
+int nicklist_del(channel*, const char*);
+void nicklist_names_add(channel*, const char*);
+void nicklist_names_end(channel*);
+struct member* member_get(server*, const char*);
 void part_channel(channel*);
 void reset_channel(channel*);
+void server_set_casemap(server*, const unsigned char*);
 void server_set_mode(server*, const char*);
 
 #endif
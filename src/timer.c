@@ -0,0 +1,195 @@
+/* timer.c
+ *
+ * One-shot timers, ordered by expiry in a binary min-heap of pointers to
+ * the timers themselves, each of which tracks its position in the heap.
+ *
+ * A timer is removed from the heap before its callback is called, so it
+ * fires exactly once per timer_set, and may be re-armed by its callback. A
+ * timer armed during a timer_run never fires in that same run
+ * */
+
+/* For clock_gettime */
+#define _POSIX_C_SOURCE 200112L
+
+#include <limits.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "timer.h"
+#include "utils.h"
+
+static void timer_remove(struct timer*);
+static void timer_sift_down(size_t);
+static void timer_sift_up(size_t);
+
+static struct
+{
+	size_t n;
+	size_t size;
+	unsigned long run;
+	struct timer **heap;
+} timers;
+
+long
+timer_now(void)
+{
+	/* Monotonic time in milliseconds */
+
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+		fatal("clock_gettime");
+
+	return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+void
+timer_init(struct timer *t, void (*cb)(void*), void *arg)
+{
+	t->expire = 0;
+	t->i = 0;
+	t->cb = cb;
+	t->arg = arg;
+}
+
+int
+timer_pending(const struct timer *t)
+{
+	return (t->i != 0);
+}
+
+void
+timer_set(struct timer *t, long ms)
+{
+	/* Arm a timer to fire in ms milliseconds, re-arming it if pending */
+
+	t->expire = timer_now() + ms;
+	t->run = timers.run;
+
+	if (t->i) {
+		timer_sift_up(t->i - 1);
+		timer_sift_down(t->i - 1);
+		return;
+	}
+
+	if (timers.n == timers.size) {
+
+		timers.size = timers.size ? timers.size * 2 : 16;
+
+		if ((timers.heap = realloc(timers.heap, timers.size * sizeof(*timers.heap))) == NULL)
+			fatal("realloc");
+	}
+
+	timers.heap[timers.n] = t;
+	t->i = ++timers.n;
+
+	timer_sift_up(t->i - 1);
+}
+
+void
+timer_cancel(struct timer *t)
+{
+	if (t->i)
+		timer_remove(t);
+}
+
+int
+timer_timeout(void)
+{
+	/* Return the number of milliseconds until the next timer is due,
+	 * or -1 if none are pending */
+
+	long ms;
+
+	if (timers.n == 0)
+		return -1;
+
+	if ((ms = timers.heap[0]->expire - timer_now()) < 0)
+		return 0;
+
+	return (ms > INT_MAX) ? INT_MAX : (int)ms;
+}
+
+void
+timer_run(void)
+{
+	/* Fire all timers that are due */
+
+	long now = timer_now();
+	unsigned long run = timers.run++;
+	struct timer *t;
+
+	while (timers.n && (t = timers.heap[0])->expire <= now && t->run <= run) {
+		timer_remove(t);
+		t->cb(t->arg);
+	}
+}
+
+void
+timer_free(void)
+{
+	while (timers.n)
+		timer_remove(timers.heap[0]);
+
+	free(timers.heap);
+
+	timers.heap = NULL;
+	timers.size = 0;
+}
+
+static void
+timer_remove(struct timer *t)
+{
+	/* Remove a pending timer, replacing it with the last in the heap */
+
+	size_t i = t->i - 1;
+
+	t->i = 0;
+
+	if (i == --timers.n)
+		return;
+
+	timers.heap[i] = timers.heap[timers.n];
+	timers.heap[i]->i = i + 1;
+
+	timer_sift_up(i);
+	timer_sift_down(i);
+}
+
+static void
+timer_sift_up(size_t i)
+{
+	struct timer *t = timers.heap[i];
+
+	while (i > 0 && t->expire < timers.heap[(i - 1) / 2]->expire) {
+		timers.heap[i] = timers.heap[(i - 1) / 2];
+		timers.heap[i]->i = i + 1;
+		i = (i - 1) / 2;
+	}
+
+	timers.heap[i] = t;
+	t->i = i + 1;
+}
+
+static void
+timer_sift_down(size_t i)
+{
+	size_t c;
+	struct timer *t = timers.heap[i];
+
+	while ((c = 2 * i + 1) < timers.n) {
+
+		if (c + 1 < timers.n && timers.heap[c + 1]->expire < timers.heap[c]->expire)
+			c++;
+
+		if (t->expire <= timers.heap[c]->expire)
+			break;
+
+		timers.heap[i] = timers.heap[c];
+		timers.heap[i]->i = i + 1;
+		i = c;
+	}
+
+	timers.heap[i] = t;
+	t->i = i + 1;
+}
@@ -0,0 +1,35 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+/* timer.h
+ *
+ * One-shot timers on a monotonic millisecond clock
+ *
+ * Timers are embedded in the structures they belong to and ordered by a
+ * binary min-heap, so arming, re-arming and canceling are O(log n) and the
+ * main loop can sleep until the earliest deadline. A zeroed timer is valid
+ * and not pending */
+
+#include <stddef.h>
+
+struct timer
+{
+	long expire;           /* Monotonic time at which the timer fires, in ms */
+	size_t i;              /* Position in the heap + 1, 0 if not pending */
+	unsigned long run;     /* timer_run in which the timer was armed */
+	void (*cb)(void*);
+	void *arg;
+};
+
+int timer_pending(const struct timer*);
+int timer_timeout(void);
+
+long timer_now(void);
+
+void timer_cancel(struct timer*);
+void timer_free(void);
+void timer_init(struct timer*, void (*)(void*), void*);
+void timer_run(void);
+void timer_set(struct timer*, long);
+
+#endif
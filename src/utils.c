@@ -1,10 +1,9 @@
 #include <stdio.h>
-#include <ctype.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <setjmp.h>
 #include <stdarg.h>
 #include <string.h>
-#include <strings.h>
 
 #include "utils.h"
 
@@ -13,17 +12,68 @@
 
 static int irc_isnickchar(const char);
 
+/* Message parsing functions */
+static void parse_tags(parsed_mesg*, char*);
+
 /* AVL tree function */
+struct avl_sort
+{
+	unsigned long long prefix;
+	char *key;
+};
+
 static avl_node* _avl_add(avl_node*, const char*, void*);
 static avl_node* _avl_del(avl_node*, const char*);
 static avl_node* _avl_get(avl_node*, const char*, size_t);
+static avl_node* avl_build(avl_node**, size_t);
 static avl_node* avl_new_node(const char*, void*);
+static int avl_cmp(const void*, const void*);
+static unsigned long long avl_prefix(const char*);
+static void avl_sort(struct avl_sort*, struct avl_sort*, size_t);
+static size_t avl_count(avl_node*);
+static size_t avl_flatten(avl_node*, avl_node**);
 static void avl_free_node(avl_node*);
 static avl_node* avl_rotate_L(avl_node*);
 static avl_node* avl_rotate_R(avl_node*);
 
+/* Hash map functions */
+static struct hmap_entry* hmap_find(const struct hmap*, const char*, unsigned long);
+static unsigned long hmap_key_hash(const struct hmap*, const char*);
+static void hmap_grow(struct hmap*);
+
 static jmp_buf jmpbuf;
 
+/* Interned string, indexed by its text, see str_intern */
+struct istr
+{
+	unsigned int refs;
+	char str[];
+};
+
+#define ISTR(S) ((struct istr *)((S) - offsetof(struct istr, str)))
+
+static struct hmap istrs;
+
+/* Case mapping of the AVL tree operation in progress */
+static const unsigned char *avl_map;
+
+/* Case mapping tables, folding 'A' through the given upper bound by 32 */
+#define CM(C, U)    (((C) >= 'A' && (C) <= (U)) ? (C) + 32 : (C))
+#define CM4(C, U)   CM(C, U), CM(C + 1, U), CM(C + 2, U), CM(C + 3, U)
+#define CM16(C, U)  CM4(C, U), CM4(C + 4, U), CM4(C + 8, U), CM4(C + 12, U)
+#define CM64(C, U)  CM16(C, U), CM16(C + 16, U), CM16(C + 32, U), CM16(C + 48, U)
+#define CASEMAP(U) { CM64(0, U), CM64(64, U), CM64(128, U), CM64(192, U) }
+
+const unsigned char casemap_ascii[256]          = CASEMAP('Z');
+const unsigned char casemap_rfc1459[256]        = CASEMAP('^');
+const unsigned char casemap_strict_rfc1459[256] = CASEMAP(']');
+
+#undef CASEMAP
+#undef CM64
+#undef CM16
+#undef CM4
+#undef CM
+
 void
 error(int errnum, const char *fmt, ...)
 {
@@ -57,11 +107,18 @@ getarg(char **str, const char *sep)
 	 * Returns NULL if *str is NULL or contains only sep characters */
 
 	char *ret, *ptr;
+	unsigned char c, set[256 / 8] = {0};
 
 	if (str == NULL || (ptr = *str) == NULL)
 		return NULL;
 
-	while (*ptr && strchr(sep, *ptr))
+	/* Bitset of sep characters, NUL is always a separator */
+	for (set[0] = 1; (c = *sep); sep++)
+		set[c >> 3] |= 1 << (c & 7);
+
+	#define IS_SEP(C) (set[(unsigned char)(C) >> 3] & (1 << ((unsigned char)(C) & 7)))
+
+	while (*ptr && IS_SEP(*ptr))
 		ptr++;
 
 	if (*ptr == '\0')
@@ -69,7 +126,7 @@ getarg(char **str, const char *sep)
 
 	ret = ptr;
 
-	while (*ptr && !strchr(sep, *ptr))
+	while (!IS_SEP(*ptr))
 		ptr++;
 
 	/* If the string continues after the found arg, set the input to point
@@ -78,10 +135,12 @@ getarg(char **str, const char *sep)
 	 * This might result in *str pointing to the original string's null
 	 * terminator, in which case the next call to getarg will return NULL */
 
-	*str = ptr + (*ptr && strchr(sep, *ptr));
+	*str = ptr + (*ptr != '\0');
 
 	*ptr = '\0';
 
+	#undef IS_SEP
+
 	return ret;
 }
 
@@ -115,9 +174,9 @@ irc_isnickchar(const char c)
 parsed_mesg*
 parse(parsed_mesg *p, char *mesg)
 {
-	/* RFC 2812, section 2.3.1
+	/* RFC 2812, section 2.3.1, with IRCv3 message tags
 	 *
-	 * message    =   [ ":" prefix SPACE ] command [ params ] crlf
+	 * message    =   [ "@" tags SPACE ] [ ":" prefix SPACE ] command [ params ] crlf
 	 * prefix     =   servername / ( nickname [ [ "!" user ] "@" host ] )
 	 * command    =   1*letter / 3digit
 	 * params     =   *14( SPACE middle ) [ SPACE ":" trailing ]
@@ -130,81 +189,223 @@ parse(parsed_mesg *p, char *mesg)
 	 *
 	 * SPACE      =   %x20        ; space character
 	 * crlf       =   %x0D %x0A   ; "carriage return" "linefeed"
+	 *
+	 * The message is split in place in a single pass, each token found with
+	 * strchr and terminated at the space following it
 	 */
 
-	memset(p, 0, sizeof(parsed_mesg));
+	char *end;
+	unsigned int n = 0;
+
+	/* Tags past n_tags are left unset */
+	memset(p, 0, offsetof(parsed_mesg, tags));
+	p->n_tags = 0;
 
 	/* Skip leading whitespace */
-	while (*mesg && *mesg == ' ')
+	while (*mesg == ' ')
 		mesg++;
 
+	/* Check for tags and parse if detected */
+	if (*mesg == '@') {
+
+		if ((end = strchr(mesg, ' ')) == NULL)
+			return NULL;
+
+		*end = '\0';
+
+		parse_tags(p, mesg + 1);
+
+		mesg = end + 1;
+
+		while (*mesg == ' ')
+			mesg++;
+	}
+
 	/* Check for prefix and parse if detected */
 	if (*mesg == ':') {
 
 		p->from = ++mesg;
 
-		while (*mesg) {
-			if (*mesg == '!' || (*mesg == '@' && !p->hostinfo)) {
-				*mesg++ = '\0';
-				p->hostinfo = mesg;
-			} else if (*mesg == ' ') {
-				*mesg++ = '\0';
-				break;
-			}
-			mesg++;
+		if ((end = strchr(mesg, ' ')) == NULL)
+			return NULL;
+
+		*end = '\0';
+
+		if ((mesg = strpbrk(p->from, "!@"))) {
+			*mesg++ = '\0';
+			p->hostinfo = mesg;
 		}
+
+		mesg = end + 1;
+
+		while (*mesg == ' ')
+			mesg++;
 	}
 
 	/* The command is minimally required for a valid message */
-	if (!(p->command = getarg(&mesg, " ")))
+	if (*mesg == '\0')
 		return NULL;
 
-	/* Keep track of the last arg so it can be terminated */
-	char *param_end = NULL;
+	p->command = mesg;
 
-	int param_count = 0;
+	if ((end = strchr(mesg, ' ')) == NULL)
+		return p;
 
-	while (*mesg) {
+	*end = '\0';
+	mesg = end + 1;
+
+	for (;;) {
 
 		/* Skip whitespace before each parameter */
-		while (*mesg && *mesg == ' ')
+		while (*mesg == ' ')
 			mesg++;
 
-		/* Parameter found */
-		if (*mesg) {
+		if (*mesg == '\0')
+			break;
+
+		/* Trailing section found, or maximum number of middle parameters */
+		if (*mesg == ':' || n == PARSE_PARAMS_MAX - 1) {
+			p->trailing = mesg + (*mesg == ':');
+			p->params[n] = p->trailing;
+			p->lens[n++] = strlen(p->trailing);
+			break;
+		}
+
+		p->params[n] = mesg;
+
+		if ((end = strchr(mesg, ' ')) == NULL) {
+			p->lens[n++] = strlen(mesg);
+			break;
+		}
+
+		*end = '\0';
+		p->lens[n++] = end - mesg;
+		mesg = end + 1;
+	}
+
+	p->n_params = n;
+
+	return p;
+}
+
+static void
+parse_tags(parsed_mesg *p, char *tags)
+{
+	/* IRCv3 message tags
+	 *
+	 * tags       =   tag *[ ";" tag ]
+	 * tag        =   key [ "=" escaped_value ]
+	 * key        =   [ client_prefix ] [ vendor "/" ] 1*( ALPHA / DIGIT / "-" )
+	 *
+	 * Tags are split in place, values are unescaped on demand by tag_value */
+
+	static const char *const known[] = {
+#define X(T, K) K,
+		PARSE_TAGS_KNOWN
+#undef X
+	};
+
+	char *key, *val;
+	int i;
+	struct tag *t;
+
+	do {
+		key = tags;
+
+		if ((tags = strchr(tags, ';')))
+			*tags++ = '\0';
+
+		if (*key == '\0' || *key == '=')
+			continue;
+
+		if (p->n_tags == PARSE_TAGS_MAX)
+			break;
+
+		if ((val = strchr(key, '='))) {
+			*val++ = '\0';
+		} else {
+			val = "";
+		}
 
-			/* Maximum number of parameters found */
-			if (param_count == 14) {
-				p->trailing = mesg;
+		t = &p->tags[p->n_tags++];
+		t->key = key;
+		t->val = val;
+		t->escaped = (*val != '\0');
+
+		/* Index well-known keys, when sent more than once the last is used */
+		for (i = 0; i < TAG_T_SIZE; i++) {
+			if (*key == *known[i] && !strcmp(key, known[i])) {
+				p->known[i] = t;
 				break;
 			}
+		}
+	} while (tags);
+}
 
-			/* Trailing section found */
-			if (*mesg == ':') {
-				p->trailing = (mesg + 1);
-				break;
+struct tag*
+tag_get(parsed_mesg *p, const char *key)
+{
+	/* Return the last tag with key, or NULL if not sent */
+
+	unsigned int i = p->n_tags;
+
+	while (i--) {
+		if (!strcmp(p->tags[i].key, key))
+			return &p->tags[i];
+	}
+
+	return NULL;
+}
+
+char*
+tag_value(struct tag *t)
+{
+	/* Return a tag's value, unescaping it in place when first read */
+
+	char *r, *w;
+
+	if (t->escaped && (r = strchr(t->val, '\\'))) {
+
+		for (w = r; *r; r++) {
+
+			if (*r != '\\') {
+				*w++ = *r;
+				continue;
 			}
 
-			if (!p->params)
-				p->params = mesg;
+			switch (*++r) {
+				case ':':
+					*w++ = ';';
+					break;
+				case 's':
+					*w++ = ' ';
+					break;
+				case 'r':
+					*w++ = '\r';
+					break;
+				case 'n':
+					*w++ = '\n';
+					break;
+				case '\0':
+					/* Trailing backslash is dropped */
+					r--;
+					break;
+				default:
+					/* Including an escaped backslash */
+					*w++ = *r;
+			}
 		}
 
-		while (*mesg && *mesg != ' ')
-			mesg++;
-
-		param_count++;
-		param_end = mesg;
+		*w = '\0';
 	}
 
-	/* Terminate the last parameter if any */
-	if (param_end)
-		*param_end = '\0';
+	t->escaped = 0;
 
-	return p;
+	return t->val;
 }
 
 int
-check_pinged(const char *mesg, const char *nick)
+check_pinged(const char *mesg, const char *nick, const unsigned char *map)
 {
 
 	int len = strlen(nick);
@@ -212,11 +413,11 @@ check_pinged(const char *mesg, const char *nick)
 	while (*mesg) {
 
 		/* skip any prefixing characters that wouldn't match a valid nick */
-		while (!(*mesg >= 0x41 && *mesg <= 0x7D))
+		while (*mesg && !(*mesg >= 0x41 && *mesg <= 0x7D))
 			mesg++;
 
 		/* nick prefixes the word, following character is space or symbol */
-		if (!strncasecmp(mesg, nick, len) && !irc_isnickchar(*(mesg + len))) {
+		if (!casemap_ncmp(map, mesg, nick, len) && !irc_isnickchar(*(mesg + len))) {
 			putchar('\a');
 			return 1;
 		}
@@ -305,10 +506,12 @@ free_avl(avl_node *n)
 }
 
 int
-avl_add(avl_node **n, const char *key, void *val)
+avl_add(avl_node **n, const char *key, void *val, const unsigned char *map)
 {
 	/* Entry point for adding a node to an AVL tree */
 
+	avl_map = map;
+
 	if (setjmp(jmpbuf))
 		return 0;
 
@@ -318,10 +521,12 @@ avl_add(avl_node **n, const char *key, void *val)
 }
 
 int
-avl_del(avl_node **n, const char *key)
+avl_del(avl_node **n, const char *key, const unsigned char *map)
 {
 	/* Entry point for removing a node from an AVL tree */
 
+	avl_map = map;
+
 	if (setjmp(jmpbuf))
 		return 0;
 
@@ -330,11 +535,85 @@ avl_del(avl_node **n, const char *key)
 	return 1;
 }
 
+size_t
+avl_merge(avl_node **n, char **keys, size_t len, const unsigned char *map)
+{
+	/* Add keys to an AVL tree in bulk: the keys are sorted, merged with the
+	 * tree's nodes in order, and the tree rebuilt balanced in a single pass,
+	 * O(n log n) overall with no rotations.
+	 *
+	 * The tree takes ownership of the keys, which must be interned. Keys
+	 * already in the tree or repeated are released and set NULL, the others
+	 * remain in keys, sorted. Returns the number of keys added */
+
+	avl_node **nodes;
+	size_t i, j, k, m;
+	size_t added = 0;
+	struct avl_sort *sort;
+
+	if (len == 0)
+		return 0;
+
+	avl_map = map;
+
+	if ((sort = malloc(2 * len * sizeof(*sort))) == NULL)
+		fatal("malloc");
+
+	for (i = 0; i < len; i++) {
+		sort[i].key = keys[i];
+		sort[i].prefix = avl_prefix(keys[i]);
+	}
+
+	avl_sort(sort, sort + len, len);
+
+	for (i = 0; i < len; i++)
+		keys[i] = sort[i].key;
+
+	free(sort);
+
+	m = avl_count(*n);
+
+	if ((nodes = malloc((len + m) * sizeof(*nodes))) == NULL)
+		fatal("malloc");
+
+	/* The tree's nodes follow the space for the merge, which never overtakes
+	 * them, since no more nodes are merged than keys are added */
+	avl_flatten(*n, nodes + len);
+
+	for (i = 0, j = len, k = 0; i < len || j < len + m;) {
+
+		if (j < len + m && (i == len || casemap_cmp(map, keys[i], nodes[j]->key) >= 0)) {
+			nodes[k++] = nodes[j++];
+			continue;
+		}
+
+		if (k && !casemap_cmp(map, keys[i], nodes[k - 1]->key)) {
+			str_release(keys[i]);
+			keys[i++] = NULL;
+			continue;
+		}
+
+		if ((nodes[k] = calloc(1, sizeof(*nodes[k]))) == NULL)
+			fatal("calloc");
+
+		nodes[k++]->key = keys[i++];
+		added++;
+	}
+
+	*n = avl_build(nodes, k);
+
+	free(nodes);
+
+	return added;
+}
+
 const avl_node*
-avl_get(avl_node *n, const char *key, size_t len)
+avl_get(avl_node *n, const char *key, size_t len, const unsigned char *map)
 {
 	/* Entry point for fetching an avl node with prefix key */
 
+	avl_map = map;
+
 	if (setjmp(jmpbuf))
 		return NULL;
 
@@ -350,16 +629,134 @@ avl_new_node(const char *key, void *val)
 		fatal("calloc");
 
 	n->height = 1;
-	n->key = strdup(key);
+	n->key = str_intern(key);
 	n->val = val;
 
 	return n;
 }
 
+static avl_node*
+avl_build(avl_node **nodes, size_t n)
+{
+	/* Link n sorted nodes into a balanced tree, returning its root */
+
+	avl_node *r;
+	size_t mid = n / 2;
+
+	if (n == 0)
+		return NULL;
+
+	r = nodes[mid];
+	r->l = avl_build(nodes, mid);
+	r->r = avl_build(nodes + mid + 1, n - mid - 1);
+	r->height = MAX(H(r->l), H(r->r)) + 1;
+
+	return r;
+}
+
+static int
+avl_cmp(const void *a, const void *b)
+{
+	const struct avl_sort *x = a, *y = b;
+
+	return casemap_cmp(avl_map, x->key, y->key);
+}
+
+static void
+avl_sort(struct avl_sort *s, struct avl_sort *tmp, size_t n)
+{
+	/* Sort keys as the case mapping orders them: a radix sort of their prefixes,
+	 * a byte per pass, then runs of keys sharing a prefix sorted in full */
+
+	int shift;
+	size_t count[256], i, j, sum;
+	struct avl_sort *swap, *out = s;
+
+	for (shift = 0; shift < 64; shift += 8) {
+
+		memset(count, 0, sizeof(count));
+
+		for (i = 0; i < n; i++)
+			count[(s[i].prefix >> shift) & 0xff]++;
+
+		/* All keys have the same byte */
+		if (count[(s[0].prefix >> shift) & 0xff] == n)
+			continue;
+
+		for (i = 0, sum = 0; i < 256; i++) {
+			j = count[i];
+			count[i] = sum;
+			sum += j;
+		}
+
+		for (i = 0; i < n; i++)
+			tmp[count[(s[i].prefix >> shift) & 0xff]++] = s[i];
+
+		swap = s;
+		s = tmp;
+		tmp = swap;
+	}
+
+	if (s != out)
+		memcpy(out, s, n * sizeof(*s));
+
+	/* Keys with equal prefixes shorter than 8 characters are equal */
+	for (i = 0; i < n; i = j) {
+
+		for (j = i + 1; j < n && out[j].prefix == out[i].prefix; j++)
+			;
+
+		if (j - i > 1 && (out[i].prefix & 0xff))
+			qsort(out + i, j - i, sizeof(*out), avl_cmp);
+	}
+}
+
+static unsigned long long
+avl_prefix(const char *key)
+{
+	/* A key's first 8 characters, case folded and packed most significant
+	 * first, so that comparing prefixes orders keys as casemap_cmp does */
+
+	int i;
+	unsigned long long prefix = 0;
+
+	for (i = 0; i < 8; i++) {
+
+		prefix <<= 8;
+
+		if (*key)
+			prefix |= avl_map[(unsigned char)*key++];
+	}
+
+	return prefix;
+}
+
+static size_t
+avl_count(avl_node *n)
+{
+	return n ? avl_count(n->l) + avl_count(n->r) + 1 : 0;
+}
+
+static size_t
+avl_flatten(avl_node *n, avl_node **nodes)
+{
+	/* Write a tree's nodes in order, returning the number written */
+
+	size_t i;
+
+	if (n == NULL)
+		return 0;
+
+	i = avl_flatten(n->l, nodes);
+	nodes[i++] = n;
+
+	return i + avl_flatten(n->r, nodes + i);
+}
+
 static void
 avl_free_node(avl_node *n)
 {
-	free(n->key);
+	str_release(n->key);
 	free(n->val);
 	free(n);
 }
@@ -424,7 +821,7 @@ _avl_add(avl_node *n, const char *key, void *val)
 	if (n == NULL)
 		return avl_new_node(key, val);
 
-	int ret = strcasecmp(key, n->key);
+	int ret = casemap_cmp(avl_map, key, n->key);
 
 	if (ret == 0)
 		/* Duplicate found */
@@ -446,7 +843,7 @@ _avl_add(avl_node *n, const char *key, void *val)
 	if (balance > 1) {
 
 		/* left-right rotation */
-		if (strcasecmp(key, n->l->key) > 0)
+		if (casemap_cmp(avl_map, key, n->l->key) > 0)
 			n->l = avl_rotate_L(n->l);
 
 		return avl_rotate_R(n);
@@ -456,7 +853,7 @@ _avl_add(avl_node *n, const char *key, void *val)
 	if (balance < -1) {
 
 		/* right-left rotation */
-		if (strcasecmp(n->r->key, key) > 0)
+		if (casemap_cmp(avl_map, n->r->key, key) > 0)
 			n->r = avl_rotate_R(n->r);
 
 		return avl_rotate_L(n);
@@ -476,7 +873,7 @@ _avl_del(avl_node *n, const char *key)
 		/* Node not found */
 		longjmp(jmpbuf, 1);
 
-	int ret = strcasecmp(key, n->key);
+	int ret = casemap_cmp(avl_map, key, n->key);
 
 	if (ret == 0) {
 		/* Node found */
@@ -555,7 +952,7 @@ _avl_get(avl_node *n, const char *key, size_t len)
 	if (n == NULL)
 		longjmp(jmpbuf, 1);
 
-	int ret = strncasecmp(key, n->key, len);
+	int ret = casemap_ncmp(avl_map, key, n->key, len);
 
 	if (ret > 0)
 		return _avl_get(n->r, key, len);
@@ -566,3 +963,214 @@ _avl_get(avl_node *n, const char *key, size_t len)
 	/* Match found */
 	return n;
 }
+
+unsigned long
+hmap_hash(const char *key)
+{
+	/* FNV-1a */
+
+	unsigned long hash = 2166136261UL;
+
+	while (*key) {
+		hash ^= (unsigned char)*key++;
+		hash *= 16777619UL;
+	}
+
+	return hash;
+}
+
+int
+hmap_add(struct hmap *h, const char *key, void *val)
+{
+	/* Add key to a hash map, returning 0 if the key already exists */
+
+	size_t i;
+	unsigned long hash = hmap_key_hash(h, key);
+
+	if (hmap_find(h, key, hash))
+		return 0;
+
+	if ((h->n + 1) * 4 > h->size * 3)
+		hmap_grow(h);
+
+	for (i = hash & (h->size - 1); h->entries[i].key; i = (i + 1) & (h->size - 1))
+		;
+
+	h->entries[i].hash = hash;
+	h->entries[i].key = key;
+	h->entries[i].val = val;
+	h->n++;
+
+	return 1;
+}
+
+void*
+hmap_del(struct hmap *h, const char *key)
+{
+	/* Remove key from a hash map, returning its value, or NULL if not found.
+	 *
+	 * Entries following in the probe sequence are shifted back into the gap,
+	 * so lookups never need to skip deleted entries */
+
+	size_t i, j, k, mask = h->size - 1;
+	struct hmap_entry *e;
+	void *val;
+
+	if ((e = hmap_find(h, key, hmap_key_hash(h, key))) == NULL)
+		return NULL;
+
+	val = e->val;
+
+	for (i = j = (size_t)(e - h->entries);;) {
+
+		e = &h->entries[i];
+		e->key = NULL;
+
+		do {
+			j = (j + 1) & mask;
+
+			if (h->entries[j].key == NULL) {
+				h->n--;
+				return val;
+			}
+
+			k = h->entries[j].hash & mask;
+
+		/* Entry at j can't move to i if its home slot k lies cyclically in (i, j] */
+		} while ((i <= j) ? (i < k && k <= j) : (i < k || k <= j));
+
+		*e = h->entries[j];
+		i = j;
+	}
+}
+
+void*
+hmap_get(const struct hmap *h, const char *key)
+{
+	/* Return the value of key in a hash map, or NULL if not found */
+
+	struct hmap_entry *e;
+
+	return (e = hmap_find(h, key, hmap_key_hash(h, key))) ? e->val : NULL;
+}
+
+void
+hmap_free(struct hmap *h)
+{
+	/* Free a hash map's table, the keys and values aren't freed */
+
+	free(h->entries);
+
+	h->n = 0;
+	h->size = 0;
+	h->entries = NULL;
+}
+
+char*
+str_intern(const char *str)
+{
+	/* Return a reference to the interned copy of a string.
+	 *
+	 * Equal strings interned share a single refcounted copy, so compare
+	 * equal by pointer. Each str_intern or str_ref is paired with a
+	 * str_release, and interned strings must not be modified */
+
+	size_t len;
+	struct istr *s;
+
+	if ((s = hmap_get(&istrs, str)) == NULL) {
+
+		len = strlen(str);
+
+		if ((s = malloc(sizeof(*s) + len + 1)) == NULL)
+			fatal("malloc");
+
+		s->refs = 0;
+		memcpy(s->str, str, len + 1);
+
+		hmap_add(&istrs, s->str, s);
+	}
+
+	s->refs++;
+
+	return s->str;
+}
+
+char*
+str_ref(char *str)
+{
+	/* Return another reference to an interned string */
+
+	ISTR(str)->refs++;
+
+	return str;
+}
+
+void
+str_release(char *str)
+{
+	/* Release a reference to an interned string, freeing it with the last */
+
+	struct istr *s;
+
+	if (str == NULL)
+		return;
+
+	if (--(s = ISTR(str))->refs == 0) {
+		hmap_del(&istrs, s->str);
+		free(s);
+	}
+}
+
+static struct hmap_entry*
+hmap_find(const struct hmap *h, const char *key, unsigned long hash)
+{
+	size_t i;
+
+	if (h->n == 0)
+		return NULL;
+
+	for (i = hash & (h->size - 1); h->entries[i].key; i = (i + 1) & (h->size - 1)) {
+
+		if (h->entries[i].hash != hash)
+			continue;
+
+		if (h->map ? !casemap_cmp(h->map, h->entries[i].key, key) : !strcmp(h->entries[i].key, key))
+			return &h->entries[i];
+	}
+
+	return NULL;
+}
+
+static unsigned long
+hmap_key_hash(const struct hmap *h, const char *key)
+{
+	return h->map ? casemap_hash(h->map, key) : hmap_hash(key);
+}
+
+static void
+hmap_grow(struct hmap *h)
+{
+	/* Double the size of a hash map's table, reinserting its entries */
+
+	size_t i, j, size = h->size;
+	struct hmap_entry *entries = h->entries;
+
+	h->size = size ? size * 2 : 16;
+
+	if ((h->entries = calloc(h->size, sizeof(*h->entries))) == NULL)
+		fatal("calloc");
+
+	for (i = 0; i < size; i++) {
+
+		if (entries[i].key == NULL)
+			continue;
+
+		for (j = entries[i].hash & (h->size - 1); h->entries[j].key; j = (j + 1) & (h->size - 1))
+			;
+
+		h->entries[j] = entries[i];
+	}
+
+	free(entries);
+}
@@ -2,6 +2,7 @@
 #define UTILS_H
 
 #include <errno.h>
+#include <stddef.h>
 
 /* Nicklist AVL tree node */
 typedef struct avl_node
@@ -13,24 +14,147 @@ typedef struct avl_node
 	void *val;
 } avl_node;
 
-/* Parsed IRC message */
+/* Hash map of string keys to values
+ *
+ * Open addressing with linear probing, the table is a power of two in size
+ * and kept at most 3/4 full. Keys aren't copied and must outlive their entry.
+ *
+ * Keys are compared exactly, or folded by a case mapping if map is set while
+ * the map is empty */
+struct hmap
+{
+	size_t n;
+	size_t size;
+	const unsigned char *map;
+	struct hmap_entry {
+		unsigned long hash;
+		const char *key;
+		void *val;
+	} *entries;
+};
+
+/* Case mappings, tables folding each byte to its lower case equivalent
+ *
+ * ascii:          A-Z are folded to a-z
+ * rfc1459:        A-Z[]\^ are folded to a-z{}|~
+ * strict-rfc1459: A-Z[]\ are folded to a-z{}|
+ *
+ * Strings are ordered by comparing their folded bytes */
+extern const unsigned char casemap_ascii[256];
+extern const unsigned char casemap_rfc1459[256];
+extern const unsigned char casemap_strict_rfc1459[256];
+
+static inline int
+casemap_ncmp(const unsigned char *map, const char *s1, const char *s2, size_t n)
+{
+	const unsigned char *a = (const unsigned char *)s1;
+	const unsigned char *b = (const unsigned char *)s2;
+
+	/* Interned strings compare equal by pointer */
+	if (a == b)
+		return 0;
+
+	for (; n && map[*a] == map[*b]; a++, b++, n--) {
+		if (*a == '\0')
+			return 0;
+	}
+
+	return n ? map[*a] - map[*b] : 0;
+}
+
+static inline int
+casemap_cmp(const unsigned char *map, const char *s1, const char *s2)
+{
+	return casemap_ncmp(map, s1, s2, (size_t)-1);
+}
+
+static inline unsigned long
+casemap_hash(const unsigned char *map, const char *key)
+{
+	/* FNV-1a of the folded key, equal for keys that compare equal */
+
+	unsigned long hash = 2166136261UL;
+
+	while (*key) {
+		hash ^= map[(unsigned char)*key++];
+		hash *= 16777619UL;
+	}
+
+	return hash;
+}
+
+/* Maximum number of parameters in a message, RFC 2812 */
+#define PARSE_PARAMS_MAX 15
+
+/* Maximum number of message tags kept, further tags are skipped */
+#define PARSE_TAGS_MAX 32
+
+/* IRCv3 message tags looked up by handlers, by key */
+#define PARSE_TAGS_KNOWN \
+	X(TAG_ACCOUNT, "account") \
+	X(TAG_BATCH,   "batch") \
+	X(TAG_LABEL,   "label") \
+	X(TAG_MSGID,   "msgid") \
+	X(TAG_TIME,    "time")
+
+enum tag_t
+{
+#define X(T, K) T,
+	PARSE_TAGS_KNOWN
+#undef X
+	TAG_T_SIZE
+};
+
+/* IRCv3 message tag, the key and value point into the parsed message
+ *
+ * Values are left escaped until read with tag_value, a missing value is "" */
+struct tag
+{
+	char *key;
+	char *val;
+	int escaped;
+};
+
+/* Parsed IRC message
+ *
+ * params holds the middle parameters followed by the trailing parameter, if
+ * any, which is also pointed to by trailing. Unused params are NULL.
+ *
+ * known holds the tags in PARSE_TAGS_KNOWN, NULL if not sent. Entries in
+ * tags past n_tags are unset */
 typedef struct parsed_mesg
 {
 	char *from;
 	char *hostinfo;
 	char *command;
-	char *params;
+	char *params[PARSE_PARAMS_MAX];
 	char *trailing;
+	size_t lens[PARSE_PARAMS_MAX];
+	unsigned int n_params;
+	unsigned int n_tags;
+	struct tag *known[TAG_T_SIZE];
+	struct tag tags[PARSE_TAGS_MAX];
 } parsed_mesg;
 
 char* getarg(char**, const char*);
+char* str_intern(const char*);
+char* str_ref(char*);
+void str_release(char*);
 char* strdup(const char*);
+char* tag_value(struct tag*);
 char* word_wrap(int, char**, char*);
-const avl_node* avl_get(avl_node*, const char*, size_t);
-int avl_add(avl_node**, const char*, void*);
-int avl_del(avl_node**, const char*);
-int check_pinged(const char*, const char*);
+const avl_node* avl_get(avl_node*, const char*, size_t, const unsigned char*);
+int avl_add(avl_node**, const char*, void*, const unsigned char*);
+int avl_del(avl_node**, const char*, const unsigned char*);
+int check_pinged(const char*, const char*, const unsigned char*);
+size_t avl_merge(avl_node**, char**, size_t, const unsigned char*);
+int hmap_add(struct hmap*, const char*, void*);
+unsigned long hmap_hash(const char*);
+void* hmap_del(struct hmap*, const char*);
+void* hmap_get(const struct hmap*, const char*);
+void hmap_free(struct hmap*);
 parsed_mesg* parse(parsed_mesg*, char*);
+struct tag* tag_get(parsed_mesg*, const char*);
 void error(int status, const char*, ...);
 void free_avl(avl_node*);
 
@@ -1,10 +1,17 @@
+/* For mkstemp, pwrite */
+#define _POSIX_C_SOURCE 200809L
+
 #include "test.h"
 
 #include "../src/utils.c" /* FIXME: word_wrap */
 #include "../src/buffer.c"
+#include "../src/spill.c"
 
 #include <limits.h>
 
+/* Lines kept in history by the buffers tested */
+#define LINES_MAX (1 << 10)
+
 static char*
 _fmt_int(int i)
 {
@@ -21,7 +28,7 @@ _buffer_newline(struct buffer *b, const char *t)
 {
 	/* Abstract newline with default values */
 
-	buffer_newline(b, BUFFER_LINE_OTHER, "", t);
+	buffer_newline(b, BUFFER_LINE_OTHER, "", t, time(NULL));
 }
 
 static void
@@ -29,7 +36,7 @@ test_buffer(void)
 {
 	/* Test retrieving values from an initialized buffer and resetting it */
 
-	struct buffer b = buffer(BUFFER_T_SIZE);
+	struct buffer b = buffer(BUFFER_T_SIZE, LINES_MAX);
 
 	assert_equals(b.type, BUFFER_T_SIZE);
 
@@ -39,7 +46,7 @@ test_buffer(void)
 	assert_null(buffer_line(&b, b.scrollback));
 
 	/* Reset the buffer, check values again */
-	b = buffer(BUFFER_T_SIZE);
+	b = buffer(BUFFER_T_SIZE, LINES_MAX);
 
 	assert_equals(b.type, BUFFER_T_SIZE);
 
@@ -47,6 +54,8 @@ test_buffer(void)
 	assert_null(buffer_head(&b));
 	assert_null(buffer_tail(&b));
 	assert_null(buffer_line(&b, b.scrollback));
+
+	buffer_free(&b);
 }
 
 static void
@@ -56,15 +65,17 @@ test_buffer_head(void)
 
 	int i;
 
-	struct buffer b = buffer(BUFFER_OTHER);
+	struct buffer b = buffer(BUFFER_OTHER, LINES_MAX);
 
 	assert_null(buffer_head(&b));
 
-	for (i = 0; i < BUFFER_LINES_MAX + 1; i++)
+	for (i = 0; i < LINES_MAX + 1; i++)
 		_buffer_newline(&b, _fmt_int(i + 1));
 
-	assert_strcmp(buffer_head(&b)->text, _fmt_int(BUFFER_LINES_MAX + 1));
-	assert_equals(buffer_size(&b), BUFFER_LINES_MAX);
+	assert_strcmp(buffer_head(&b)->text, _fmt_int(LINES_MAX + 1));
+	assert_equals(buffer_size(&b), LINES_MAX);
+
+	buffer_free(&b);
 }
 
 static void
@@ -74,20 +85,22 @@ test_buffer_tail(void)
 
 	int i;
 
-	struct buffer b = buffer(BUFFER_OTHER);
+	struct buffer b = buffer(BUFFER_OTHER, LINES_MAX);
 
 	assert_null(buffer_tail(&b));
 
-	for (i = 0; i < BUFFER_LINES_MAX; i++)
+	for (i = 0; i < LINES_MAX; i++)
 		_buffer_newline(&b, _fmt_int(i + 1));
 
 	assert_strcmp(buffer_tail(&b)->text, _fmt_int(1));
-	assert_equals(buffer_size(&b), BUFFER_LINES_MAX);
+	assert_equals(buffer_size(&b), LINES_MAX);
 
 	_buffer_newline(&b, _fmt_int(i + 1));
 
 	assert_strcmp(buffer_tail(&b)->text, _fmt_int(2));
-	assert_equals(buffer_size(&b), BUFFER_LINES_MAX);
+	assert_equals(buffer_size(&b), LINES_MAX);
+
+	buffer_free(&b);
 }
 
 static void
@@ -95,7 +108,7 @@ test_buffer_line(void)
 {
 	/* Test that retrieving a buffer line fails when i != [tail, head) */
 
-	struct buffer b = buffer(BUFFER_OTHER);
+	struct buffer b = buffer(BUFFER_OTHER, LINES_MAX);
 
 	/* Should retrieve null for an empty buffer */
 	assert_equals(buffer_size(&b), 0);
@@ -119,7 +132,7 @@ test_buffer_line(void)
 	 * a, c : invalid */
 
 	b.tail = 1;
-	b.head = 1 + BUFFER_LINES_MAX;
+	b.head = 1 + LINES_MAX;
 	CHECK_BUFFER(b);
 
 	/* Inverted case:
@@ -130,7 +143,7 @@ test_buffer_line(void)
 	 * a, c : valid */
 
 	b.tail = UINT_MAX - 1;
-	b.head = UINT_MAX - 1 + BUFFER_LINES_MAX;
+	b.head = UINT_MAX - 1 + LINES_MAX;
 	CHECK_BUFFER(b);
 
 	/* Edge case, head is 0
@@ -139,7 +152,7 @@ test_buffer_line(void)
 	 * a : invalid
 	 * b : valid */
 
-	b.tail = 0 - BUFFER_LINES_MAX;
+	b.tail = 0 - LINES_MAX;
 	b.head = 0;
 	CHECK_BUFFER(b);
 
@@ -149,7 +162,7 @@ test_buffer_line(void)
 	 * a : invalid
 	 * b : valid */
 
-	b.tail = UINT_MAX - BUFFER_LINES_MAX;
+	b.tail = UINT_MAX - LINES_MAX;
 	b.head = UINT_MAX;
 	CHECK_BUFFER(b);
 
@@ -160,7 +173,7 @@ test_buffer_line(void)
 	 * b : invalid */
 
 	b.tail = 0;
-	b.head = 0 + BUFFER_LINES_MAX;
+	b.head = 0 + LINES_MAX;
 	CHECK_BUFFER(b);
 
 	/* Edge case, tail is UINT_MAX
@@ -170,10 +183,15 @@ test_buffer_line(void)
 	 * c    : invalid */
 
 	b.tail = UINT_MAX;
-	b.head = UINT_MAX + BUFFER_LINES_MAX;
+	b.head = UINT_MAX + LINES_MAX;
 	CHECK_BUFFER(b);
 
 	#undef CHECK_BUFFER
+
+	/* No lines were added, only indexed */
+	b.tail = b.head;
+
+	buffer_free(&b);
 }
 
 static void
@@ -186,7 +204,7 @@ test_buffer_scrollback(void)
 	 *   Buffer scrollback stays locked to the tail when incrementing
 	 * */
 
-	struct buffer b = buffer(BUFFER_OTHER);
+	struct buffer b = buffer(BUFFER_OTHER, LINES_MAX);
 
 	/* Empty buffer returns NULL */
 	assert_null(buffer_line(&b, b.scrollback));
@@ -209,7 +227,7 @@ test_buffer_scrollback(void)
 	assert_strcmp(buffer_line(&b, b.scrollback)->text, "b");
 
 	/* Buffer scrollback stays locked to the buffer tail when incrementing */
-	b.head = b.tail + BUFFER_LINES_MAX;
+	b.head = b.tail + LINES_MAX;
 	assert_true(buffer_full(&b));
 
 	_buffer_newline(&b, "e");
@@ -217,6 +235,8 @@ test_buffer_scrollback(void)
 
 	_buffer_newline(&b, "f");
 	assert_strcmp(buffer_line(&b, b.scrollback)->text, "c");
+
+	buffer_free(&b);
 }
 
 static void
@@ -224,10 +244,10 @@ test_buffer_scrollback_status(void)
 {
 	/* Test retrieving buffer scrollback status */
 
-	struct buffer b = buffer(BUFFER_OTHER);
+	struct buffer b = buffer(BUFFER_OTHER, LINES_MAX);
 
-	b.head = (BUFFER_LINES_MAX / 2) - 1;
-	b.tail = UINT_MAX - (BUFFER_LINES_MAX / 2);
+	b.head = (LINES_MAX / 2) - 1;
+	b.tail = UINT_MAX - (LINES_MAX / 2);
 	b.scrollback = b.tail;
 
 	assert_true(buffer_full(&b));
@@ -235,11 +255,16 @@ test_buffer_scrollback_status(void)
 	b.scrollback = b.tail;
 	assert_equals((int)(100 * buffer_scrollback_status(&b)), 100);
 
-	b.scrollback = b.tail + (BUFFER_LINES_MAX / 2);
+	b.scrollback = b.tail + (LINES_MAX / 2);
 	assert_equals((int)(100 * buffer_scrollback_status(&b)), 50);
 
 	b.scrollback = b.head - 1;
 	assert_equals((int)(100 * buffer_scrollback_status(&b)), 0);
+
+	/* No lines were added, only indexed */
+	b.tail = b.head;
+
+	buffer_free(&b);
 }
 
 static void
@@ -247,24 +272,29 @@ test_buffer_index_overflow(void)
 {
 	/* Test masked indexing after unsigned integer overflow */
 
-	struct buffer b = buffer(BUFFER_OTHER);
+	struct buffer b = buffer(BUFFER_OTHER, LINES_MAX);
+
+	/* Allocate the buffer's lines */
+	_buffer_newline(&b, _fmt_int(1));
 
 	b.head = UINT_MAX;
 	b.tail = UINT_MAX - 1;
 	b.scrollback = b.tail;
 
 	assert_equals(buffer_size(&b), 1);
-	assert_equals(MASK(b.head), (BUFFER_LINES_MAX - 1));
+	assert_equals(MASK(&b, b.head), (BUFFER_LINES_MIN - 1));
 
 	_buffer_newline(&b, _fmt_int(0));
 
 	assert_equals(buffer_size(&b), 2);
-	assert_equals(MASK(b.head), 0);
+	assert_equals(MASK(&b, b.head), 0);
 
 	_buffer_newline(&b, _fmt_int(-1));
 
 	assert_equals(buffer_size(&b), 3);
 	assert_strcmp(b.buffer_lines[0].text, _fmt_int(-1));
+
+	buffer_free(&b);
 }
 
 static void
@@ -272,7 +302,7 @@ test_buffer_line_overlength(void)
 {
 	/* Test that lines over the maximum length are recursively split and added separately */
 
-	struct buffer b = buffer(BUFFER_OTHER);
+	struct buffer b = buffer(BUFFER_OTHER, LINES_MAX);
 
 	/* Indices to first and last positions of lines, total length = 2.5 times the maximum */
 	unsigned int f1 = 0,
@@ -283,7 +313,7 @@ test_buffer_line_overlength(void)
 	             l3 = TEXT_LENGTH_MAX * 2 + TEXT_LENGTH_MAX / 2 - 1;
 
 	/* Add a line that's 2.5 times the maximum length */
-	char text[l3 + 1];
+	char text[l3 + 2];
 
 	memset(&text, ' ', sizeof(text) - 1);
 
@@ -294,7 +324,7 @@ test_buffer_line_overlength(void)
 	text[f3] = 'c';
 	text[l3] = 'C';
 
-	text[sizeof(text)] = 0;
+	text[sizeof(text) - 1] = 0;
 
 	_buffer_newline(&b, text);
 
@@ -311,6 +341,8 @@ test_buffer_line_overlength(void)
 
 	assert_equals(b.buffer_lines[2].text[0], 'c');
 	assert_equals(b.buffer_lines[2].text[TEXT_LENGTH_MAX / 2 - 1], 'C');
+
+	buffer_free(&b);
 }
 
 static void
@@ -318,7 +350,7 @@ test_buffer_line_rows(void)
 {
 	/* Test calculating the number of rows a buffer line occupies */
 
-	struct buffer b = buffer(BUFFER_OTHER);
+	struct buffer b = buffer(BUFFER_OTHER, LINES_MAX);
 
 	_buffer_newline(&b, "aa bb cc");
 
@@ -349,6 +381,324 @@ test_buffer_line_rows(void)
 	_buffer_newline(&b, "");
 
 	assert_equals(buffer_line_rows(buffer_head(&b), 1), 1);
+
+	buffer_free(&b);
+}
+
+static void
+test_buffer_line_from(void)
+{
+	/* Test line senders are shared, and released when overwritten or freed */
+
+	int i;
+
+	char from[FROM_LENGTH_MAX + 2];
+
+	struct buffer b = buffer(BUFFER_OTHER, LINES_MAX);
+
+	buffer_newline(&b, BUFFER_LINE_OTHER, "nick", "a", time(NULL));
+	buffer_newline(&b, BUFFER_LINE_OTHER, "nick", "b", time(NULL));
+
+	assert_true(buffer_line(&b, 0)->from == buffer_line(&b, 1)->from);
+	assert_equals((int)ISTR(buffer_line(&b, 0)->from)->refs, 2);
+
+	for (i = 0; i < LINES_MAX - 1; i++)
+		buffer_newline(&b, BUFFER_LINE_OTHER, "other", "c", time(NULL));
+
+	/* Only the second line remains */
+	assert_strcmp(buffer_tail(&b)->from, "nick");
+	assert_equals((int)ISTR(buffer_tail(&b)->from)->refs, 1);
+
+	/* Overlength senders are truncated */
+	memset(from, 'a', sizeof(from) - 1);
+	from[sizeof(from) - 1] = 0;
+
+	buffer_newline(&b, BUFFER_LINE_OTHER, from, "d", time(NULL));
+
+	assert_equals((int)strlen(buffer_head(&b)->from), FROM_LENGTH_MAX);
+	assert_equals((int)buffer_head(&b)->from_len, FROM_LENGTH_MAX);
+
+	buffer_free(&b);
+
+	assert_null(hmap_get(&istrs, "nick"));
+	assert_null(hmap_get(&istrs, "other"));
+}
+
+static void
+test_buffer_line_text(void)
+{
+	/* Test line texts are kept as the arena is repacked, and the space of
+	 * lines overwritten is reclaimed */
+
+	char text[TEXT_LENGTH_MAX + 1];
+	size_t size;
+	unsigned int i;
+
+	struct buffer b = buffer(BUFFER_OTHER, LINES_MAX);
+
+	for (i = 0; i < LINES_MAX * 4; i++)
+		_buffer_newline(&b, _fmt_int(i));
+
+	for (i = 0; i < LINES_MAX; i++)
+		assert_strcmp(buffer_line(&b, b.tail + i)->text, _fmt_int(LINES_MAX * 3 + i));
+
+	/* At most 1.5x the text of the lines remaining, 5 bytes each, and
+	 * of the longest line added */
+	assert_true(b.text_size <= (LINES_MAX * 5 + 6) * 3 / 2);
+
+	/* Longer lines grow the arena */
+	memset(text, 'a', sizeof(text) - 1);
+	text[sizeof(text) - 1] = 0;
+
+	for (i = 0; i < LINES_MAX; i++)
+		_buffer_newline(&b, text);
+
+	assert_true(b.text_size >= LINES_MAX * sizeof(text));
+	assert_strcmp(buffer_tail(&b)->text, text);
+
+	/* Shorter lines shrink it, when next repacked */
+	for (size = b.text_size; b.text_size == size;)
+		_buffer_newline(&b, "");
+
+	assert_true(b.text_size <= (LINES_MAX + 1) * 3 / 2);
+	assert_strcmp(buffer_tail(&b)->text, "");
+
+	buffer_free(&b);
+
+	assert_null(b.text);
+	assert_equals((int)b.text_size, 0);
+}
+
+static void
+test_buffer_grow(void)
+{
+	/* Test lines allocated grow in powers of 2 until the buffer is full,
+	 * keeping their order across unsigned integer overflow */
+
+	unsigned int i;
+
+	struct buffer b = buffer(BUFFER_OTHER, LINES_MAX);
+
+	assert_null(b.buffer_lines);
+	assert_equals(b.lines_size, 0);
+
+	_buffer_newline(&b, _fmt_int(0));
+
+	assert_equals(b.lines_size, BUFFER_LINES_MIN);
+
+	/* Index of the next line wraps before the lines are regrown */
+	b.head = b.tail = b.scrollback = UINT_MAX - 1;
+
+	for (i = 0; i <= BUFFER_LINES_MIN; i++)
+		_buffer_newline(&b, _fmt_int(i));
+
+	assert_equals(b.lines_size, BUFFER_LINES_MIN * 2);
+
+	for (i = 0; i <= BUFFER_LINES_MIN; i++)
+		assert_strcmp(buffer_line(&b, UINT_MAX - 1 + i)->text, _fmt_int(i));
+
+	for (; i < LINES_MAX * 2; i++)
+		_buffer_newline(&b, _fmt_int(i));
+
+	assert_equals(b.lines_size, LINES_MAX);
+	assert_equals(buffer_size(&b), LINES_MAX);
+	assert_strcmp(buffer_tail(&b)->text, _fmt_int(LINES_MAX));
+	assert_strcmp(buffer_head(&b)->text, _fmt_int(LINES_MAX * 2 - 1));
+
+	buffer_free(&b);
+
+	assert_null(b.buffer_lines);
+	assert_equals(b.lines_size, 0);
+}
+
+static void
+test_buffer_lines_max(void)
+{
+	/* Test buffers keep the number of lines they're initialized with */
+
+	unsigned int i;
+
+	struct buffer b1 = buffer(BUFFER_OTHER, 1),
+	              b2 = buffer(BUFFER_OTHER, 4);
+
+	assert_true(buffer_lines_valid(1));
+	assert_true(buffer_lines_valid(BUFFER_LINES_MAX));
+	assert_false(buffer_lines_valid(0));
+	assert_false(buffer_lines_valid(3));
+	assert_false(buffer_lines_valid(BUFFER_LINES_MAX * 2));
+
+	assert_fatal(buffer(BUFFER_OTHER, 0));
+	assert_fatal(buffer(BUFFER_OTHER, 24));
+
+	for (i = 0; i < 8; i++) {
+		_buffer_newline(&b1, _fmt_int(i));
+		_buffer_newline(&b2, _fmt_int(i));
+	}
+
+	assert_equals(buffer_size(&b1), 1);
+	assert_equals(b1.lines_size, 1);
+	assert_strcmp(buffer_tail(&b1)->text, "7");
+
+	assert_equals(buffer_size(&b2), 4);
+	assert_equals(b2.lines_size, 4);
+	assert_strcmp(buffer_tail(&b2)->text, "4");
+	assert_strcmp(buffer_head(&b2)->text, "7");
+
+	buffer_free(&b1);
+	buffer_free(&b2);
+}
+
+static void
+test_buffer_spill(void)
+{
+	/* Test lines overwritten are spilled across segments, and read back in
+	 * order with the lines in memory, across unsigned integer overflow */
+
+	char from[FROM_LENGTH_MAX + 1], text[TEXT_LENGTH_MAX + 1];
+	unsigned int i, j, n = 1000;
+
+	struct buffer b = buffer(BUFFER_OTHER, 4);
+	struct buffer_line *line;
+
+	spill_init("/tmp");
+
+	b.head = b.tail = b.scrollback = UINT_MAX - 100;
+
+	for (i = 0; i < n; i++) {
+
+		/* Long lines fill a segment every ~100 lines */
+		memset(text, 'a' + i % 26, TEXT_LENGTH_MAX);
+		text[(i % 3) ? i % 50 : TEXT_LENGTH_MAX] = 0;
+
+		snprintf(from, sizeof(from), "nick%u", i % 7);
+
+		buffer_newline(&b, (i % 2) ? BUFFER_LINE_CHAT : BUFFER_LINE_OTHER, from, text, (time_t)i);
+	}
+
+	assert_equals(buffer_size(&b), 4);
+	assert_true(b.spill != NULL);
+	assert_equals(b.spill->n, n - 4);
+	assert_true(b.spill->segs.n > 1);
+	assert_equals(buffer_first(&b), UINT_MAX - 100);
+
+	for (i = 0, j = buffer_first(&b); j != b.head; i++, j++) {
+
+		memset(text, 'a' + i % 26, TEXT_LENGTH_MAX);
+		text[(i % 3) ? i % 50 : TEXT_LENGTH_MAX] = 0;
+
+		snprintf(from, sizeof(from), "nick%u", i % 7);
+
+		if ((line = buffer_line(&b, j)) == NULL)
+			fail_test("line is NULL");
+
+		assert_strcmp(line->from, from);
+		assert_strcmp(line->text, text);
+		assert_equals((int)line->text_len, (int)strlen(text));
+		assert_equals((int)line->time, (int)i);
+		assert_equals(line->type, (i % 2) ? BUFFER_LINE_CHAT : BUFFER_LINE_OTHER);
+	}
+
+	assert_equals(i, n);
+
+	/* Read again, in reverse */
+	for (j = b.head; j-- != buffer_first(&b);)
+		assert_equals((int)buffer_line(&b, j)->time, (int)--i);
+
+	assert_fatal(buffer_line(&b, buffer_first(&b) - 1));
+
+	/* Scrollback isn't locked to the tail */
+	b.scrollback = buffer_first(&b);
+
+	assert_true(buffer_scrollback_status(&b) == 1.0);
+
+	_buffer_newline(&b, "");
+
+	assert_equals(b.scrollback, UINT_MAX - 100);
+	assert_equals(buffer_first(&b), UINT_MAX - 100);
+
+	buffer_free(&b);
+
+	assert_null(b.spill);
+
+	/* Segments freed are reused */
+	j = spill_segs;
+
+	b = buffer(BUFFER_OTHER, 4);
+
+	for (i = 0; i < n; i++)
+		_buffer_newline(&b, _fmt_int(i));
+
+	assert_equals(spill_segs, j);
+	assert_strcmp(buffer_line(&b, buffer_first(&b))->text, "0");
+
+	buffer_free(&b);
+
+	/* Spilling is disabled on the first failure, the spill file created anew */
+	close(spill_fd);
+	spill_fd = -1;
+	spill_segs = 0;
+	spill_free_segs.n = 0;
+
+	spill_init("/nonexistent");
+
+	b = buffer(BUFFER_OTHER, 4);
+
+	for (i = 0; i < 8; i++)
+		_buffer_newline(&b, _fmt_int(i));
+
+	assert_null(b.spill);
+	assert_null(spill_new());
+	assert_equals(buffer_first(&b), b.tail);
+	assert_strcmp(buffer_tail(&b)->text, "4");
+	assert_equals(spill_error(), ENOENT);
+	assert_equals(spill_error(), 0);
+
+	buffer_free(&b);
+
+	spill_init(NULL);
+}
+
+static void
+test_buffer_spill_max(void)
+{
+	/* Test a buffer's oldest segment is reused once SPILL_SEGMENTS_MAX are
+	 * spilled, dropping its lines, with scrollback kept on the first line */
+
+	char text[TEXT_LENGTH_MAX + 1];
+	unsigned int i, segs;
+
+	struct buffer b = buffer(BUFFER_OTHER, 4);
+
+	spill_init("/tmp");
+
+	memset(text, 'a', TEXT_LENGTH_MAX);
+	text[TEXT_LENGTH_MAX] = 0;
+
+	for (i = 0; b.spill == NULL || b.spill->segs.n < SPILL_SEGMENTS_MAX; i++)
+		buffer_newline(&b, BUFFER_LINE_OTHER, "", text, (time_t)i);
+
+	segs = spill_segs;
+
+	assert_equals(buffer_first(&b), 0);
+	assert_equals((int)buffer_line(&b, 0)->time, 0);
+
+	b.scrollback = 0;
+
+	for (; b.spill->first == 0; i++)
+		buffer_newline(&b, BUFFER_LINE_OTHER, "", text, (time_t)i);
+
+	assert_equals((int)b.spill->segs.n, SPILL_SEGMENTS_MAX);
+	assert_equals(spill_segs, segs);
+	assert_equals(b.scrollback, buffer_first(&b));
+	assert_true(buffer_first(&b) > 0);
+	assert_equals((int)buffer_line(&b, buffer_first(&b))->time, (int)buffer_first(&b));
+	assert_equals((int)buffer_line(&b, b.head - 1)->time, (int)i - 1);
+	assert_fatal(buffer_line(&b, buffer_first(&b) - 1));
+	assert_fatal(buffer_line(&b, 0));
+
+	buffer_free(&b);
+
+	spill_init(NULL);
 }
 
 int
@@ -364,6 +714,12 @@ main(void)
 		TESTCASE(test_buffer_index_overflow),
 		TESTCASE(test_buffer_line_overlength),
 		TESTCASE(test_buffer_line_rows),
+		TESTCASE(test_buffer_line_from),
+		TESTCASE(test_buffer_line_text),
+		TESTCASE(test_buffer_grow),
+		TESTCASE(test_buffer_lines_max),
+		TESTCASE(test_buffer_spill),
+		TESTCASE(test_buffer_spill_max),
 	};
 
 	return run_tests(tests);
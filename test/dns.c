@@ -0,0 +1,254 @@
+/* For addrinfo, getaddrinfo */
+#define _POSIX_C_SOURCE 200112L
+
+#include "test.h"
+
+#include "../src/utils.c"
+#include "../src/dns.c"
+
+#include <arpa/inet.h>
+#include <poll.h>
+
+/* Stand-in for the system resolver, in /etc/hosts format */
+static const char *hosts =
+	"127.0.0.1     localhost\n"
+	"::1           localhost\n"
+	"192.0.2.10    irc.example.net\n";
+
+static int resolve_count;
+static int callback_count;
+static struct dns_result callback_result;
+
+static int
+_hosts_resolve(const char *host, const char *port, struct dns_result *r)
+{
+	/* Resolve host from the hosts table, counting calls */
+
+	char addr[64], name[256];
+	const char *p;
+	int n;
+	struct dns_addr *a;
+
+	__atomic_add_fetch(&resolve_count, 1, __ATOMIC_SEQ_CST);
+
+	for (p = hosts; sscanf(p, "%63s %255s%n", addr, name, &n) == 2; p += n) {
+
+		if (strcmp(name, host))
+			continue;
+
+		if ((r->addrs = realloc(r->addrs, (r->count + 1) * sizeof(*r->addrs))) == NULL)
+			return EAI_MEMORY;
+
+		a = memset(&r->addrs[r->count++], 0, sizeof(*a));
+		a->socktype = SOCK_STREAM;
+
+		if (strchr(addr, ':')) {
+			struct sockaddr_in6 *sa = (struct sockaddr_in6*)&a->addr;
+			a->family = sa->sin6_family = AF_INET6;
+			a->addrlen = sizeof(*sa);
+			sa->sin6_port = htons(atoi(port));
+			inet_pton(AF_INET6, addr, &sa->sin6_addr);
+		} else {
+			struct sockaddr_in *sa = (struct sockaddr_in*)&a->addr;
+			a->family = sa->sin_family = AF_INET;
+			a->addrlen = sizeof(*sa);
+			sa->sin_port = htons(atoi(port));
+			inet_pton(AF_INET, addr, &sa->sin_addr);
+		}
+	}
+
+	return r->count ? 0 : EAI_NONAME;
+}
+
+static void
+_callback(void *arg, const struct dns_result *r)
+{
+	(void)(arg);
+
+	callback_count++;
+
+	free(callback_result.addrs);
+
+	callback_result = *r;
+	callback_result.addrs = NULL;
+
+	if (r->count == 0)
+		return;
+
+	if ((callback_result.addrs = malloc(r->count * sizeof(*r->addrs))) == NULL)
+		fatal("malloc");
+
+	memcpy(callback_result.addrs, r->addrs, r->count * sizeof(*r->addrs));
+}
+
+static void
+_dns_wait(void)
+{
+	/* Wait for lookups to complete and dispatch them */
+
+	struct pollfd fds[] = {{ .fd = dns_fd(), .events = POLLIN }};
+
+	if (poll(fds, 1, 1000) != 1)
+		fail_test("timed out waiting for lookup");
+
+	dns_dispatch();
+}
+
+static void
+_dns_reset(void)
+{
+	dns_free();
+
+	resolve_count = 0;
+	callback_count = 0;
+}
+
+static void
+test_dns_lookup(void)
+{
+	/* Test lookups are resolved by a worker and completed on dispatch */
+
+	char ipstr[INET6_ADDRSTRLEN];
+	struct sockaddr_in *sa;
+
+	_dns_reset();
+
+	if (dns_lookup("irc.example.net", "6697", _callback, NULL) == NULL)
+		fail_test("lookup should be pending");
+
+	assert_equals(callback_count, 0);
+
+	_dns_wait();
+
+	assert_equals(callback_count, 1);
+	assert_equals(resolve_count, 1);
+	assert_equals(callback_result.error, 0);
+	assert_equals((int)callback_result.count, 1);
+
+	sa = (struct sockaddr_in*)&callback_result.addrs[0].addr;
+
+	assert_equals(callback_result.addrs[0].family, AF_INET);
+	assert_equals(ntohs(sa->sin_port), 6697);
+	assert_strcmp((char*)inet_ntop(AF_INET, &sa->sin_addr, ipstr, sizeof(ipstr)), "192.0.2.10");
+
+	/* Multiple address families */
+	if (dns_lookup("localhost", "6667", _callback, NULL) == NULL)
+		fail_test("lookup should be pending");
+
+	_dns_wait();
+
+	assert_equals(callback_count, 2);
+	assert_equals((int)callback_result.count, 2);
+	assert_equals(callback_result.addrs[0].family, AF_INET);
+	assert_equals(callback_result.addrs[1].family, AF_INET6);
+}
+
+static void
+test_dns_cache(void)
+{
+	/* Test lookups are cached per host:port until expired */
+
+	_dns_reset();
+
+	if (dns_lookup("irc.example.net", "6667", _callback, NULL) == NULL)
+		fail_test("lookup should be pending");
+
+	_dns_wait();
+
+	assert_equals(resolve_count, 1);
+	assert_equals(callback_count, 1);
+
+	/* Cached, the callback is called immediately */
+	assert_null(dns_lookup("irc.example.net", "6667", _callback, NULL));
+
+	assert_equals(resolve_count, 1);
+	assert_equals(callback_count, 2);
+	assert_equals((int)callback_result.count, 1);
+
+	/* Different port isn't cached */
+	if (dns_lookup("irc.example.net", "6697", _callback, NULL) == NULL)
+		fail_test("lookup should be pending");
+
+	_dns_wait();
+
+	assert_equals(resolve_count, 2);
+	assert_equals(callback_count, 3);
+
+	/* Expired entries are resolved again */
+	dns.cache->expire = time(NULL) - 1;
+	dns.cache->next->expire = time(NULL) - 1;
+
+	if (dns_lookup("irc.example.net", "6667", _callback, NULL) == NULL)
+		fail_test("lookup should be pending");
+
+	_dns_wait();
+
+	assert_equals(resolve_count, 3);
+	assert_equals(callback_count, 4);
+}
+
+static void
+test_dns_error(void)
+{
+	/* Test failed lookups are reported and not cached */
+
+	_dns_reset();
+
+	if (dns_lookup("unknown.example.net", "6667", _callback, NULL) == NULL)
+		fail_test("lookup should be pending");
+
+	_dns_wait();
+
+	assert_equals(callback_count, 1);
+	assert_equals(callback_result.error, EAI_NONAME);
+
+	if (dns_lookup("unknown.example.net", "6667", _callback, NULL) == NULL)
+		fail_test("lookup should be pending");
+
+	_dns_wait();
+
+	assert_equals(resolve_count, 2);
+	assert_equals(callback_count, 2);
+}
+
+static void
+test_dns_cancel(void)
+{
+	/* Test canceled lookups never call back */
+
+	int i;
+	struct dns_query *q[DNS_WORKERS * 2];
+	struct pollfd fds[] = {{ .fd = dns_fd(), .events = POLLIN }};
+
+	_dns_reset();
+
+	for (i = 0; i < DNS_WORKERS * 2; i++)
+		q[i] = dns_lookup("irc.example.net", "6667", _callback, NULL);
+
+	for (i = 0; i < DNS_WORKERS * 2; i++)
+		dns_cancel(q[i]);
+
+	/* Allow any lookups already picked up by workers to finish */
+	poll(fds, 1, 100);
+
+	dns_dispatch();
+
+	assert_equals(callback_count, 0);
+}
+
+int
+main(void)
+{
+	testcase tests[] = {
+		TESTCASE(test_dns_lookup),
+		TESTCASE(test_dns_cache),
+		TESTCASE(test_dns_error),
+		TESTCASE(test_dns_cancel),
+	};
+
+	dns_init();
+
+	dns_resolve_fn = _hosts_resolve;
+
+	return run_tests(tests);
+}
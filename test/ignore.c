@@ -0,0 +1,157 @@
+#include "test.h"
+
+#include "../src/utils.c"
+#include "../src/ignore.c"
+
+static void
+test_ignore_add(void)
+{
+	/* Test masks are normalized, and listed in the order added */
+
+	struct ignore i = {0};
+
+	ignore_set_casemap(&i, casemap_rfc1459);
+
+	assert_equals(ignore_add(&i, "nick"), 1);
+	assert_equals(ignore_add(&i, "nick!*"), 0);
+	assert_equals(ignore_add(&i, "nick!*@*"), 0);
+	assert_equals(ignore_add(&i, "NICK"), 0);
+	assert_equals(ignore_add(&i, "host.example.net"), 1);
+	assert_equals(ignore_add(&i, "*!*@HOST.example.net"), 0);
+	assert_equals(ignore_add(&i, "@spam.example.net"), 1);
+	assert_equals(ignore_add(&i, "*!*@spam.example.net"), 0);
+	assert_equals(ignore_add(&i, "bot*!~user"), 1);
+
+	/* Invalid masks */
+	assert_equals(ignore_add(&i, ""), -1);
+	assert_equals(ignore_add(&i, "a b"), -1);
+	assert_equals(ignore_add(&i, "user@host!nick"), -1);
+
+	assert_strcmp(ignore_get(&i, 0), "nick!*@*");
+	assert_strcmp(ignore_get(&i, 1), "*!*@host.example.net");
+	assert_strcmp(ignore_get(&i, 2), "*!*@spam.example.net");
+	assert_strcmp(ignore_get(&i, 3), "bot*!~user@*");
+	assert_null(ignore_get(&i, 4));
+
+	ignore_free(&i);
+
+	assert_null(ignore_get(&i, 0));
+}
+
+static void
+test_ignore_match(void)
+{
+	/* Test matching nick, host and glob masks */
+
+	struct ignore i = {0};
+
+	ignore_set_casemap(&i, casemap_rfc1459);
+
+	assert_false(ignore_match(&i, "nick", "user@host"));
+
+	ignore_add(&i, "nick[1]");
+	ignore_add(&i, "*!*@spam.example.net");
+	ignore_add(&i, "bot*!~user@*.example.org");
+	ignore_add(&i, "*!*@10.0.?.*");
+
+	/* Nicks, by case mapping */
+	assert_true(ignore_match(&i, "nick[1]", "user@host"));
+	assert_true(ignore_match(&i, "NICK{1}", "user@host"));
+	assert_true(ignore_match(&i, "nick[1]", NULL));
+	assert_false(ignore_match(&i, "nick[2]", "user@host"));
+
+	/* Hosts */
+	assert_true(ignore_match(&i, "anyone", "user@spam.example.net"));
+	assert_true(ignore_match(&i, "anyone", "user@SPAM.example.net"));
+	assert_false(ignore_match(&i, "anyone", "user@ham.example.net"));
+	assert_false(ignore_match(&i, "anyone", "user@x.spam.example.net"));
+
+	/* Globs */
+	assert_true(ignore_match(&i, "bot", "~user@a.example.org"));
+	assert_true(ignore_match(&i, "BOT123", "~USER@a.b.example.org"));
+	assert_false(ignore_match(&i, "bot", "user@a.example.org"));
+	assert_false(ignore_match(&i, "abot", "~user@a.example.org"));
+	assert_false(ignore_match(&i, "bot", "~user@example.org"));
+	assert_false(ignore_match(&i, "bot", NULL));
+	assert_true(ignore_match(&i, "anyone", "user@10.0.1.2"));
+	assert_false(ignore_match(&i, "anyone", "user@10.0.12.2"));
+
+	/* No sender */
+	assert_false(ignore_match(&i, NULL, NULL));
+
+	ignore_free(&i);
+}
+
+static void
+test_ignore_del(void)
+{
+	/* Test removing masks, by any equal mask */
+
+	struct ignore i = {0};
+
+	ignore_set_casemap(&i, casemap_rfc1459);
+
+	ignore_add(&i, "a");
+	ignore_add(&i, "@b.example.net");
+	ignore_add(&i, "c*");
+	ignore_add(&i, "d");
+
+	assert_equals(ignore_del(&i, "x"), 0);
+	assert_equals(ignore_del(&i, ""), 0);
+
+	assert_equals(ignore_del(&i, "A!*@*"), 1);
+	assert_equals(ignore_del(&i, "*!*@B.example.net"), 1);
+	assert_equals(ignore_del(&i, "c*"), 1);
+	assert_equals(ignore_del(&i, "c*"), 0);
+
+	assert_false(ignore_match(&i, "a", "user@host"));
+	assert_false(ignore_match(&i, "nick", "user@b.example.net"));
+	assert_false(ignore_match(&i, "cat", "user@host"));
+	assert_true(ignore_match(&i, "d", "user@host"));
+
+	assert_strcmp(ignore_get(&i, 0), "d!*@*");
+	assert_null(ignore_get(&i, 1));
+
+	ignore_free(&i);
+}
+
+static void
+test_ignore_set_casemap(void)
+{
+	/* Test masks are recompiled by a new case mapping, merging any made equal */
+
+	struct ignore i = {0};
+
+	ignore_set_casemap(&i, casemap_ascii);
+
+	assert_equals(ignore_add(&i, "nick[1]"), 1);
+	assert_equals(ignore_add(&i, "nick{1}"), 1);
+	assert_equals(ignore_add(&i, "x[*"), 1);
+
+	assert_false(ignore_match(&i, "NICK{2}", NULL));
+	assert_false(ignore_match(&i, "X{y", NULL));
+
+	ignore_set_casemap(&i, casemap_rfc1459);
+
+	assert_strcmp(ignore_get(&i, 0), "nick[1]!*@*");
+	assert_strcmp(ignore_get(&i, 1), "x[*!*@*");
+	assert_null(ignore_get(&i, 2));
+
+	assert_true(ignore_match(&i, "NICK{1}", NULL));
+	assert_true(ignore_match(&i, "X{y", NULL));
+
+	ignore_free(&i);
+}
+
+int
+main(void)
+{
+	testcase tests[] = {
+		TESTCASE(test_ignore_add),
+		TESTCASE(test_ignore_match),
+		TESTCASE(test_ignore_del),
+		TESTCASE(test_ignore_set_casemap),
+	};
+
+	return run_tests(tests);
+}
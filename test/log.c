@@ -0,0 +1,178 @@
+/* For localtime_r, mkdtemp, setenv */
+#define _POSIX_C_SOURCE 200809L
+
+#include "test.h"
+
+#include "../src/utils.c"
+#include "../src/log.c"
+
+/* 2023-11-14 22:13:20 UTC */
+#define T0 ((time_t)1700000000)
+
+static char dir[] = "/tmp/rirc-log-XXXXXX";
+
+static char*
+_read_file(const char *name)
+{
+	/* Return the contents of a file in the log directory, removing it */
+
+	static char buf[1 << 23];
+	char path[256];
+	size_t n;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+
+	if ((f = fopen(path, "r")) == NULL)
+		return NULL;
+
+	n = fread(buf, 1, sizeof(buf) - 1, f);
+	buf[n] = '\0';
+
+	fclose(f);
+	unlink(path);
+
+	return buf;
+}
+
+static void
+_rmdir(const char *name)
+{
+	char path[256];
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+
+	rmdir(path);
+}
+
+static void
+test_log_disabled(void)
+{
+	/* Test lines aren't queued while logging is disabled */
+
+	assert_equals(log_line("irc.example.net", "#chan", T0, "nick", "text", 4), 0);
+	assert_null(logger.q);
+	assert_equals((int)logger.head, 0);
+
+	log_free();
+}
+
+static void
+test_log_files(void)
+{
+	/* Test lines are written per network and per channel, and rotated by date */
+
+	log_init(dir, 0);
+
+	assert_equals(log_line("irc.example.net", NULL, T0, "--", "Connected", 9), 0);
+	assert_equals(log_line("irc.example.net", "#chan", T0 + 1, "nick", "hello, world", 5), 0);
+	assert_equals(log_line("irc.example.net", "#chan", T0 + 2, "", "* nick waves", 12), 0);
+	assert_equals(log_line("irc.example.net", "nick", T0 + 3, "nick", "hi", 2), 0);
+	assert_equals(log_line("irc.example.net", "#chan", T0 + 86400, "nick", "tomorrow", 8), 0);
+	assert_equals(log_line("irc.example.org", "#chan", T0, "nick", "elsewhere", 9), 0);
+	assert_equals(log_line("irc.example.org", "#a/b", T0, "nick", "path", 4), 0);
+	assert_equals(log_line("..", NULL, T0, "--", "dots", 4), 0);
+
+	log_free();
+
+	assert_null(logger.q);
+
+	assert_strcmp(_read_file("irc.example.net.2023-11-14.log"),
+		"22:13:20 -- Connected\n");
+	assert_strcmp(_read_file("irc.example.net/#chan.2023-11-14.log"),
+		"22:13:21 nick hello\n"
+		"22:13:22  * nick waves\n");
+	assert_strcmp(_read_file("irc.example.net/nick.2023-11-14.log"),
+		"22:13:23 nick hi\n");
+	assert_strcmp(_read_file("irc.example.net/#chan.2023-11-15.log"),
+		"22:13:20 nick tomorrow\n");
+	assert_strcmp(_read_file("irc.example.org/#chan.2023-11-14.log"),
+		"22:13:20 nick elsewhere\n");
+	assert_strcmp(_read_file("irc.example.org/#a_b.2023-11-14.log"),
+		"22:13:20 nick path\n");
+	assert_strcmp(_read_file("_..2023-11-14.log"),
+		"22:13:20 -- dots\n");
+
+	_rmdir("irc.example.net");
+	_rmdir("irc.example.org");
+}
+
+static void
+test_log_queue(void)
+{
+	/* Test lines are dropped when the queue is full, and counted in the log,
+	 * and the queue wraps */
+
+	char text[501], *p;
+	int i, n, written = 0;
+
+	/* Written without the writer */
+	if ((logger.q = malloc(LOG_QUEUE_SIZE)) == NULL)
+		fail_test("malloc");
+
+	logger.dir = dir;
+
+	memset(text, 'x', sizeof(text));
+
+	for (i = 0; i < 3; i++) {
+
+		for (n = 0; log_line("irc.example.net", "#chan", T0, "nick", text, sizeof(text)) == 0; n++)
+			;
+
+		assert_true(n > 0);
+		assert_equals((int)logger.dropped, 1);
+		assert_equals((int)log_drain(), n);
+		assert_equals((int)logger.dropped, 0);
+		assert_equals((int)logger.tail, (int)logger.head);
+
+		written += n;
+	}
+
+	/* Queue wrapped */
+	assert_true(logger.head > LOG_QUEUE_SIZE * 2);
+
+	while (log_files_n)
+		log_file_close(&log_files[--log_files_n]);
+
+	p = _read_file("irc.example.net/#chan.2023-11-14.log");
+
+	for (n = 0; (p = strchr(p, '\n')); p++, n++)
+		;
+
+	/* Lines written, and a line dropped noted per round */
+	assert_equals(n, written + 3);
+
+	free(logger.q);
+
+	logger.q = NULL;
+	logger.dir = NULL;
+	logger.head = 0;
+	logger.tail = 0;
+}
+
+int
+main(void)
+{
+	testcase tests[] = {
+		TESTCASE(test_log_disabled),
+		TESTCASE(test_log_files),
+		TESTCASE(test_log_queue),
+	};
+
+	int ret;
+
+	setenv("TZ", "UTC", 1);
+	tzset();
+
+	if (mkdtemp(dir) == NULL) {
+		perror("mkdtemp");
+		return EXIT_FAILURE;
+	}
+
+	ret = run_tests(tests);
+
+	_rmdir("irc.example.net");
+	rmdir(dir);
+
+	return ret;
+}
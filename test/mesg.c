@@ -0,0 +1,288 @@
+/* For mkstemp, pwrite */
+#define _POSIX_C_SOURCE 200809L
+
+#include "test.h"
+
+#include "../src/utils.c"
+#include "../src/buffer.c"
+#include "../src/spill.c"
+#include "../src/ignore.c"
+#include "../src/log.c"
+#include "../src/state.c"
+#include "../src/mesg.c"
+
+/* Stand-ins for the config, draw, input, net and timer functions used by
+ * state.c and mesg.c, counting redraws of the status bar */
+struct config config = {
+	.scrollback.lines = {
+		[BUFFER_OTHER]   = SCROLLBACK_SERVER,
+		[BUFFER_CHANNEL] = SCROLLBACK_CHANNEL,
+		[BUFFER_SERVER]  = SCROLLBACK_SERVER,
+		[BUFFER_PRIVATE] = SCROLLBACK_PRIVATE
+	}
+};
+
+static int draws;
+
+void action(int (*f)(char), const char *m, ...) { UNUSED(f); UNUSED(m); }
+void draw_all(void) { }
+void draw_buffer(void) { }
+void draw_nav(void) { }
+void draw_status(void) { draws++; }
+void free_input(input *i) { UNUSED(i); }
+server* get_server_head(void) { return NULL; }
+int sendf(char *e, server *s, const char *m, ...) { UNUSED(e); UNUSED(s); UNUSED(m); return 0; }
+int sendf_prio(char *e, server *s, enum send_prio p, const char *m, ...) { UNUSED(e); UNUSED(s); UNUSED(p); UNUSED(m); return 0; }
+server* server_connect(char *h, char *p, char *j, char *n) { UNUSED(h); UNUSED(p); UNUSED(j); UNUSED(n); return NULL; }
+void server_disconnect(server *s, int e, int k, char *m) { UNUSED(s); UNUSED(e); UNUSED(k); UNUSED(m); }
+int timer_pending(const struct timer *t) { UNUSED(t); return 0; }
+void split_buffer_cols(struct buffer_line *l, unsigned int *h, unsigned int *t, unsigned int c, unsigned int p)
+{
+	UNUSED(l); UNUSED(c); UNUSED(p);
+
+	*h = *t = 0;
+}
+
+static void
+_recv(server *s, const char *fmt, ...)
+{
+	/* Receive a formatted message */
+
+	char mesg[BUFFSIZE];
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(mesg, sizeof(mesg), fmt, ap);
+	va_end(ap);
+
+	recv_mesg(mesg, s);
+}
+
+static int
+_lines(channel *c, const char *text)
+{
+	/* Return the number of lines in a channel containing text */
+
+	int n = 0;
+	unsigned int i;
+
+	for (i = buffer_first(&c->buffer); i != c->buffer.head; i++) {
+		if (strstr(buffer_line(&c->buffer, i)->text, text))
+			n++;
+	}
+
+	return n;
+}
+
+static server*
+_server(void)
+{
+	server *s;
+
+	if ((s = calloc(1, sizeof(*s))) == NULL)
+		fail_test("calloc");
+
+	strcpy(s->nick, "me");
+
+	s->soc = 0;
+	s->channel = new_channel("irc.example.net", s, NULL, BUFFER_SERVER);
+
+	recv_reset(s);
+
+	s->caps = CAP_BIT(CAP_BATCH);
+
+	state.current_channel = s->channel;
+
+	return s;
+}
+
+static void
+_server_free(server *s)
+{
+	channel *t, *c = s->channel;
+
+	recv_reset(s);
+
+	do {
+		t = c;
+		c = c->next;
+		free_channel(t);
+	} while (c != s->channel);
+
+	hmap_free(&s->channels);
+	hmap_free(&s->members);
+	free(s);
+}
+
+static void
+test_batch_netsplit(void)
+{
+	/* Test a netsplit's QUITs are applied to the nicklists as received,
+	 * printing a single line per channel and redrawing once when it ends */
+
+	channel *a, *b;
+	char names[BUFFSIZE];
+	int i, len = 0;
+	server *s = _server();
+
+	_recv(s, ":me!u@h JOIN #a");
+	_recv(s, ":me!u@h JOIN #b");
+
+	if ((a = channel_get("#a", s)) == NULL || (b = channel_get("#b", s)) == NULL)
+		fail_test("channel not joined");
+
+	for (i = 0; i < 5000; i++) {
+
+		len += snprintf(names + len, sizeof(names) - len, " u%d", i);
+
+		if (i % 50 == 49) {
+			_recv(s, ":irc.example.net 353 me = #a :me%s", names);
+			len = 0;
+		}
+	}
+
+	_recv(s, ":irc.example.net 366 me #a :End of /NAMES list");
+	_recv(s, ":irc.example.net 353 me = #b :me u1 u2 u3 other");
+	_recv(s, ":irc.example.net 366 me #b :End of /NAMES list");
+
+	assert_equals(a->nick_count, 5001);
+	assert_equals(b->nick_count, 5);
+
+	draws = 0;
+
+	_recv(s, ":irc.example.net BATCH +split netsplit irc.hub other.host");
+
+	for (i = 0; i < 5000; i++)
+		_recv(s, "@batch=split :u%d!u@h QUIT :irc.hub other.host", i);
+
+	/* Applied as received, nothing held or drawn */
+	assert_equals(a->nick_count, 1);
+	assert_equals(b->nick_count, 2);
+	assert_equals((int)s->batches->n, 0);
+	assert_equals(draws, 0);
+
+	_recv(s, ":irc.example.net BATCH -split");
+
+	assert_null(s->batches);
+	assert_equals(draws, 1);
+	assert_equals(_lines(a, "users have quit"), 1);
+	assert_equals(_lines(a, "5000 users have quit (netsplit irc.hub other.host)"), 1);
+	assert_equals(_lines(b, "3 users have quit (netsplit irc.hub other.host)"), 1);
+	assert_equals(_lines(a, "has quit"), 0);
+	assert_equals(_lines(s->channel, "not open"), 0);
+
+	_server_free(s);
+}
+
+static void
+test_batch_netjoin(void)
+{
+	/* Test a netjoin's JOINs are applied to the nicklists as received */
+
+	channel *c;
+	int i;
+	server *s = _server();
+
+	_recv(s, ":me!u@h JOIN #a");
+
+	if ((c = channel_get("#a", s)) == NULL)
+		fail_test("channel not joined");
+
+	draws = 0;
+
+	_recv(s, ":irc.example.net BATCH +join netjoin irc.hub other.host");
+
+	for (i = 0; i < 100; i++)
+		_recv(s, "@batch=join :u%d!u@h JOIN #a", i);
+
+	/* Already joined */
+	_recv(s, "@batch=join :u0!u@h JOIN #a");
+
+	assert_equals(c->nick_count, 100);
+	assert_equals(draws, 0);
+
+	_recv(s, ":irc.example.net BATCH -join");
+
+	assert_equals(draws, 1);
+	assert_equals(_lines(c, "100 users have joined (netjoin irc.hub other.host)"), 1);
+	assert_equals(_lines(c, "has joined"), 0);
+
+	_server_free(s);
+}
+
+static void
+test_batch_ended_early(void)
+{
+	/* Test a batch holding BATCH_LINES_MAX messages is ended early, its
+	 * messages handled in order, and its closing BATCH is accepted */
+
+	channel *c;
+	char text[32];
+	int i;
+	server *s = _server();
+
+	_recv(s, ":me!u@h JOIN #a");
+
+	if ((c = channel_get("#a", s)) == NULL)
+		fail_test("channel not joined");
+
+	_recv(s, ":irc.example.net BATCH +hist chathistory #a");
+
+	for (i = 0; i < BATCH_LINES_MAX - 1; i++)
+		_recv(s, "@batch=hist :nick!u@h PRIVMSG #a :held %d", i);
+
+	assert_equals((int)s->batches->n, BATCH_LINES_MAX - 1);
+	assert_equals(_lines(c, "held"), 0);
+
+	_recv(s, "@batch=hist :nick!u@h PRIVMSG #a :held %d", i);
+
+	assert_equals((int)s->batches->n, 0);
+	assert_true(s->batches->ended);
+	assert_equals(_lines(c, "held"), (int)buffer_size(&c->buffer));
+
+	snprintf(text, sizeof(text), "held %d", BATCH_LINES_MAX - 1);
+
+	assert_strcmp(buffer_head(&c->buffer)->text, text);
+
+	/* Handled unbatched since */
+	_recv(s, "@batch=hist :nick!u@h PRIVMSG #a :after");
+
+	assert_equals(_lines(c, "after"), 1);
+
+	_recv(s, ":irc.example.net BATCH -hist");
+
+	assert_null(s->batches);
+	assert_equals(_lines(s->channel, "not open"), 0);
+
+	/* Batches opened first are ended early, their references kept */
+	for (i = 0; i < BATCH_OPEN_MAX * 3; i++)
+		_recv(s, ":irc.example.net BATCH +b%d chathistory #a", i);
+
+	for (i = 0; i < BATCH_OPEN_MAX * 3; i++)
+		_recv(s, ":irc.example.net BATCH -b%d", i);
+
+	assert_null(s->batches);
+	assert_equals(_lines(s->channel, "not open"), BATCH_OPEN_MAX);
+
+	_server_free(s);
+}
+
+int
+main(void)
+{
+	testcase tests[] = {
+		TESTCASE(test_batch_netsplit),
+		TESTCASE(test_batch_netjoin),
+		TESTCASE(test_batch_ended_early),
+	};
+
+	int ret;
+
+	init_mesg();
+
+	ret = run_tests(tests);
+
+	free_mesg();
+
+	return ret;
+}
@@ -0,0 +1,191 @@
+/* For clock_gettime */
+#define _POSIX_C_SOURCE 200112L
+
+#include "test.h"
+
+#include "../src/utils.c"
+#include "../src/timer.c"
+
+/* Order in which timers fired */
+static int fired[16];
+static int fired_n;
+
+static void
+_fire(void *arg)
+{
+	fired[fired_n++] = *(int*)arg;
+}
+
+static struct timer rearm_timer;
+
+static void
+_fire_rearm(void *arg)
+{
+	/* Re-arm this timer as already due */
+
+	_fire(arg);
+
+	timer_set(&rearm_timer, -1);
+}
+
+static void
+test_timer_order(void)
+{
+	/* Test timers fire once each, in order of expiry */
+
+	int i, vals[] = {3, 1, 4, 0, 2};
+	struct timer t[5];
+
+	fired_n = 0;
+
+	for (i = 0; i < 5; i++) {
+		timer_init(&t[i], _fire, &vals[i]);
+		/* Spaced apart so the clock ticking between sets can't reorder them */
+		timer_set(&t[i], vals[i] * 100 - 1000);
+	}
+
+	for (i = 0; i < 5; i++)
+		assert_true(timer_pending(&t[i]));
+
+	timer_run();
+
+	assert_equals(fired_n, 5);
+
+	for (i = 0; i < 5; i++) {
+		assert_equals(fired[i], i);
+		assert_false(timer_pending(&t[i]));
+	}
+
+	timer_run();
+
+	assert_equals(fired_n, 5);
+	assert_equals(timer_timeout(), -1);
+}
+
+static void
+test_timer_cancel(void)
+{
+	/* Test canceled timers don't fire */
+
+	int i, vals[] = {0, 1, 2, 3};
+	struct timer t[4];
+
+	fired_n = 0;
+
+	for (i = 0; i < 4; i++) {
+		timer_init(&t[i], _fire, &vals[i]);
+		timer_set(&t[i], -10 + i);
+	}
+
+	timer_cancel(&t[0]);
+	timer_cancel(&t[2]);
+
+	/* Canceling a timer that isn't pending has no effect */
+	timer_cancel(&t[2]);
+
+	assert_false(timer_pending(&t[0]));
+	assert_true(timer_pending(&t[1]));
+
+	timer_run();
+
+	assert_equals(fired_n, 2);
+	assert_equals(fired[0], 1);
+	assert_equals(fired[1], 3);
+}
+
+static void
+test_timer_rearm(void)
+{
+	/* Test re-arming a pending timer moves it, and timers armed by a callback
+	 * don't fire in the same run */
+
+	int vals[] = {0, 1};
+	struct timer t;
+
+	fired_n = 0;
+
+	timer_init(&t, _fire, &vals[0]);
+	timer_init(&rearm_timer, _fire_rearm, &vals[1]);
+
+	timer_set(&t, -5);
+	timer_set(&t, 60000);
+
+	timer_set(&rearm_timer, -5);
+
+	timer_run();
+
+	assert_equals(fired_n, 1);
+	assert_equals(fired[0], 1);
+	assert_true(timer_pending(&rearm_timer));
+
+	/* Re-armed timer is due */
+	assert_equals(timer_timeout(), 0);
+
+	timer_run();
+
+	assert_equals(fired_n, 2);
+	assert_equals(fired[1], 1);
+
+	timer_cancel(&rearm_timer);
+
+	/* Remaining timer isn't due */
+	assert_true(timer_timeout() > 59000);
+
+	timer_run();
+
+	assert_equals(fired_n, 2);
+
+	timer_cancel(&t);
+
+	assert_equals(timer_timeout(), -1);
+}
+
+static void
+test_timer_heap(void)
+{
+	/* Test the heap order holds over many arms and cancels */
+
+	int i, j, vals[256];
+	struct timer t[256];
+
+	fired_n = 0;
+
+	for (i = 0; i < 256; i++) {
+		vals[i] = i;
+		timer_init(&t[i], _fire, &vals[i]);
+		timer_set(&t[i], (i * 7919) % 256 - 1000);
+	}
+
+	/* Cancel all but 16 timers, in an order unrelated to expiry */
+	for (i = 0; i < 256; i++) {
+		if ((i * 31) % 16)
+			timer_cancel(&t[(i * 13) % 256]);
+	}
+
+	timer_run();
+
+	assert_equals(fired_n, 16);
+
+	/* Fired in order of expiry */
+	for (j = 1; j < fired_n; j++) {
+		if ((fired[j - 1] * 7919) % 256 > (fired[j] * 7919) % 256)
+			fail_testf("timer %d fired before timer %d", fired[j - 1], fired[j]);
+	}
+
+	timer_free();
+
+	assert_equals(timer_timeout(), -1);
+}
+
+int
+main(void)
+{
+	testcase tests[] = {
+		TESTCASE(test_timer_order),
+		TESTCASE(test_timer_cancel),
+		TESTCASE(test_timer_rearm),
+		TESTCASE(test_timer_heap),
+	};
+
+	return run_tests(tests);
+}
@@ -70,7 +70,7 @@ test_avl(void)
 
 	/* Add all strings to the tree */
 	for (ptr = strings; *ptr; ptr++) {
-		if (!avl_add(&root, *ptr, NULL))
+		if (!avl_add(&root, *ptr, NULL, casemap_ascii))
 			fail_testf("avl_add() failed to add %s", *ptr);
 		else
 			count++;
@@ -98,17 +98,17 @@ test_avl(void)
 		fail_testf("_avl_height() returned %d, expected strictly less than %f", ret, max_height);
 
 	/* Test adding a duplicate and case sensitive duplicate */
-	if (avl_add(&root, "aa", NULL) && count++)
+	if (avl_add(&root, "aa", NULL, casemap_ascii) && count++)
 		fail_test("avl_add() failed to detect duplicate 'aa'");
 
-	if (avl_add(&root, "aA", NULL) && count++)
+	if (avl_add(&root, "aA", NULL, casemap_ascii) && count++)
 		fail_test("avl_add() failed to detect case sensitive duplicate 'aA'");
 
 	/* Delete about half of the strings */
 	int num_delete = count / 2;
 
 	for (ptr = strings; *ptr && num_delete > 0; ptr++, num_delete--) {
-		if (!avl_del(&root, *ptr))
+		if (!avl_del(&root, *ptr, casemap_ascii))
 			fail_testf("avl_del() failed to delete %s", *ptr);
 		else
 			count--;
@@ -139,10 +139,100 @@ test_avl(void)
 		fail_testf("_avl_height() returned %d, expected strictly less than %f", ret, max_height);
 
 	/* Test deleting string that was previously deleted */
-	if (avl_del(&root, *strings))
+	if (avl_del(&root, *strings, casemap_ascii))
 		fail_testf("_avl_del() should have failed to delete %s", *strings);
 }
 
+static int
+_avl_heights_ok(avl_node *n)
+{
+	/* Check each node's height is correct and balanced */
+
+	int l, r;
+
+	if (n == NULL)
+		return 1;
+
+	l = _avl_height(n->l);
+	r = _avl_height(n->r);
+
+	if (n->height != 1 + MAX(l, r) || l - r > 1 || r - l > 1)
+		return 0;
+
+	return _avl_heights_ok(n->l) & _avl_heights_ok(n->r);
+}
+
+void
+test_avl_merge(void)
+{
+	/* Test adding keys to an AVL tree in bulk */
+
+	avl_node *root = NULL;
+
+	char *keys[1000];
+	char buf[16];
+	int i, ret;
+	size_t added;
+
+	/* Merge into an empty tree, with keys repeated */
+	for (i = 0; i < 100; i++) {
+		snprintf(buf, sizeof(buf), "k%03d", (i * 37) % 50);
+		keys[i] = str_intern(buf);
+	}
+
+	if ((added = avl_merge(&root, keys, 100, casemap_ascii)) != 50)
+		fail_testf("avl_merge() returned %zu, expected 50", added);
+
+	for (i = 0, ret = 0; i < 100; i++)
+		ret += (keys[i] != NULL);
+
+	assert_equals(ret, 50);
+	assert_equals(_avl_count(root), 50);
+
+	if (!_avl_is_binary(root))
+		fail_test("_avl_is_binary() failed");
+
+	if (!_avl_heights_ok(root))
+		fail_test("_avl_heights_ok() failed");
+
+	/* Merge into the existing tree, with keys already present in another case */
+	for (i = 0; i < 1000; i++) {
+		snprintf(buf, sizeof(buf), (i % 2 ? "K%03d" : "k%03d"), i);
+		keys[i] = str_intern(buf);
+	}
+
+	if ((added = avl_merge(&root, keys, 1000, casemap_ascii)) != 950)
+		fail_testf("avl_merge() returned %zu, expected 950", added);
+
+	assert_equals(_avl_count(root), 1000);
+
+	if (!_avl_heights_ok(root))
+		fail_test("_avl_heights_ok() failed");
+
+	/* Nodes added remain usable by the other AVL functions */
+	if (!avl_get(root, "K999", 4, casemap_ascii) || !avl_get(root, "k025", 4, casemap_ascii))
+		fail_test("avl_get() failed to find merged keys");
+
+	if (avl_add(&root, "K000", NULL, casemap_ascii))
+		fail_test("avl_add() failed to detect duplicate 'K000'");
+
+	for (i = 0; i < 1000; i += 3) {
+		snprintf(buf, sizeof(buf), "k%03d", i);
+		if (!avl_del(&root, buf, casemap_ascii))
+			fail_testf("avl_del() failed to delete %s", buf);
+	}
+
+	assert_equals(_avl_count(root), 666);
+
+	if (!_avl_heights_ok(root))
+		fail_test("_avl_heights_ok() failed");
+
+	/* Merging no keys has no effect */
+	assert_equals((int)avl_merge(&root, keys, 0, casemap_ascii), 0);
+
+	free_avl(root);
+}
+
 void
 test_getarg(void)
 {
@@ -212,66 +302,80 @@ test_parse(void)
 
 	if ((parse(&p, mesg1)) == NULL)
 		fail_test("Failed to parse message");
-	assert_strcmp(p.from,     "nick");
-	assert_strcmp(p.hostinfo, "user@hostname.domain");
-	assert_strcmp(p.command,  "CMD");
-	assert_strcmp(p.params,   "args");
-	assert_strcmp(p.trailing, "trailing");
+	assert_strcmp(p.from,      "nick");
+	assert_strcmp(p.hostinfo,  "user@hostname.domain");
+	assert_strcmp(p.command,   "CMD");
+	assert_strcmp(p.params[0], "args");
+	assert_strcmp(p.params[1], "trailing");
+	assert_strcmp(p.params[2], NULL);
+	assert_strcmp(p.trailing,  "trailing");
+	assert_equals((int)p.n_params, 2);
+	assert_equals((int)p.lens[0], 4);
+	assert_equals((int)p.lens[1], 8);
 
 	/* Test no nick/host */
-	char mesg2[] = "CMD arg1 arg2 :  trailing message  ";
+	char mesg2[] = "CMD arg1  arg2 :  trailing message  ";
 
 	if ((parse(&p, mesg2)) == NULL)
 		fail_test("Failed to parse message");
-	assert_strcmp(p.from,     NULL);
-	assert_strcmp(p.hostinfo, NULL);
-	assert_strcmp(p.command,  "CMD");
-	assert_strcmp(p.params,   "arg1 arg2");
-	assert_strcmp(p.trailing, "  trailing message  ");
+	assert_strcmp(p.from,      NULL);
+	assert_strcmp(p.hostinfo,  NULL);
+	assert_strcmp(p.command,   "CMD");
+	assert_strcmp(p.params[0], "arg1");
+	assert_strcmp(p.params[1], "arg2");
+	assert_strcmp(p.trailing,  "  trailing message  ");
+	assert_equals((int)p.n_params, 3);
+	assert_equals((int)p.lens[2], 20);
 
 	/* Test the 15 arg limit */
 	char mesg3[] = "CMD a1 a2 a3 a4 a5 a6 a7 a8 a9 a10 a11 a12 a13 a14 a15 :trailing message";
 
 	if ((parse(&p, mesg3)) == NULL)
 		fail_test("Failed to parse message");
-	assert_strcmp(p.from,     NULL);
-	assert_strcmp(p.hostinfo, NULL);
-	assert_strcmp(p.command,  "CMD");
-	assert_strcmp(p.params,   "a1 a2 a3 a4 a5 a6 a7 a8 a9 a10 a11 a12 a13 a14");
-	assert_strcmp(p.trailing, "a15 :trailing message");
+	assert_strcmp(p.from,       NULL);
+	assert_strcmp(p.hostinfo,   NULL);
+	assert_strcmp(p.command,    "CMD");
+	assert_strcmp(p.params[0],  "a1");
+	assert_strcmp(p.params[13], "a14");
+	assert_strcmp(p.params[14], "a15 :trailing message");
+	assert_strcmp(p.trailing,   "a15 :trailing message");
+	assert_equals((int)p.n_params, 15);
 
 	/* Test ':' can exist in args */
 	char mesg4[] = ":nick!user@hostname.domain CMD arg:1:2:3 arg:4:5:6 :trailing message";
 
 	if ((parse(&p, mesg4)) == NULL)
 		fail_test("Failed to parse message");
-	assert_strcmp(p.from,     "nick");
-	assert_strcmp(p.hostinfo, "user@hostname.domain");
-	assert_strcmp(p.command,  "CMD");
-	assert_strcmp(p.params,   "arg:1:2:3 arg:4:5:6");
-	assert_strcmp(p.trailing, "trailing message");
-
-	/* Test no args */
+	assert_strcmp(p.from,      "nick");
+	assert_strcmp(p.hostinfo,  "user@hostname.domain");
+	assert_strcmp(p.command,   "CMD");
+	assert_strcmp(p.params[0], "arg:1:2:3");
+	assert_strcmp(p.params[1], "arg:4:5:6");
+	assert_strcmp(p.trailing,  "trailing message");
+
+	/* Test no args, e.g. JOIN :#chan */
 	char mesg5[] = ":nick!user@hostname.domain CMD :trailing message";
 
 	if ((parse(&p, mesg5)) == NULL)
 		fail_test("Failed to parse message");
-	assert_strcmp(p.from,     "nick");
-	assert_strcmp(p.hostinfo, "user@hostname.domain");
-	assert_strcmp(p.command,  "CMD");
-	assert_strcmp(p.params,   NULL);
-	assert_strcmp(p.trailing, "trailing message");
+	assert_strcmp(p.from,      "nick");
+	assert_strcmp(p.hostinfo,  "user@hostname.domain");
+	assert_strcmp(p.command,   "CMD");
+	assert_strcmp(p.params[0], "trailing message");
+	assert_strcmp(p.trailing,  "trailing message");
+	assert_equals((int)p.n_params, 1);
 
 	/* Test no trailing */
 	char mesg6[] = ":nick!user@hostname.domain CMD arg1 arg2 arg3";
 
 	if ((parse(&p, mesg6)) == NULL)
 		fail_test("Failed to parse message");
-	assert_strcmp(p.from,     "nick");
-	assert_strcmp(p.hostinfo, "user@hostname.domain");
-	assert_strcmp(p.command,  "CMD");
-	assert_strcmp(p.params,   "arg1 arg2 arg3");
-	assert_strcmp(p.trailing, NULL);
+	assert_strcmp(p.from,      "nick");
+	assert_strcmp(p.hostinfo,  "user@hostname.domain");
+	assert_strcmp(p.command,   "CMD");
+	assert_strcmp(p.params[2], "arg3");
+	assert_strcmp(p.trailing,  NULL);
+	assert_equals((int)p.n_params, 3);
 
 	/* Test no user */
 	char mesg7[] = ":nick@hostname.domain CMD arg1 arg2 arg3";
@@ -281,19 +385,100 @@ test_parse(void)
 	assert_strcmp(p.from,     "nick");
 	assert_strcmp(p.hostinfo, "hostname.domain");
 	assert_strcmp(p.command,  "CMD");
-	assert_strcmp(p.params,   "arg1 arg2 arg3");
-	assert_strcmp(p.trailing, NULL);
+
+	/* Test empty trailing */
+	char mesg8[] = "CMD arg1 :";
+
+	if ((parse(&p, mesg8)) == NULL)
+		fail_test("Failed to parse message");
+	assert_strcmp(p.params[1], "");
+	assert_strcmp(p.trailing,  "");
+	assert_equals((int)p.n_params, 2);
+
+	/* Test no params */
+	char mesg9[] = ":nick CMD";
+
+	if ((parse(&p, mesg9)) == NULL)
+		fail_test("Failed to parse message");
+	assert_strcmp(p.command,   "CMD");
+	assert_strcmp(p.params[0], NULL);
+	assert_equals((int)p.n_params, 0);
 
 	/* Error: empty message */
-	char mesg8[] = "";
+	char mesg10[] = "";
 
-	if ((parse(&p, mesg8)) != NULL)
+	if ((parse(&p, mesg10)) != NULL)
 		fail_test("parse() was expected to fail");
 
 	/* Error: no command */
-	char mesg9[] = ":nick!user@hostname.domain";
+	char mesg11[] = ":nick!user@hostname.domain";
+
+	if ((parse(&p, mesg11)) != NULL)
+		fail_test("parse() was expected to fail");
+}
+
+void
+test_parse_tags(void)
+{
+	/* Test parsing IRCv3 message tags */
+
+	parsed_mesg p;
+
+	/* Test tags with prefix */
+	char mesg1[] = "@time=2017-01-01T00:00:00.000Z;msgid=abc;+example.com/x :nick!user@host CMD arg :trailing";
+
+	if ((parse(&p, mesg1)) == NULL)
+		fail_test("Failed to parse message");
+	assert_strcmp(p.from,     "nick");
+	assert_strcmp(p.command,  "CMD");
+	assert_strcmp(p.trailing, "trailing");
+	assert_equals((int)p.n_tags, 3);
+	assert_strcmp(p.tags[0].key, "time");
+	assert_strcmp(p.tags[2].key, "+example.com/x");
+	assert_strcmp(tag_value(&p.tags[2]), "");
+	assert_strcmp(tag_value(p.known[TAG_TIME]), "2017-01-01T00:00:00.000Z");
+	assert_strcmp(tag_value(p.known[TAG_MSGID]), "abc");
+
+	if (p.known[TAG_BATCH] || p.known[TAG_LABEL] || p.known[TAG_ACCOUNT])
+		fail_test("Unexpected known tag");
+
+	if (tag_get(&p, "+example.com/x") != &p.tags[2] || tag_get(&p, "x"))
+		fail_test("tag_get returned the wrong tag");
+
+	/* Test escaped values are unescaped when read, and repeated keys */
+	char mesg2[] = "@a=\\\\:\\s\\:\\r\\n\\x;label=1;;label=2;b=c\\ CMD";
+
+	if ((parse(&p, mesg2)) == NULL)
+		fail_test("Failed to parse message");
+	assert_strcmp(p.command, "CMD");
+	assert_equals((int)p.n_params, 0);
+	assert_equals((int)p.n_tags, 4);
+	assert_strcmp(p.tags[0].val, "\\\\:\\s\\:\\r\\n\\x");
+	assert_strcmp(tag_value(&p.tags[0]), "\\: ;\r\nx");
+	assert_strcmp(tag_value(&p.tags[0]), "\\: ;\r\nx");
+	assert_strcmp(tag_value(&p.tags[3]), "c");
+	assert_strcmp(tag_value(p.known[TAG_LABEL]), "2");
+	assert_strcmp(tag_value(tag_get(&p, "label")), "2");
+
+	/* Test tags are reset between messages */
+	char mesg3[] = "CMD";
+
+	if ((parse(&p, mesg3)) == NULL)
+		fail_test("Failed to parse message");
+	assert_equals((int)p.n_tags, 0);
 
-	if ((parse(&p, mesg9)) != NULL)
+	if (p.known[TAG_LABEL] || tag_get(&p, "label"))
+		fail_test("Unexpected tag");
+
+	/* Error: tags with no command */
+	char mesg4[] = "@time=0";
+
+	if ((parse(&p, mesg4)) != NULL)
+		fail_test("parse() was expected to fail");
+
+	char mesg5[] = "@time=0 :nick";
+
+	if ((parse(&p, mesg5)) != NULL)
 		fail_test("parse() was expected to fail");
 }
 
@@ -306,31 +491,77 @@ test_check_pinged(void)
 
 	/* Test message contains username */
 	char *mesg1 = "testing testnick testing";
-	assert_equals(check_pinged(mesg1, nick), 1);
+	assert_equals(check_pinged(mesg1, nick, casemap_rfc1459), 1);
 
 	/* Test common way of addressing messages to users */
 	char *mesg2 = "testnick: testing";
-	assert_equals(check_pinged(mesg2, nick), 1);
+	assert_equals(check_pinged(mesg2, nick, casemap_rfc1459), 1);
 
 	/* Test non-nick char prefix */
 	char *mesg3 = "testing !@#testnick testing";
-	assert_equals(check_pinged(mesg3, nick), 1);
+	assert_equals(check_pinged(mesg3, nick, casemap_rfc1459), 1);
 
 	/* Test non-nick char suffix */
 	char *mesg4 = "testing testnick!@#$ testing";
-	assert_equals(check_pinged(mesg4, nick), 1);
+	assert_equals(check_pinged(mesg4, nick, casemap_rfc1459), 1);
 
 	/* Test non-nick char prefix and suffix */
 	char *mesg5 = "testing !testnick! testing";
-	assert_equals(check_pinged(mesg5, nick), 1);
+	assert_equals(check_pinged(mesg5, nick, casemap_rfc1459), 1);
 
 	/* Error: message doesn't contain username */
 	char *mesg6 = "testing testing";
-	assert_equals(check_pinged(mesg6, nick), 0);
+	assert_equals(check_pinged(mesg6, nick, casemap_rfc1459), 0);
 
 	/* Error: message contains username prefix */
 	char *mesg7 = "testing testnickshouldfail testing";
-	assert_equals(check_pinged(mesg7, nick), 0);
+	assert_equals(check_pinged(mesg7, nick, casemap_rfc1459), 0);
+
+	/* Error: message ends in non-nick chars */
+	char *mesg8 = "testing !@#";
+	assert_equals(check_pinged(mesg8, nick, casemap_rfc1459), 0);
+
+	/* Test nick matched by the server's case mapping only */
+	char *mesg9 = "TEST{NICK}: testing";
+	assert_equals(check_pinged(mesg9, "test[nick]", casemap_rfc1459), 1);
+	assert_equals(check_pinged(mesg9, "test[nick]", casemap_ascii), 0);
+}
+
+void
+test_casemap(void)
+{
+	/* Test case mappings fold and order strings, and hash folded strings */
+
+	avl_node *root = NULL;
+
+	assert_equals(casemap_cmp(casemap_ascii, "Nick", "nICK"), 0);
+	assert_true(casemap_cmp(casemap_ascii, "nick[a]", "NICK{A}") < 0);
+
+	assert_equals(casemap_cmp(casemap_rfc1459, "nick[a]\\^", "NICK{A}|~"), 0);
+	assert_equals(casemap_cmp(casemap_strict_rfc1459, "nick[a]\\", "NICK{A}|"), 0);
+	assert_true(casemap_cmp(casemap_strict_rfc1459, "^", "~") < 0);
+
+	assert_true(casemap_cmp(casemap_rfc1459, "a", "B") < 0);
+	assert_true(casemap_cmp(casemap_rfc1459, "ab", "A") > 0);
+	assert_true(casemap_cmp(casemap_rfc1459, "", "a") < 0);
+
+	assert_equals(casemap_ncmp(casemap_rfc1459, "NICK[name", "nick{", 5), 0);
+	assert_true(casemap_ncmp(casemap_rfc1459, "NICK[name", "nick{", 6) > 0);
+
+	assert_true(casemap_hash(casemap_rfc1459, "Nick[a]") == casemap_hash(casemap_rfc1459, "nICK{A}"));
+	assert_true(casemap_hash(casemap_ascii, "Nick[a]") != casemap_hash(casemap_ascii, "nICK{A}"));
+
+	/* AVL trees are ordered by a case mapping */
+	if (!avl_add(&root, "nick[a]", NULL, casemap_rfc1459))
+		fail_test("avl_add() failed to add 'nick[a]'");
+
+	if (avl_add(&root, "NICK{A}", NULL, casemap_rfc1459))
+		fail_test("avl_add() failed to detect duplicate 'NICK{A}'");
+
+	if (!avl_get(root, "Nick{", 5, casemap_rfc1459))
+		fail_test("avl_get() failed to find 'nick[a]'");
+
+	free_avl(root);
 }
 
 void
@@ -457,12 +688,125 @@ test_word_wrap(void)
 		fail_test("seg1 should be advanced to end of string");
 }
 
+static void
+test_str_intern(void)
+{
+	/* Test interned strings are shared until their last reference is released */
+
+	char buf[] = "nick", *s1, *s2, *s3;
+
+	s1 = str_intern("nick");
+	s2 = str_intern(buf);
+	s3 = str_intern("Nick");
+
+	assert_true(s1 == s2);
+	assert_true(s1 != s3);
+	assert_true(s1 != buf);
+	assert_strcmp(s1, "nick");
+
+	assert_true(str_ref(s1) == s1);
+
+	str_release(s1);
+	str_release(s2);
+
+	assert_true(hmap_get(&istrs, "nick") != NULL);
+
+	str_release(s1);
+
+	assert_null(hmap_get(&istrs, "nick"));
+
+	str_release(s3);
+	str_release(NULL);
+
+	assert_null(hmap_get(&istrs, "Nick"));
+}
+
+static void
+test_hmap(void)
+{
+	/* Test hash map functions */
+
+	char keys[1000][8];
+	int i, vals[1000];
+	struct hmap h = {0};
+
+	assert_null(hmap_get(&h, "a"));
+	assert_null(hmap_del(&h, "a"));
+
+	for (i = 0; i < 1000; i++) {
+		snprintf(keys[i], sizeof(keys[i]), "k%d", i);
+		vals[i] = i;
+
+		if (!hmap_add(&h, keys[i], &vals[i]))
+			fail_testf("hmap_add() failed to add %s", keys[i]);
+	}
+
+	assert_equals((int)h.n, 1000);
+
+	/* Table is kept at most 3/4 full */
+	if (h.n * 4 > h.size * 3)
+		fail_testf("hmap size %zu, %zu entries", h.size, h.n);
+
+	if (hmap_add(&h, "k10", NULL))
+		fail_test("hmap_add() failed to detect duplicate 'k10'");
+
+	/* Delete every other key, the rest must remain reachable past the gaps */
+	for (i = 0; i < 1000; i += 2) {
+		if (hmap_del(&h, keys[i]) != &vals[i])
+			fail_testf("hmap_del() failed to delete %s", keys[i]);
+	}
+
+	assert_equals((int)h.n, 500);
+
+	for (i = 0; i < 1000; i++) {
+		if (hmap_get(&h, keys[i]) != ((i % 2) ? &vals[i] : NULL))
+			fail_testf("hmap_get() returned wrong value for %s", keys[i]);
+	}
+
+	/* Re-add the deleted keys */
+	for (i = 0; i < 1000; i += 2) {
+		if (!hmap_add(&h, keys[i], &vals[i]))
+			fail_testf("hmap_add() failed to re-add %s", keys[i]);
+	}
+
+	for (i = 0; i < 1000; i++) {
+		if (hmap_get(&h, keys[i]) != &vals[i])
+			fail_testf("hmap_get() returned wrong value for %s", keys[i]);
+	}
+
+	hmap_free(&h);
+
+	assert_null(hmap_get(&h, "k1"));
+
+	/* Keys folded by a case mapping */
+	h.map = casemap_rfc1459;
+
+	if (!hmap_add(&h, "#Chan[a]", &vals[0]))
+		fail_test("hmap_add() failed to add '#Chan[a]'");
+
+	if (hmap_add(&h, "#CHAN{A}", NULL))
+		fail_test("hmap_add() failed to detect duplicate '#CHAN{A}'");
+
+	if (hmap_get(&h, "#chan{a}") != &vals[0] || hmap_get(&h, "#chan[b]"))
+		fail_test("hmap_get() failed to fold keys");
+
+	if (hmap_del(&h, "#chan{A}") != &vals[0])
+		fail_test("hmap_del() failed to delete '#chan{A}'");
+
+	hmap_free(&h);
+}
+
 int
 main(void)
 {
 	testcase tests[] = {
 		TESTCASE(test_avl),
+		TESTCASE(test_avl_merge),
+		TESTCASE(test_casemap),
+		TESTCASE(test_hmap),
+		TESTCASE(test_str_intern),
 		TESTCASE(test_parse),
+		TESTCASE(test_parse_tags),
 		TESTCASE(test_getarg),
 		TESTCASE(test_check_pinged),
 		TESTCASE(test_word_wrap)